@@ -0,0 +1,754 @@
+#include "Batch.h"
+
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QImageReader>
+
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+//
+// Parameters used by the main window for the Hough transformation
+const int HOUGH_ALPHA_PRECISION = 180;
+const int HOUGH_TRESHOLD = 100;
+const int HOUGH_MAXIMAS = 9;
+const int HOUGH_LINE_COLOR = 0xff0000;
+
+//
+// Weakest gradient the closure of contours goes through, as in the main window
+const int CONTOUR_MIN_GRADIENT = 20;
+
+const char* DEFAULT_DEFINITIONS = "Data/filters.xml";
+
+double ElapsedMilliseconds(const QElapsedTimer& timer)
+{
+	return timer.nsecsElapsed() / 1000000.0;
+}
+
+//
+// Duration of a step, followed by the number of buffers the pool had to allocate for it if any
+void WriteStep(std::ostringstream& steps, double milliseconds, uint64_t allocations)
+{
+	steps << milliseconds << " ms";
+	if(allocations > 0)
+	{
+		steps << " (+" << allocations << " buffers)";
+	}
+}
+
+//
+// Report of a result file that could not be written
+std::string WriteError(const QString& file)
+{
+	return "cannot write " + QDir::toNativeSeparators(file).toStdString();
+}
+
+//
+// One line per row: rho theta votes, strongest lines first
+bool SaveLines(const std::vector<Convolution::HoughLine>& lines, const QString& file)
+{
+	std::ofstream stream(file.toStdString().c_str());
+	for(uint32_t i = 0; i < lines.size() && stream; ++i)
+	{
+		stream << lines[i].rho << ' ' << lines[i].theta << ' ' << lines[i].votes << '\n';
+	}
+	return (bool)stream;
+}
+
+//
+// 8-connected components of a gray scale image, one per row: label area left top right bottom centroid x and y
+bool SaveComponents(const Convolution::Image& image, uint32_t threadCount, const QString& file)
+{
+	if(image.format != Convolution::Image::Format::Indexed8)
+	{
+		return false;
+	}
+	std::vector<uint32_t> labels;
+	std::vector<Convolution::Component> components;
+	Convolution::LabelComponents(image, labels, components, true, threadCount);
+	std::ofstream stream(file.toStdString().c_str());
+	for(uint32_t i = 0; i < components.size() && stream; ++i)
+	{
+		const Convolution::Component& component = components[i];
+		stream << (i + 1) << ' ' << component.area << ' ' << component.left << ' ' << component.top << ' ' << component.right << ' ' << component.bottom << ' '
+			   << component.centroidX << ' ' << component.centroidY << '\n';
+	}
+	return (bool)stream;
+}
+
+Batch::Batch(void)
+	: m_outputDirectory("Out")
+	, m_saveAccumulator(false)
+	, m_saveLines(false)
+	, m_saveComponents(false)
+	, m_jobs(1)
+	, m_threadsPerFile(1)
+	, m_filters(Convolution::DefaultFilters())
+	, m_pipeline(nullptr)
+{
+
+}
+
+/*virtual*/ Batch::~Batch(void)
+{
+	for(std::map<std::string, Convolution::Filter>::iterator it = m_filters.begin(); it != m_filters.end(); ++it)
+	{
+		delete [] it->second.kernel;
+	}
+	for(std::map<std::string, Convolution::CompiledFilter*>::iterator it = m_compiledFilters.begin(); it != m_compiledFilters.end(); ++it)
+	{
+		delete it->second;
+	}
+	for(std::map<std::string, Pipeline*>::iterator it = m_pipelines.begin(); it != m_pipelines.end(); ++it)
+	{
+		delete it->second;
+	}
+}
+
+/*static*/ bool Batch::IsRequested(int argc, char* argv[])
+{
+	for(int i = 1; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "--batch") == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/*static*/ void Batch::Usage(void)
+{
+	std::cerr
+		<< "Usage: ImageAnalysis --batch [options] [operations] <file or directory>..." << std::endl
+		<< std::endl
+		<< "Operations are applied in the order they are given:" << std::endl
+		<< "  --gray                 Convert to gray scale" << std::endl
+		<< "  --filter <name>        Apply a filter, the result becomes the gradient" << std::endl
+		<< "  --multi <name>         Apply a filter as a multiconvolution" << std::endl
+		<< "  --threshold <min>      Simple threshold" << std::endl
+		<< "  --hysteresis <min> <max>" << std::endl
+		<< "                         Hysteresis threshold" << std::endl
+		<< "  --canny <min> <max>    Edges found by the Canny method, hysteresis threshold of its gradient" << std::endl
+		<< "  --refine               Thin the edges using the last gradient" << std::endl
+		<< "  --oriented-refine      Thin the edges using the last gradient, comparing the edge pixels along the" << std::endl
+		<< "                         gradient direction of the original image only" << std::endl
+		<< "  --close <gap>          Close the gaps of up to <gap> pixels at the ends of the contours, along the" << std::endl
+		<< "                         last gradient" << std::endl
+		<< "  --hough                Draw the lines found by the Hough transformation" << std::endl
+		<< "  --oriented-hough <degrees>" << std::endl
+		<< "                         Hough transformation where edge pixels only vote for the angles within" << std::endl
+		<< "                         <degrees> of the gradient direction of the original image" << std::endl
+		<< "  --probabilistic-hough <samples>" << std::endl
+		<< "                         Probabilistic Hough transformation, at most <samples> edge pixels vote" << std::endl
+		<< "  --hough-circles <min> <max>" << std::endl
+		<< "                         Draw the circles of radius in [<min>, <max>] found by the Hough transformation" << std::endl
+		<< "  --pipeline <name>      Run a pipeline of the definition file instead, every output step is saved" << std::endl
+		<< std::endl
+		<< "Options:" << std::endl
+		<< "  --definitions <file>   Load filters and pipelines (default for pipelines: " << DEFAULT_DEFINITIONS << ")" << std::endl
+		<< "  --output <directory>   Where results are written (default: Out), named after the input files, whose" << std::endl
+		<< "                         names without extension must differ" << std::endl
+		<< "  --jobs <count>         Files processed at once (default: one per core)" << std::endl
+		<< "  --accumulator          Also save the Hough accumulator of each file" << std::endl
+		<< "  --lines                Also save the lines found by the Hough transformation, as rho theta votes" << std::endl
+		<< "  --components           Also save the connected components of gray scale results, as label area" << std::endl
+		<< "                         left top right bottom and centroid" << std::endl
+		<< std::endl
+		<< "Built-in filters:";
+	std::map<std::string, Convolution::Filter> filters = Convolution::DefaultFilters();
+	for(std::map<std::string, Convolution::Filter>::iterator it = filters.begin(); it != filters.end(); ++it)
+	{
+		std::cerr << " \"" << it->first << "\"";
+		delete [] it->second.kernel;
+	}
+	std::cerr << std::endl;
+}
+
+bool Batch::Parse(const QStringList& arguments)
+{
+	int jobs = 0;
+	std::string pipeline;
+	for(int i = 1; i < arguments.size(); ++i)
+	{
+		const QString& argument = arguments[i];
+		int values = 0;
+		if(argument == "--filter" || argument == "--multi" || argument == "--threshold" || argument == "--output" || argument == "--jobs" ||
+		   argument == "--definitions" || argument == "--pipeline" || argument == "--oriented-hough" ||
+		   argument == "--probabilistic-hough" || argument == "--close")
+		{
+			values = 1;
+		}
+		else if(argument == "--hysteresis" || argument == "--canny" || argument == "--hough-circles")
+		{
+			values = 2;
+		}
+		if(i + values >= arguments.size())
+		{
+			std::cerr << "Missing value for " << argument.toStdString() << std::endl;
+			return false;
+		}
+
+		Operation operation = { Operation::Type::GrayScale, std::string(), 0, 0, 0, 0, 0, 0, 0 };
+		bool valid = true;
+		if(argument == "--batch")
+		{
+			continue;
+		}
+		else if(argument == "--help")
+		{
+			return false;
+		}
+		else if(argument == "--output")
+		{
+			m_outputDirectory = arguments[++i];
+		}
+		else if(argument == "--jobs")
+		{
+			jobs = arguments[++i].toInt(&valid);
+			valid = valid && jobs >= 0;
+		}
+		else if(argument == "--accumulator")
+		{
+			m_saveAccumulator = true;
+		}
+		else if(argument == "--lines")
+		{
+			m_saveLines = true;
+		}
+		else if(argument == "--components")
+		{
+			m_saveComponents = true;
+		}
+		else if(argument == "--definitions")
+		{
+			if(!LoadDefinitions(arguments[++i]))
+			{
+				return false;
+			}
+		}
+		else if(argument == "--pipeline")
+		{
+			pipeline = arguments[++i].toStdString();
+		}
+		else if(argument == "--gray")
+		{
+			m_operations.push_back(operation);
+		}
+		else if(argument == "--filter" || argument == "--multi")
+		{
+			operation.type = (argument == "--filter") ? Operation::Type::Filter : Operation::Type::MultiFilter;
+			operation.filter = arguments[++i].toStdString();
+			m_operations.push_back(operation);
+		}
+		else if(argument == "--threshold")
+		{
+			operation.type = Operation::Type::Treshold;
+			operation.tresholdMin = operation.tresholdMax = arguments[++i].toInt(&valid);
+			m_operations.push_back(operation);
+		}
+		else if(argument == "--hysteresis")
+		{
+			bool validMax = true;
+			operation.type = Operation::Type::Treshold;
+			operation.tresholdMin = arguments[++i].toInt(&valid);
+			operation.tresholdMax = arguments[++i].toInt(&validMax);
+			valid = valid && validMax && operation.tresholdMin <= operation.tresholdMax;
+			m_operations.push_back(operation);
+		}
+		else if(argument == "--canny")
+		{
+			bool validMax = true;
+			operation.type = Operation::Type::Canny;
+			operation.tresholdMin = arguments[++i].toInt(&valid);
+			operation.tresholdMax = arguments[++i].toInt(&validMax);
+			valid = valid && validMax && operation.tresholdMin <= operation.tresholdMax;
+			m_operations.push_back(operation);
+		}
+		else if(argument == "--refine" || argument == "--oriented-refine")
+		{
+			operation.type = (argument == "--refine") ? Operation::Type::Refine : Operation::Type::OrientedRefine;
+			m_operations.push_back(operation);
+		}
+		else if(argument == "--close")
+		{
+			operation.type = Operation::Type::CloseContours;
+			operation.gap = arguments[++i].toInt(&valid);
+			valid = valid && operation.gap > 0;
+			m_operations.push_back(operation);
+		}
+		else if(argument == "--hough")
+		{
+			operation.type = Operation::Type::Hough;
+			m_operations.push_back(operation);
+		}
+		else if(argument == "--oriented-hough")
+		{
+			operation.type = Operation::Type::Hough;
+			operation.angleWindow = arguments[++i].toInt(&valid);
+			valid = valid && operation.angleWindow > 0;
+			m_operations.push_back(operation);
+		}
+		else if(argument == "--probabilistic-hough")
+		{
+			operation.type = Operation::Type::Hough;
+			operation.samples = arguments[++i].toUInt(&valid);
+			valid = valid && operation.samples > 0;
+			m_operations.push_back(operation);
+		}
+		else if(argument == "--hough-circles")
+		{
+			bool validMax = true;
+			operation.type = Operation::Type::HoughCircles;
+			operation.minRadius = arguments[++i].toInt(&valid);
+			operation.maxRadius = arguments[++i].toInt(&validMax);
+			valid = valid && validMax && operation.minRadius > 0 && operation.minRadius <= operation.maxRadius;
+			m_operations.push_back(operation);
+		}
+		else if(argument.startsWith("--"))
+		{
+			std::cerr << "Unknown option " << argument.toStdString() << std::endl;
+			return false;
+		}
+		else if(!AddInput(argument))
+		{
+			return false;
+		}
+
+		if(!valid)
+		{
+			std::cerr << "Invalid value for " << argument.toStdString() << std::endl;
+			return false;
+		}
+	}
+
+	if(m_files.isEmpty())
+	{
+		std::cerr << "No image to process" << std::endl;
+		return false;
+	}
+
+	if(!pipeline.empty())
+	{
+		if(!m_operations.empty())
+		{
+			std::cerr << "A pipeline cannot be combined with other operations" << std::endl;
+			return false;
+		}
+		if(m_pipelines.empty() && !LoadDefinitions(DEFAULT_DEFINITIONS))
+		{
+			return false;
+		}
+		if(m_pipelines.count(pipeline) == 0)
+		{
+			std::cerr << "Unknown pipeline \"" << pipeline << "\"" << std::endl;
+			return false;
+		}
+		m_pipeline = m_pipelines[pipeline];
+	}
+
+	//
+	// Filters are compiled once every definition file has been loaded
+	for(uint32_t i = 0; i < m_operations.size(); ++i)
+	{
+		const std::string& filter = m_operations[i].filter;
+		if(filter.empty() || m_compiledFilters.count(filter) != 0)
+		{
+			continue;
+		}
+		if(m_filters.count(filter) == 0)
+		{
+			std::cerr << "Unknown filter \"" << filter << "\"" << std::endl;
+			return false;
+		}
+		m_compiledFilters[filter] = new Convolution::CompiledFilter(m_filters[filter]);
+	}
+
+	//
+	// Files are the unit of parallelism, the cores left over go to the filters of each file
+	uint32_t cores = Convolution::ThreadCount(0);
+	m_jobs = Convolution::ThreadCount(jobs);
+	if(m_jobs > (uint32_t)m_files.size())
+	{
+		m_jobs = m_files.size();
+	}
+	m_threadsPerFile = (cores > m_jobs) ? cores / m_jobs : 1;
+	return true;
+}
+
+int Batch::Run(void)
+{
+	if(!QDir().mkpath(m_outputDirectory))
+	{
+		std::cerr << "Cannot create output directory " << m_outputDirectory.toStdString() << std::endl;
+		return 1;
+	}
+
+	uint32_t count = m_files.size();
+	std::atomic<uint32_t> failures(0);
+	uint32_t done = 0;
+	double totalMilliseconds = 0.0;
+	QElapsedTimer timer;
+	timer.start();
+
+	//
+	// Each job pulls files until none is left, keeping its pipeline buffers from one file to the next
+	std::atomic<uint32_t> next(0);
+	Convolution::ParallelFor(m_jobs, 1, m_jobs, [&](uint32_t, uint32_t)
+	{
+		Pipeline::Context context;
+		for(uint32_t i = next++; i < count; i = next++)
+		{
+			QElapsedTimer fileTimer;
+			fileTimer.start();
+			std::string report;
+			bool success = ProcessFile(m_files[i], context, report);
+			double milliseconds = ElapsedMilliseconds(fileTimer);
+
+			std::lock_guard<std::mutex> lock(m_outputMutex);
+			std::ostream& out = success ? std::cout : std::cerr;
+			out << "[" << ++done << "/" << count << "] " << m_files[i].toStdString() << ": ";
+			if(success)
+			{
+				totalMilliseconds += milliseconds;
+				out << std::fixed << std::setprecision(1) << milliseconds << " ms (" << report << ")" << std::endl;
+			}
+			else
+			{
+				++failures;
+				out << report << std::endl;
+			}
+		}
+	});
+
+	Convolution::Pool::Counters counters = Convolution::Pool::TotalCounters();
+	std::cout << std::fixed << std::setprecision(1)
+			  << count - failures << " of " << count << " files processed in " << ElapsedMilliseconds(timer) << " ms"
+			  << " (" << totalMilliseconds << " ms of work, " << m_jobs << " jobs, " << m_threadsPerFile << " threads per file)" << std::endl
+			  << counters.allocations << " of " << counters.acquisitions << " image buffers allocated, "
+			  << counters.allocatedBytes / (1024.0 * 1024.0) << " MB" << std::endl;
+	return (failures == 0) ? 0 : 1;
+}
+
+bool Batch::LoadDefinitions(const QString& file)
+{
+	QString error;
+	if(!Pipeline::Load(file, m_filters, m_pipelines, error))
+	{
+		std::cerr << error.toStdString() << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool Batch::AddInput(const QString& path)
+{
+	QFileInfo info(path);
+	if(info.isDir())
+	{
+		QStringList nameFilters;
+		QList<QByteArray> formats = QImageReader::supportedImageFormats();
+		for(int i = 0; i < formats.size(); ++i)
+		{
+			nameFilters << QString("*.") + QString(formats[i]);
+		}
+		QFileInfoList entries = QDir(path).entryInfoList(nameFilters, QDir::Files, QDir::Name);
+		for(int i = 0; i < entries.size(); ++i)
+		{
+			if(!AddFile(entries[i].filePath()))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+	if(info.isFile())
+	{
+		return AddFile(path);
+	}
+	std::cerr << "No such file or directory " << path.toStdString() << std::endl;
+	return false;
+}
+
+//
+// Results are named after the input file without its extension, two inputs with the same name would
+// overwrite each other's results, concurrently when several jobs run. Names are compared ignoring case
+// for the file systems that do.
+bool Batch::AddFile(const QString& file)
+{
+	std::string name = QFileInfo(file).completeBaseName().toLower().toStdString();
+	std::map<std::string, QString>::const_iterator found = m_outputNames.find(name);
+	if(found != m_outputNames.end())
+	{
+		std::cerr << "Results of " << file.toStdString() << " and " << found->second.toStdString() << " would have the same name" << std::endl;
+		return false;
+	}
+	m_outputNames[name] = file;
+	m_files << file;
+	return true;
+}
+
+bool Batch::ProcessFile(const QString& file, Pipeline::Context& context, std::string& report)
+{
+	std::ostringstream steps;
+	steps << std::fixed << std::setprecision(1);
+	QElapsedTimer timer;
+	timer.start();
+	uint64_t allocations = Convolution::Pool::ThreadCounters().allocations;
+
+	Convolution::Image* original = Convolution::LoadImage(file.toStdString());
+	if(original == nullptr)
+	{
+		report = "cannot load image";
+		return false;
+	}
+	steps << "load ";
+	WriteStep(steps, ElapsedMilliseconds(timer), Convolution::Pool::ThreadCounters().allocations - allocations);
+
+	bool success = (m_pipeline != nullptr) ? RunPipeline(file, *original, context, steps, report) : RunOperations(file, original, steps, report);
+	if(success)
+	{
+		report = steps.str();
+	}
+	delete original;
+	return success;
+}
+
+bool Batch::RunOperations(const QString& file, Convolution::Image* original, std::ostringstream& steps, std::string& report)
+{
+	QElapsedTimer timer;
+
+	//
+	// Same chaining as the main window: filters produce the gradient used by refine
+	Convolution::Image* current = original;
+	Convolution::Image* gradient = nullptr;
+	Convolution::Image* accumulator = nullptr;
+	Convolution::Image* result = nullptr;
+	std::vector<Convolution::HoughLine> lines;
+	bool houghLines = false;
+	bool success = true;
+	for(uint32_t i = 0; i < m_operations.size() && success; ++i)
+	{
+		const Operation& operation = m_operations[i];
+		timer.start();
+		uint64_t allocations = Convolution::Pool::ThreadCounters().allocations;
+		result = nullptr;
+		switch(operation.type)
+		{
+		case Operation::Type::GrayScale:
+			result = Convolution::ToGrayScale(*current);
+			steps << ", gray ";
+			break;
+		case Operation::Type::Filter:
+		case Operation::Type::MultiFilter:
+			result = Convolution::ApplyFilter(*current, *m_compiledFilters[operation.filter], Convolution::Filter::SideHandle::Continuous, operation.type == Operation::Type::MultiFilter, m_threadsPerFile);
+			delete gradient;
+			gradient = Convolution::ToGrayScale(*result);
+			steps << ", " << (operation.type == Operation::Type::MultiFilter ? "multi" : "filter") << " \"" << operation.filter << "\" ";
+			break;
+		case Operation::Type::Treshold:
+			result = Convolution::Treshold(current, operation.tresholdMin, operation.tresholdMax, m_threadsPerFile);
+			steps << ", " << (operation.tresholdMin == operation.tresholdMax ? "threshold " : "hysteresis ");
+			break;
+		case Operation::Type::Canny:
+			result = new Convolution::Image();
+			Convolution::Canny(*current, operation.tresholdMin, operation.tresholdMax, *result, m_threadsPerFile);
+			steps << ", canny ";
+			break;
+		case Operation::Type::Refine:
+			if(gradient == nullptr)
+			{
+				report = "refine needs a filter to be applied first";
+				success = false;
+				break;
+			}
+			result = Convolution::Refine(*current, *gradient);
+			steps << ", refine ";
+			break;
+		case Operation::Type::OrientedRefine:
+		{
+			if(gradient == nullptr)
+			{
+				report = "oriented refine needs a filter to be applied first";
+				success = false;
+				break;
+			}
+			Convolution::Image orientation;
+			Convolution::Orientation(*original, orientation, m_threadsPerFile);
+			result = new Convolution::Image();
+			Convolution::Refine(*current, *gradient, orientation, *result, m_threadsPerFile);
+			steps << ", oriented refine ";
+			break;
+		}
+		case Operation::Type::CloseContours:
+		{
+			if(gradient == nullptr || current->format != Convolution::Image::Format::Indexed8)
+			{
+				report = "close needs a filter and a gray scale edge image";
+				success = false;
+				break;
+			}
+			Convolution::Contours contours;
+			Convolution::TraceContours(*current, gradient, contours, operation.gap, CONTOUR_MIN_GRADIENT);
+			result = new Convolution::Image(current->width, current->height);
+			memset(result->pixels, 0, (size_t)current->width * current->height);
+			Convolution::DrawContours(contours, *result, 0xffffff);
+			steps << ", close ";
+			break;
+		}
+		case Operation::Type::Hough:
+		{
+			if(current->format != Convolution::Image::Format::Indexed8)
+			{
+				report = "hough needs a gray scale edge image";
+				success = false;
+				break;
+			}
+			if(operation.samples > 0)
+			{
+				result = new Convolution::Image();
+				Convolution::ProbabilisticHough(*current, *original, *result, HOUGH_ALPHA_PRECISION, HOUGH_TRESHOLD, operation.samples, HOUGH_LINE_COLOR);
+				steps << ", probabilistic hough ";
+				break;
+			}
+			delete accumulator;
+			accumulator = m_saveAccumulator ? new Convolution::Image() : nullptr;
+			Convolution::Image orientation;
+			if(operation.angleWindow > 0)
+			{
+				Convolution::Orientation(*original, orientation, m_threadsPerFile);
+			}
+			Convolution::HoughLines(*current, lines, accumulator, HOUGH_ALPHA_PRECISION, HOUGH_TRESHOLD, HOUGH_MAXIMAS, m_threadsPerFile,
+									(operation.angleWindow > 0) ? &orientation : nullptr, operation.angleWindow);
+			houghLines = true;
+			result = new Convolution::Image(*original);
+			result->Detach();
+			Convolution::DrawHoughLines(lines, *result, HOUGH_LINE_COLOR);
+			steps << ", " << (operation.angleWindow > 0 ? "oriented hough " : "hough ");
+			break;
+		}
+		case Operation::Type::HoughCircles:
+		{
+			if(current->format != Convolution::Image::Format::Indexed8)
+			{
+				report = "hough needs a gray scale edge image";
+				success = false;
+				break;
+			}
+			Convolution::Image orientation;
+			Convolution::Orientation(*original, orientation, m_threadsPerFile);
+			std::vector<Convolution::HoughCircle> circles;
+			Convolution::HoughCircles(*current, orientation, circles, operation.minRadius, operation.maxRadius, HOUGH_TRESHOLD, HOUGH_MAXIMAS, m_threadsPerFile);
+			result = new Convolution::Image(*original);
+			result->Detach();
+			Convolution::DrawHoughCircles(circles, *result, HOUGH_LINE_COLOR);
+			steps << ", hough circles ";
+			break;
+		}
+		}
+		if(result != nullptr)
+		{
+			WriteStep(steps, ElapsedMilliseconds(timer), Convolution::Pool::ThreadCounters().allocations - allocations);
+			if(current != original)
+			{
+				delete current;
+			}
+			current = result;
+		}
+	}
+
+	if(success)
+	{
+		timer.start();
+		QString output = OutputPath(file, "");
+		success = Convolution::SaveImage(*current, output.toStdString());
+		if(success && m_saveAccumulator && accumulator != nullptr)
+		{
+			output = OutputPath(file, "_hough");
+			success = Convolution::SaveImage(*accumulator, output.toStdString());
+		}
+		if(success && m_saveLines && houghLines)
+		{
+			output = OutputPath(file, "_lines", ".txt");
+			success = SaveLines(lines, output);
+		}
+		if(success && m_saveComponents && current->format == Convolution::Image::Format::Indexed8)
+		{
+			output = OutputPath(file, "_components", ".txt");
+			success = SaveComponents(*current, m_threadsPerFile, output);
+		}
+		if(success)
+		{
+			steps << ", save " << ElapsedMilliseconds(timer) << " ms";
+		}
+		else
+		{
+			report = WriteError(output);
+		}
+	}
+
+	if(current != original)
+	{
+		delete current;
+	}
+	delete gradient;
+	delete accumulator;
+	return success;
+}
+
+//
+// Every output step of the pipeline is saved with the step name as suffix
+bool Batch::RunPipeline(const QString& file, const Convolution::Image& original, Pipeline::Context& context, std::ostringstream& steps, std::string& report)
+{
+	if(!m_pipeline->Run(original, context, m_threadsPerFile, report))
+	{
+		return false;
+	}
+
+	const std::vector<Pipeline::Step>& pipelineSteps = m_pipeline->Steps();
+	for(uint32_t i = 0; i < pipelineSteps.size(); ++i)
+	{
+		steps << ", " << pipelineSteps[i].name << " ";
+		WriteStep(steps, context.milliseconds[i], context.poolAllocations[i]);
+	}
+	QElapsedTimer timer;
+	timer.start();
+	for(uint32_t i = 0; i < pipelineSteps.size(); ++i)
+	{
+		QString suffix = "_" + QString::fromStdString(pipelineSteps[i].name);
+		QString output;
+		bool saved = true;
+		if(pipelineSteps[i].output)
+		{
+			output = OutputPath(file, suffix);
+			saved = Convolution::SaveImage(*context.results[i], output.toStdString());
+			if(saved && m_saveComponents && context.results[i]->format == Convolution::Image::Format::Indexed8)
+			{
+				output = OutputPath(file, suffix + "_components", ".txt");
+				saved = SaveComponents(*context.results[i], m_threadsPerFile, output);
+			}
+		}
+		if(saved && m_saveLines && pipelineSteps[i].operation == Pipeline::Step::Operation::Hough && pipelineSteps[i].samples == 0)
+		{
+			output = OutputPath(file, suffix + "_lines", ".txt");
+			saved = SaveLines(context.lines[i], output);
+		}
+		if(!saved)
+		{
+			report = WriteError(output);
+			return false;
+		}
+	}
+	steps << ", save " << ElapsedMilliseconds(timer) << " ms";
+	return true;
+}
+
+QString Batch::OutputPath(const QString& file, const QString& suffix, const QString& extension) const
+{
+	return QDir(m_outputDirectory).filePath(QFileInfo(file).completeBaseName() + suffix + extension);
+}
@@ -0,0 +1,86 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "Convolution.h"
+#include "Pipeline.h"
+
+#include <QString>
+#include <QStringList>
+
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//
+// Headless processing of a list of images through a chain of operations or a pipeline, one file per worker
+class Batch
+{
+
+public:
+
+	struct Operation
+	{
+		enum class Type
+		{
+			GrayScale,
+			Filter,
+			MultiFilter,
+			Treshold,
+			Canny,
+			Refine,
+			OrientedRefine,
+			CloseContours,
+			Hough,
+			HoughCircles
+		};
+
+		Type		type;
+		std::string	filter;
+		int			tresholdMin;	// Treshold and Canny
+		int			tresholdMax;
+		int			angleWindow;	// Hough, 0 to vote for every angle
+		uint32_t	samples;		// Hough, pixels voting in the probabilistic transformation, 0 for the standard one
+		int			minRadius;		// HoughCircles
+		int			maxRadius;
+		int			gap;			// CloseContours, longest gap closed
+	};
+
+	explicit	Batch		(void);
+	virtual		~Batch		(void);
+
+	static bool	IsRequested	(int argc, char* argv[]);
+	static void	Usage		(void);
+
+	bool		Parse		(const QStringList& arguments);
+	int			Run			(void);
+
+private:
+
+	bool		LoadDefinitions	(const QString& file);
+	bool		AddInput		(const QString& path);
+	bool		AddFile			(const QString& file);
+	bool		ProcessFile		(const QString& file, Pipeline::Context& context, std::string& report);
+	bool		RunOperations	(const QString& file, Convolution::Image* original, std::ostringstream& steps, std::string& report);
+	bool		RunPipeline		(const QString& file, const Convolution::Image& original, Pipeline::Context& context, std::ostringstream& steps, std::string& report);
+	QString		OutputPath		(const QString& file, const QString& suffix, const QString& extension = ".png") const;
+
+	std::vector<Operation>								m_operations;
+	QStringList											m_files;
+	std::map<std::string, QString>						m_outputNames;
+	QString												m_outputDirectory;
+	bool												m_saveAccumulator;
+	bool												m_saveLines;
+	bool												m_saveComponents;
+	uint32_t											m_jobs;
+	uint32_t											m_threadsPerFile;
+	std::map<std::string, Convolution::Filter>			m_filters;
+	std::map<std::string, Convolution::CompiledFilter*>	m_compiledFilters;
+	std::map<std::string, Pipeline*>					m_pipelines;
+	const Pipeline*										m_pipeline;
+	std::mutex											m_outputMutex;
+
+};
+
+#endif // BATCH_H
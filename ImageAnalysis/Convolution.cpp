@@ -1,894 +1,3407 @@
 #include "Convolution.h"
 
+#include <QApplication>
 #include <QImage>
 #include <QMessageBox>
 #include <QVector>
 
-/*static*/ Convolution::Image* Convolution::ApplyFilter(const Convolution::Image& image, const Convolution::Filter& filter, Convolution::Filter::SideHandle sideHandle, bool multi)
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+//
+// Amount of output data processed by a worker at once, small enough to keep a band and its source rows in cache
+const uint32_t BAND_BYTES = 64 * 1024;
+
+uint32_t BandHeight(uint32_t rowBytes)
 {
-	// Multiconvolution case
-	if(multi)
+	if(rowBytes == 0 || rowBytes >= BAND_BYTES)
 	{
-		Convolution::Image* out = new Convolution::Image();
-		out->format = image.format;
+		return 1;
+	}
+	return BAND_BYTES / rowBytes;
+}
 
-		if(sideHandle == Convolution::Filter::SideHandle::Crop)
-		{
-			out->width = (image.width - (filter.size - 1));
-			out->height = (image.height - (filter.size - 1));
-		}
-		else
-		{
-			out->width = image.width;
-			out->height = image.height;
-		}
-		uint32_t pixelSize = Convolution::PixelSize(image.format);
-		uint32_t imageSize = out->width * out->height * pixelSize;
-		out->pixels = new uint8_t[imageSize];
+//
+// Buffers are only freed when the pool would grow over its capacity or when it is cleared
+const size_t DEFAULT_POOL_CAPACITY = 256 * 1024 * 1024;
 
-		Convolution::Image* buffers[8];
-		buffers[0] = ApplyFilter(image, filter, sideHandle, false);
-		Convolution::Filter* rotated = Rotate(filter);
-		for(int i = 1; i < 8; ++i)
-		{
-			buffers[i] = ApplyFilter(image, *rotated, sideHandle, false);
-			if(i != 7)
-			{
-				Convolution::Filter* tmpFilter = rotated;
-				rotated = Rotate(*rotated);
-				delete tmpFilter;
-			}
-		}
-		delete rotated;
-		for(uint32_t i = 0; i < imageSize; ++i)
-		{
-			out->pixels[i] = 0;
-			for(uint32_t j = 0; j < 8; ++j)
-			{
-				if(buffers[j]->pixels[i] > out->pixels[i])
-				{
-					out->pixels[i] = buffers[j]->pixels[i];
-				}
-			}
-		}
-		for(uint32_t i = 0; i < 8; ++i)
-		{
-			delete buffers[i];
-		}
-		return out;
-	}
-	else
+struct PoolState
+{
+	PoolState(void)
+		: pooledBytes(0)
+		, capacity(DEFAULT_POOL_CAPACITY)
+		, acquisitions(0)
+		, allocations(0)
+		, allocatedBytes(0)
 	{
-		//
-		// Create new image
-		Convolution::Image* out = new Convolution::Image();
-		out->format = image.format;
 
-		uint32_t bufferWidth, bufferHeight;
-		uint8_t* buffer = nullptr;
+	}
 
-		uint32_t convStart;
+	~PoolState(void)
+	{
+		Clear();
+	}
 
-		//
-		// Select pixel size and fill indexed color tables
-		uint32_t pixelSize = Convolution::PixelSize(image.format);
-		if(image.format == Convolution::Image::Format::Indexed8)
+	void Clear(void)
+	{
+		for(std::map<size_t, std::vector<uint8_t*> >::iterator it = buffers.begin(); it != buffers.end(); ++it)
 		{
-			for(uint32_t i = 0; i < 256; ++i)
+			for(uint32_t i = 0; i < it->second.size(); ++i)
 			{
-				out->colorTable[i] = image.colorTable[i];
+				delete [] it->second[i];
 			}
+			it->second.clear();
 		}
+		pooledBytes = 0;
+	}
 
-		//
-		// Select buffer size and output image size
-		if(sideHandle == Convolution::Filter::SideHandle::Crop)
-		{
-			out->width = (image.width - (filter.size - 1));
-			out->height = (image.height - (filter.size - 1));
-			bufferWidth = image.width;
-			bufferHeight = image.height;
-			convStart = 0;
-		}
-		else
-		{
-			out->width = image.width;
-			out->height = image.height;
-			bufferWidth = image.width + filter.size - 1;
-			bufferHeight = image.height + filter.size - 1;
-			convStart = filter.size / 2;
-		}
+	std::mutex									mutex;
+	std::map<size_t, std::vector<uint8_t*> >	buffers;		// Free buffers by size, the vectors keep their capacity once warm
+	size_t										pooledBytes;
+	size_t										capacity;
+	std::atomic<uint64_t>						acquisitions;
+	std::atomic<uint64_t>						allocations;
+	std::atomic<uint64_t>						allocatedBytes;
+};
 
-		//
-		// Create buffers
-		buffer = new uint8_t[bufferWidth * bufferHeight * pixelSize];
-		out->pixels = new uint8_t[out->width * out->height * pixelSize];
+PoolState& GetPoolState(void)
+{
+	static PoolState state;
+	return state;
+}
 
-		//
-		// Copy image to buffer
-		for(uint32_t j = 0; j < image.height; ++j)
-		{
-			for(uint32_t i = 0; i < image.width; ++i)
-			{
-				for(uint32_t k = 0; k < pixelSize; ++k)
-				{
-					uint8_t pixelData = image.pixels[pixelSize * (i + j * image.width) + k];
-					buffer[pixelSize * (convStart + i + (j + convStart) * image.width) + k] = pixelData;
-				}
-			}
-		}
+thread_local Convolution::Pool::Counters threadPoolCounters = { 0, 0, 0 };
 
-		//
-		// Wrap sides according to side handle
-		if(sideHandle != Convolution::Filter::SideHandle::Crop)
+/*static*/ uint8_t* Convolution::Pool::Acquire(size_t bytes)
+{
+	if(bytes == 0)
+	{
+		return nullptr;
+	}
+	PoolState& state = GetPoolState();
+	++state.acquisitions;
+	++threadPoolCounters.acquisitions;
+	{
+		std::lock_guard<std::mutex> lock(state.mutex);
+		std::map<size_t, std::vector<uint8_t*> >::iterator it = state.buffers.find(bytes);
+		if(it != state.buffers.end() && !it->second.empty())
 		{
-			for(uint32_t j = 0; j < convStart; ++j)
-			{
-				for(uint32_t i = 0; i < image.width; ++i)
-				{
-					for(uint32_t k = 0; k < pixelSize; ++k)
-					{
-						switch(sideHandle)
-						{
-						case Convolution::Filter::SideHandle::Zeros:
-							buffer[pixelSize * (i + j * image.width) + k] = 0;
-							buffer[pixelSize * (i + (image.height + convStart + convStart - 1 - j) * image.width) + k] = 0;
-							break;
-						case Convolution::Filter::SideHandle::Black:
-							buffer[pixelSize * (i + j * image.width) + k] = 0;
-							buffer[pixelSize * (i + (image.height + convStart + convStart - 1 - j) * image.width) + k] = 0;
-							if(k == 0 && image.format == Convolution::Image::Format::ARGB)
-							{
-								buffer[pixelSize * (i + j * image.width) + k] = 0xff;
-								buffer[pixelSize * (i + (image.height + convStart + convStart - 1 - j) * image.width) + k] = 0xff;
-							}
-							break;
-						case Convolution::Filter::SideHandle::Ones:
-						case Convolution::Filter::SideHandle::White:
-							buffer[pixelSize * (i + j * image.width) + k] = 0xff;
-							buffer[pixelSize * (i + (image.height + convStart + convStart - 1 - j) * image.width) + k] = 0xff;
-							break;
-						case Convolution::Filter::SideHandle::Continuous:
-							buffer[pixelSize * (i + j * image.width) + k] = image.pixels[pixelSize * i + k];
-							buffer[pixelSize * (i + (image.height + convStart + convStart - 1 - j) * image.width) + k] = image.pixels[pixelSize * (i + (image.height - 1) * image.width) + k];
-							break;
-						case Convolution::Filter::SideHandle::Mirror:
-							buffer[pixelSize * (i + j * image.width) + k] = image.pixels[pixelSize * (i + (convStart - j) * image.width) + k];
-							buffer[pixelSize * (i + (image.height + convStart + convStart - 1 - j) * image.width) + k] = image.pixels[pixelSize * (i + (image.height - 1 - convStart + j) * image.width) + k];
-							break;
-						case Convolution::Filter::SideHandle::Repeat:
-							buffer[pixelSize * (i + j * image.width) + k] = image.pixels[pixelSize * (i + (image.height - 1 - convStart + j) * image.width) + k];
-							buffer[pixelSize * (i + (image.height + convStart + convStart - 1 - j) * image.width) + k] = image.pixels[pixelSize * (i + (convStart - j) * image.width) + k];
-							break;
-						default:
-							break;
-						}
-					}
-				}
-				uint32_t bufferHeight = image.height + convStart + convStart;
-				uint32_t bufferWidth = image.width + convStart + convStart;
-				for(uint32_t i = 0; i < bufferHeight; ++i)
-				{
-					for(uint32_t k = 0; k < pixelSize; ++k)
-					{
-						switch(sideHandle)
-						{
-						case Convolution::Filter::SideHandle::Zeros:
-							buffer[pixelSize * (j + i * image.width) + k] = 0;
-							buffer[pixelSize * ((bufferWidth - j - 1) + i * image.width) + k] = 0;
-							break;
-						case Convolution::Filter::SideHandle::Black:
-							buffer[pixelSize * (j + i * image.width) + k] = 0;
-							buffer[pixelSize * ((bufferWidth - j - 1) + i * image.width) + k] = 0;
-							if(k == 0 && image.format == Convolution::Image::Format::ARGB)
-							{
-								buffer[pixelSize * (j + i * image.width) + k] = 0xff;
-								buffer[pixelSize * ((bufferWidth - j - 1) + i * image.width) + k] = 0xff;
-							}
-							break;
-						case Convolution::Filter::SideHandle::Ones:
-						case Convolution::Filter::SideHandle::White:
-							buffer[pixelSize * (j + i * image.width) + k] = 0xff;
-							buffer[pixelSize * ((bufferWidth - j - 1) + i * image.width) + k] = 0xff;
-							break;
-						case Convolution::Filter::SideHandle::Continuous:
-							buffer[pixelSize * (j + i * image.width) + k] = buffer[pixelSize * (convStart + i * image.width) + k];
-							buffer[pixelSize * ((bufferWidth - j - 1) + i * image.width) + k] = buffer[pixelSize * (bufferWidth - 1 - convStart + i * image.width) + k];
-							break;
-						case Convolution::Filter::SideHandle::Mirror:
-							buffer[pixelSize * (j + i * image.width) + k] = buffer[pixelSize * (convStart + convStart - j + i * image.width) + k];
-							buffer[pixelSize * ((bufferWidth - j - 1) + i * image.width) + k] = buffer[pixelSize * (bufferWidth - 1 - convStart - convStart + j + i * image.width) + k];
-							break;
-						case Convolution::Filter::SideHandle::Repeat:
-							buffer[pixelSize * ((bufferWidth - j - 1) + i * image.width) + k] = buffer[pixelSize * (convStart + convStart - j + i * image.width) + k];
-							buffer[pixelSize * (j + i * image.width) + k] = buffer[pixelSize * (bufferWidth - 1 - convStart - convStart + j + i * image.width) + k];
-							break;
-						default:
-							break;
-						}
-					}
-				}
-			}
+			uint8_t* buffer = it->second.back();
+			it->second.pop_back();
+			state.pooledBytes -= bytes;
+			return buffer;
 		}
+	}
+	++state.allocations;
+	state.allocatedBytes += bytes;
+	++threadPoolCounters.allocations;
+	threadPoolCounters.allocatedBytes += bytes;
+	return new uint8_t[bytes];
+}
 
-		//
-		// Apply convolution
-		for(uint32_t j = 0; j < out->height; ++j)
+/*static*/ void Convolution::Pool::Release(uint8_t* buffer, size_t bytes)
+{
+	if(buffer == nullptr)
+	{
+		return;
+	}
+	PoolState& state = GetPoolState();
+	{
+		std::lock_guard<std::mutex> lock(state.mutex);
+		if(state.pooledBytes + bytes <= state.capacity)
 		{
-			for(uint32_t i = 0; i < out->width; ++i)
-			{
-				for(uint32_t k = 0; k < pixelSize; ++k)
-				{
-					double acc = 0.0;
-					double divisor = 0.0;
-					for(uint32_t x = 0; x < filter.size; ++x)
-					{
-						for(uint32_t y = 0; y < filter.size; ++y)
-						{
-							acc += buffer[pixelSize * ((i + x) + (j + y) * out->width) + k] * filter.kernel[x + y * filter.size];
-							divisor += fabs(filter.kernel[x + y * filter.size]);
-						}
-					}
-					if(filter.divisor == 0.0)
-					{
-						out->pixels[pixelSize * (i + j * out->width) + k] = (uint8_t)(acc / divisor);
-					}
-					else
-					{
-						out->pixels[pixelSize * (i + j * out->width) + k] = (uint8_t)(acc / filter.divisor);
-					}
-				}
-			}
+			state.buffers[bytes].push_back(buffer);
+			state.pooledBytes += bytes;
+			return;
 		}
-
-
-		//
-		// Clean temporaries and return result image
-		delete [] buffer;
-		return out;
 	}
+	delete [] buffer;
 }
 
-void PermuteMatrix(double* in, double* out, int size, int* permutation)
+/*static*/ void Convolution::Pool::Clear(void)
 {
-	for(int i = 0; i < size; ++i)
+	PoolState& state = GetPoolState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	state.Clear();
+}
+
+//
+// Buffers released while the pool is full are freed instead of being kept
+/*static*/ void Convolution::Pool::SetCapacity(size_t bytes)
+{
+	PoolState& state = GetPoolState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	state.capacity = bytes;
+	if(state.pooledBytes > bytes)
 	{
-		out[i] = in[permutation[i]];
+		state.Clear();
 	}
 }
 
-int perm3 [9] = {
-	3, 0, 1,
-	6, 4, 2,
-	7, 8, 5 };
+/*static*/ size_t Convolution::Pool::PooledBytes(void)
+{
+	PoolState& state = GetPoolState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	return state.pooledBytes;
+}
 
-int perm5 [25] = {
-	10,  5,  0,  1,  2,
-	15, 11,  6,  7,  3,
-	20, 16, 12,  8,  4,
-	21, 17, 18, 13,  9,
-	22, 23, 24, 19, 14 };
+/*static*/ Convolution::Pool::Counters Convolution::Pool::ThreadCounters(void)
+{
+	return threadPoolCounters;
+}
 
-int perm7 [49] = {
-	21, 14,  7,  0,  1,  2,  3,
-	28, 22, 15,  8,  9, 10,  4,
-	35, 29, 23, 16, 17, 11,  5,
-	42, 36, 30, 24, 18, 12,  6,
-	43, 37, 31, 32, 25, 19, 13,
-	44, 38, 39, 40, 33, 26, 20,
-	45, 46, 47, 48, 41, 34, 27 };
+/*static*/ Convolution::Pool::Counters Convolution::Pool::TotalCounters(void)
+{
+	PoolState& state = GetPoolState();
+	Convolution::Pool::Counters counters = { state.acquisitions, state.allocations, state.allocatedBytes };
+	return counters;
+}
 
-int perm9 [81] = {
-	21, 14,  7,  0,  1,  2,  3,
-	28, 22, 15,  8,  9, 10,  4,
-	35, 29, 23, 16, 17, 11,  5,
-	42, 36, 30, 24, 18, 12,  6,
-	43, 37, 31, 32, 25, 19, 13,
-	44, 38, 39, 40, 33, 26, 20,
-	45, 46, 47, 48, 41, 34, 27 };
+//
+// Add counters gathered on other threads to the calling thread
+/*static*/ void Convolution::Pool::Account(const Convolution::Pool::Counters& counters)
+{
+	threadPoolCounters.acquisitions += counters.acquisitions;
+	threadPoolCounters.allocations += counters.allocations;
+	threadPoolCounters.allocatedBytes += counters.allocatedBytes;
+}
 
+thread_local Convolution::Task* currentTask = nullptr;
 
-/*static*/ Convolution::Filter* Convolution::Rotate(const Convolution::Filter& filter)
+Convolution::Task::Task(void)
+	: cancelled(false)
+	, progress(0)
 {
-	Convolution::Filter* out = new Convolution::Filter();
-	out->divisor = filter.divisor;
-	out->size = filter.size;
-	out->kernel = new double[out->size * out->size];
-	switch(out->size)
-	{
-	case 1:
-		out->kernel[0] = filter.kernel[0];
-		break;
-	case 3:
-		PermuteMatrix(filter.kernel, out->kernel, 9, perm3);
-		break;
-	case 5:
-		PermuteMatrix(filter.kernel, out->kernel, 25, perm5);
-		break;
-	case 7:
-		PermuteMatrix(filter.kernel, out->kernel, 49, perm7);
-		break;
-	case 9:
-		PermuteMatrix(filter.kernel, out->kernel, 81, perm9);
-		break;
-	}
-	return out;
+
 }
 
-/*static*/ Convolution::Image* Convolution::Refine(const Convolution::Image& tresholded, const Convolution::Image& gradient)
+void Convolution::Task::Reset(void)
 {
-	Convolution::Image* out = new Convolution::Image(tresholded.width, tresholded.height, Convolution::Image::Format::Indexed8);
+	cancelled = false;
+	progress = 0;
+}
 
-	for(int j = 0; j < (int)out->height; ++j)
-	{
-		for(int i = 0; i < (int)out->width; ++i)
-		{
-			if(tresholded.pixels[(i + j * out->width)] != 0)
-			{
-				bool found = false;
-				for(int x = -1; x < 2 && !found; ++x)
-				{
-					for(int y = -1; y < 2 && !found; ++y)
-					{
-						if(i + x < 0 || i + x >= (int)out->width || j + y < 0 || j + y >= (int)out->height)
-						{
-							continue;
-						}
-						if(tresholded.pixels[(i + x) + (j + y) * out->width] != 0 && gradient.pixels[(i + x) + (j + y) * out->width] > gradient.pixels[i + j * out->width])
-						{
-							found = true;
-						}
-					}
-				}
-				if(found)
-				{
-					out->pixels[i + j * out->width] = 0;
-				}
-				else
-				{
-					out->pixels[i + j * out->width] = 255;
-				}
-			}
-		}
-	}
+void Convolution::Task::Cancel(void)
+{
+	cancelled = true;
+}
 
-	return out;
+bool Convolution::Task::IsCancelled(void) const
+{
+	return cancelled;
 }
 
-/*static*/ Convolution::Image* Convolution::ToGrayScale(const Convolution::Image& in)
+void Convolution::Task::SetProgress(uint32_t done, uint32_t total)
 {
-	Convolution::Image* out = new Convolution::Image(in.width, in.height, Convolution::Image::Format::Indexed8);
-	uint8_t gray = 0;
-	for(int j = 0; j < (int)out->height; ++j)
-	{
-		for(int i = 0; i < (int)out->width; ++i)
-		{
-			switch(in.format)
-			{
-			case Convolution::Image::Format::RGB:
-				gray = GrayScale(
-							in.pixels[(i + j * out->width) * 3],
-							in.pixels[(i + j * out->width) * 3 + 1],
-							in.pixels[(i + j * out->width) * 3 + 2]);
-				out->pixels[i + j * out->width] = gray;
-				break;
-			case Convolution::Image::Format::ARGB:
-				gray = GrayScale(
-							in.pixels[(i + j * out->width) * 4 + 1],
-							in.pixels[(i + j * out->width) * 4 + 2],
-							in.pixels[(i + j * out->width) * 4 + 3]);
-				out->pixels[i + j * out->width] = gray;
-				break;
-			case Convolution::Image::Format::Indexed8:
-				out->pixels[i + j * out->width] = in.pixels[i + j * out->width];
-				break;
-			}
-		}
-	}
-	return out;
+	progress = (total == 0) ? 1000 : (uint32_t)((uint64_t)done * 1000 / total);
 }
 
-void LoadRGB32(Convolution::Image** out, const QImage& in)
+uint32_t Convolution::Task::Progress(void) const
 {
-	*out = new Convolution::Image(in.width(), in.height(), Convolution::Image::Format::RGB);
-	const uchar* bits = in.constBits();
-	uint32_t size = (*out)->width * (*out)->height * 3;
-	for(uint32_t i = 0; i < size; ++i)
+	return progress;
+}
+
+/*static*/ Convolution::Task* Convolution::Task::Current(void)
+{
+	return currentTask;
+}
+
+/*static*/ void Convolution::Task::SetCurrent(Convolution::Task* task)
+{
+	currentTask = task;
+}
+
+//
+// Called by the serial loops for each row: reports the progress to the task of the thread, if any,
+// and returns false when the task was cancelled
+bool KeepRunning(uint32_t row, uint32_t rows)
+{
+	if(currentTask == nullptr)
 	{
-		(*out)->pixels[i] = bits[((i / 3) * 4) + 2 - (i % 3)];
+		return true;
 	}
+	currentTask->SetProgress(row, rows);
+	return !currentTask->IsCancelled();
 }
 
-void LoadARGB32(Convolution::Image** out, const QImage& in)
+//
+// Cancellation check for the loops run by ParallelFor, which reports the progress itself
+bool Cancelled(void)
 {
-	*out = new Convolution::Image(in.width(), in.height(), Convolution::Image::Format::ARGB);
-	const uchar* bits = in.constBits();
-	uint32_t size = (*out)->width * (*out)->height * 4;
-	memcpy((*out)->pixels, bits, size);
+	return currentTask != nullptr && currentTask->IsCancelled();
 }
 
-void LoadIndexed8(Convolution::Image** out, const QImage& in)
+/*static*/ uint32_t Convolution::ThreadCount(uint32_t threadCount)
 {
-	*out = new Convolution::Image(in.width(), in.height(), Convolution::Image::Format::Indexed8);
-	const uchar* bits = in.constBits();
-	uint32_t size = (*out)->width * (*out)->height;
-	memcpy((*out)->pixels, bits, size);
+	if(threadCount == 0)
+	{
+		threadCount = std::thread::hardware_concurrency();
+	}
+	return (threadCount == 0) ? 1 : threadCount;
 }
 
-/*static*/ Convolution::Image* Convolution::LoadImage(const std::string& file)
+/*static*/ void Convolution::ParallelFor(uint32_t count, uint32_t grain, uint32_t threadCount, const std::function<void(uint32_t begin, uint32_t end)>& body)
 {
-	Convolution::Image* out = nullptr;
-	
-	QImage in(file.c_str());
-
-	switch(in.format())
+	if(grain == 0)
 	{
-	case QImage::Format_RGB32:
-		LoadRGB32(&out, in);
-		break;
-	case QImage::Format_ARGB32:
-		LoadARGB32(&out, in);
-		break;
-	case QImage::Format_Indexed8:
-		LoadIndexed8(&out, in);
-		break;
-	default:
-		QMessageBox::warning(nullptr, QObject::tr("Unsupported format"), QObject::tr("The image format is not supported by application"), QMessageBox::Ok);
-		break;
+		grain = 1;
+	}
+	uint32_t chunks = (count + grain - 1) / grain;
+	threadCount = Convolution::ThreadCount(threadCount);
+	if(threadCount > chunks)
+	{
+		threadCount = chunks;
+	}
+	Convolution::Task* task = currentTask;
+	if(threadCount <= 1 && task == nullptr)
+	{
+		if(count > 0)
+		{
+			body(0, count);
+		}
+		return;
+	}
+	if(threadCount <= 1)
+	{
+		//
+		// Chunk by chunk so that the task can be cancelled in between
+		for(uint32_t chunk = 0; chunk < chunks && !task->IsCancelled(); ++chunk)
+		{
+			uint32_t begin = chunk * grain;
+			uint32_t end = (begin + grain < count) ? begin + grain : count;
+			body(begin, end);
+			task->SetProgress(chunk + 1, chunks);
+		}
+		return;
 	}
-	
-	return out;
-}
 
-/*static*/ QImage Convolution::ToQImage(const Convolution::Image& image)
-{
-	QImage out;
-	QVector<QRgb> colorTable(256);
-	uint32_t dimension = image.width * image.height;
-	uint32_t size = dimension * Convolution::PixelSize(image.format);
-	uchar* buffer = nullptr;
-	switch(image.format)
+	//
+	// Workers pull chunks until none is left or the task is cancelled, the calling thread works too.
+	// The pool counters of the workers, which start from zero, are accounted to the calling thread.
+	std::atomic<uint32_t> next(0);
+	std::atomic<uint32_t> done(0);
+	std::mutex countersMutex;
+	Convolution::Pool::Counters workerCounters = { 0, 0, 0 };
+	auto worker = [&](bool spawned)
 	{
-	case Convolution::Image::Format::RGB:
-		buffer = new uchar[dimension * 4];
-		for(uint32_t i = 0; i < dimension; ++i)
+		if(spawned)
 		{
-			buffer[i * 4 + 3] = 0xff;
+			currentTask = task;
 		}
-		for(uint32_t i = 0; i < size; ++i)
+		for(uint32_t chunk = next++; chunk < chunks && (task == nullptr || !task->IsCancelled()); chunk = next++)
 		{
-			buffer[((i / 3) * 4) + 2 - (i % 3)] = image.pixels[i];
+			uint32_t begin = chunk * grain;
+			uint32_t end = (begin + grain < count) ? begin + grain : count;
+			body(begin, end);
+			if(task != nullptr)
+			{
+				task->SetProgress(++done, chunks);
+			}
 		}
-		out = QImage(image.width, image.height, QImage::Format_RGB32);
-		memcpy(out.bits(), buffer, dimension * 4);
-		break;
-	case Convolution::Image::Format::ARGB:
-		buffer = new uchar[dimension * 4];
-		memcpy(buffer, image.pixels, size);
-		out = QImage(image.width, image.height, QImage::Format_ARGB32);
-		memcpy(out.bits(), buffer, dimension * 4);
-		break;
-	case Convolution::Image::Format::Indexed8:
-		buffer = new uchar[dimension];
-		memcpy(buffer, image.pixels, size);
-		out = QImage(image.width, image.height, QImage::Format_Indexed8);
-		memcpy(out.bits(), buffer, dimension);
-		for(uint32_t i = 0; i < 256; ++i)
+		if(spawned)
 		{
-			colorTable[i] = image.colorTable[i];
+			Convolution::Pool::Counters counters = Convolution::Pool::ThreadCounters();
+			std::lock_guard<std::mutex> lock(countersMutex);
+			workerCounters.acquisitions += counters.acquisitions;
+			workerCounters.allocations += counters.allocations;
+			workerCounters.allocatedBytes += counters.allocatedBytes;
 		}
-		out.setColorCount(256);
-		out.setColorTable(colorTable);
-		break;
+	};
+	std::vector<std::thread> threads;
+	for(uint32_t i = 1; i < threadCount; ++i)
+	{
+		threads.push_back(std::thread(worker, true));
 	}
-	delete buffer;
-	return out;
+	worker(false);
+	for(uint32_t i = 0; i < threads.size(); ++i)
+	{
+		threads[i].join();
+	}
+	Convolution::Pool::Account(workerCounters);
 }
 
-/*static*/ void Convolution::SaveImage(const Convolution::Image& image, const std::string& file)
+//
+// Scratch array drawn from the buffer pool and given back when it goes out of scope
+template<class T>
+struct PooledArray
 {
-	QImage out = ToQImage(image);
-	out.save(file.c_str());
+	explicit PooledArray(size_t count)
+		: size(count)
+		, data((T*)Convolution::Pool::Acquire(count * sizeof(T)))
+	{
+
+	}
+
+	~PooledArray(void)
+	{
+		Convolution::Pool::Release((uint8_t*)data, size * sizeof(T));
+	}
+
+	PooledArray(const PooledArray&) = delete;
+	PooledArray& operator=(const PooledArray&) = delete;
+
+	inline T& operator[](size_t i)
+	{
+		return data[i];
+	}
+
+	inline const T& operator[](size_t i) const
+	{
+		return data[i];
+	}
+
+	size_t	size;
+	T*		data;
+};
+
+//
+// Map a coordinate lying outside of the image onto the image according to the side handle.
+// Returns -1 when the side handle fills the border with a constant value.
+int32_t BorderCoordinate(int32_t p, int32_t n, Convolution::Filter::SideHandle sideHandle)
+{
+	if(p >= 0 && p < n)
+	{
+		return p;
+	}
+	switch(sideHandle)
+	{
+	case Convolution::Filter::SideHandle::Continuous:
+		return (p < 0) ? 0 : n - 1;
+	case Convolution::Filter::SideHandle::Mirror:
+		if(n == 1)
+		{
+			return 0;
+		}
+		while(p < 0 || p >= n)
+		{
+			p = (p < 0) ? -p : 2 * (n - 1) - p;
+		}
+		return p;
+	case Convolution::Filter::SideHandle::Repeat:
+		p %= n;
+		return (p < 0) ? p + n : p;
+	default:
+		return -1;
+	}
+}
+
+//
+// Value of a constant border channel
+uint8_t BorderConstant(Convolution::Filter::SideHandle sideHandle, Convolution::Image::Format format, uint32_t channel)
+{
+	switch(sideHandle)
+	{
+	case Convolution::Filter::SideHandle::Ones:
+	case Convolution::Filter::SideHandle::White:
+		return 0xff;
+	case Convolution::Filter::SideHandle::Black:
+		return (channel == 0 && format == Convolution::Image::Format::ARGB) ? 0xff : 0;
+	default:
+		return 0;
+	}
 }
 
-/*static*/ Convolution::Image* Convolution::Treshold(Convolution::Image* image, int tresholdMin, int tresholdMax)
+//
+// Virtual border of an image. The bordered image is never built: its rows and columns are looked up in remap tables.
+// Interior output columns read the image rows directly, edge columns read a few samples gathered through the tables.
+struct BorderLayout
 {
-	Convolution::Image* out = new Convolution::Image(image->width, image->height, Convolution::Image::Format::Indexed8);
-	int gray;
-	for(uint32_t j = 0; j < image->height; ++j)
+	BorderLayout(const Convolution::Image& source, uint32_t kernelSize, Convolution::Filter::SideHandle sideHandle, uint32_t width, uint32_t height)
+		: image(source)
+		, size(kernelSize)
+		, origin((sideHandle == Convolution::Filter::SideHandle::Crop) ? 0 : kernelSize / 2)
+		, pixelSize(Convolution::PixelSize(source.format))
+		, outWidth(width)
+		, rows(height + kernelSize - 1)
+		, columns(width + kernelSize - 1)
+		, constant(source.width * pixelSize)
+		, hasConstantRow(false)
 	{
-		for(uint32_t i = 0; i < image->width; ++i)
+		for(uint32_t j = 0; j < rows.size; ++j)
 		{
-			switch(image->format)
-			{
-			case Convolution::Image::Format::RGB:
-				gray = GrayScale(
-							image->pixels[(i + j * image->width) * 3],
-							image->pixels[(i + j * image->width) * 3 + 1],
-							image->pixels[(i + j * image->width) * 3 + 2]);
-				break;
-			case Convolution::Image::Format::ARGB:
-				gray = GrayScale(
-							image->pixels[(i + j * image->width) * 4 + 1],
-							image->pixels[(i + j * image->width) * 4 + 2],
-							image->pixels[(i + j * image->width) * 4 + 3]);
-				break;
-			case Convolution::Image::Format::Indexed8:
-				gray = image->pixels[i + j * image->width];
-				break;
-			}
-			if(gray <= tresholdMin)
-			{
-				out->pixels[i + j * out->width] = 0;
-			}
-			else if(gray > tresholdMax)
+			rows[j] = BorderCoordinate((int32_t)j - (int32_t)origin, (int32_t)image.height, sideHandle);
+			hasConstantRow = hasConstantRow || rows[j] < 0;
+		}
+		for(uint32_t i = 0; i < columns.size; ++i)
+		{
+			columns[i] = BorderCoordinate((int32_t)i - (int32_t)origin, (int32_t)image.width, sideHandle);
+		}
+		for(uint32_t i = 0; i < constant.size; ++i)
+		{
+			constant[i] = BorderConstant(sideHandle, image.format, i % pixelSize);
+		}
+
+		//
+		// Output columns whose whole neighborhood lies inside the image
+		interiorBegin = origin;
+		interiorEnd = (image.width + origin + 1 > size) ? image.width + origin + 1 - size : 0;
+		if(interiorEnd > outWidth)
+		{
+			interiorEnd = outWidth;
+		}
+		if(interiorEnd <= interiorBegin)
+		{
+			interiorBegin = interiorEnd = outWidth;
+		}
+	}
+
+	//
+	// Source row of a bordered row, the constant row when the border is a constant
+	inline const uint8_t* Row(uint32_t borderedRow) const
+	{
+		int32_t y = rows[borderedRow];
+		return (y < 0) ? constant.data : image.pixels + pixelSize * (uint32_t)y * image.width;
+	}
+
+	//
+	// Largest run of edge columns, used to size gathering buffers
+	inline uint32_t EdgeWidth(void) const
+	{
+		uint32_t left = interiorBegin;
+		uint32_t right = outWidth - interiorEnd;
+		return ((left > right) ? left : right) + size - 1;
+	}
+
+	const Convolution::Image&	image;
+	uint32_t					size;
+	uint32_t					origin;
+	uint32_t					pixelSize;
+	uint32_t					outWidth;
+	PooledArray<int32_t>		rows;			// Source row of each bordered row, -1 for a constant row
+	PooledArray<int32_t>		columns;		// Source column of each bordered column, -1 for a constant pixel
+	PooledArray<uint8_t>		constant;		// Image row filled with the constant border pixel
+	bool						hasConstantRow;
+	uint32_t					interiorBegin;
+	uint32_t					interiorEnd;
+};
+
+//
+// Run a row kernel over one output row. sources[y] are the source rows of the count kernel rows, the kernel is called
+// with row pointers set on the first sample of its output range: the image itself for interior columns, a copy
+// gathered through the column remap table for the edge columns.
+template<class Apply>
+void ApplyOnRow(const BorderLayout& layout, const uint8_t* const* sources, uint32_t count, PooledArray<const uint8_t*>& rows, PooledArray<uint8_t>& scratch, Apply apply)
+{
+	uint32_t pixelSize = layout.pixelSize;
+	if(layout.interiorEnd > layout.interiorBegin)
+	{
+		for(uint32_t y = 0; y < count; ++y)
+		{
+			rows[y] = sources[y] + pixelSize * (layout.interiorBegin - layout.origin);
+		}
+		apply(rows.data, layout.interiorBegin, layout.interiorEnd - layout.interiorBegin);
+	}
+
+	uint32_t edges[2][2] = { { 0, layout.interiorBegin }, { layout.interiorEnd, layout.outWidth } };
+	for(uint32_t e = 0; e < 2; ++e)
+	{
+		uint32_t begin = edges[e][0];
+		uint32_t end = edges[e][1];
+		if(begin >= end)
+		{
+			continue;
+		}
+		uint32_t length = end - begin + layout.size - 1;
+		for(uint32_t y = 0; y < count; ++y)
+		{
+			uint8_t* row = scratch.data + pixelSize * y * length;
+			for(uint32_t i = 0; i < length; ++i)
 			{
-				out->pixels[i + j * out->width] = 255;
+				int32_t x = layout.columns[begin + i];
+				for(uint32_t k = 0; k < pixelSize; ++k)
+				{
+					row[pixelSize * i + k] = (x < 0) ? layout.constant[k] : sources[y][pixelSize * x + k];
+				}
 			}
-			else
+			rows[y] = row;
+		}
+		apply(rows.data, begin, end - begin);
+	}
+}
+
+//
+// Generic convolution of one row, only the non-zero taps are visited
+void ConvolveRowTaps(const uint8_t* const* rows, uint8_t* out, uint32_t width, uint32_t pixelSize, const Convolution::CompiledFilter& filter)
+{
+	uint32_t tapCount = (uint32_t)filter.taps.size();
+	for(uint32_t i = 0; i < width; ++i)
+	{
+		for(uint32_t k = 0; k < pixelSize; ++k)
+		{
+			double acc = 0.0;
+			for(uint32_t t = 0; t < tapCount; ++t)
 			{
-				out->pixels[i + j * out->width] = 150;
+				const Convolution::CompiledFilter::Tap& tap = filter.taps[t];
+				acc += rows[tap.y][pixelSize * (i + tap.x) + k] * tap.weight;
 			}
+			out[pixelSize * i + k] = (uint8_t)(acc / filter.divisor);
 		}
 	}
-	if(tresholdMin != tresholdMax)
+}
+
+//
+// Quantize the kernel to int16 taps scaled by a power of two. The quantization is only accepted when it is exact
+// and when every intermediate value fits a float mantissa, so the result is the same as the double precision path.
+bool QuantizeKernel(Convolution::CompiledFilter& filter)
+{
+	for(uint32_t shift = 0; shift < 15; ++shift)
 	{
-		for(int j = 0; j < (int)out->height; ++j)
+		double scale = (double)(1 << shift);
+		double scaledDivisor = filter.divisor * scale;
+		if(scaledDivisor == 0.0 || scaledDivisor != floor(scaledDivisor) || fabs(scaledDivisor) > 16777216.0)
 		{
-			for(int i = 0; i < (int)out->width; ++i)
+			continue;
+		}
+		bool exact = true;
+		double sum = 0.0;
+		filter.fixedTaps.clear();
+		for(uint32_t y = 0; y < filter.size && exact; ++y)
+		{
+			for(uint32_t x = 0; x < filter.size && exact; ++x)
 			{
-				if(out->pixels[(i + j * out->width)] == 150)
+				double weight = filter.kernel[x + y * filter.size] * scale;
+				if(weight != floor(weight) || fabs(weight) > 32767.0)
 				{
-					bool found = false;
-					for(int x = -1; x < 2 && !found; ++x)
-					{
-						for(int y = -1; y < 2 && !found; ++y)
-						{
-							if(i + x < 0 || i + x >= (int)out->width || j + y < 0 || j + y >= (int)out->height)
-							{
-								continue;
-							}
-							if(out->pixels[(i + x) + (j + y) * out->width] == 255)
-							{
-								found = true;
-							}
-						}
-					}
-					if(found)
-					{
-						out->pixels[i + j * out->width] = 200;
-					}
-					else
-					{
-						out->pixels[i + j * out->width] = 0;
-					}
+					exact = false;
+				}
+				else if(weight != 0.0)
+				{
+					Convolution::CompiledFilter::FixedTap tap = { x, y, (int16_t)weight };
+					filter.fixedTaps.push_back(tap);
+					sum += fabs(weight);
 				}
 			}
 		}
-		for(uint32_t j = 0; j < out->height; ++j)
+		if(exact && sum * 255.0 < 16777216.0)
 		{
-			for(uint32_t i = 0; i < out->width; ++i)
+			while(filter.fixedTaps.empty() || filter.fixedTaps.size() % 2 != 0)
 			{
-				if(out->pixels[(i + j * out->width)] == 200)
-				{
-					out->pixels[i + j * out->width] = 255;
-				}
+				Convolution::CompiledFilter::FixedTap tap = { 0, 0, 0 };
+				filter.fixedTaps.push_back(tap);
 			}
+			filter.fixedDivisor = (float)scaledDivisor;
+			return true;
 		}
 	}
-	return out;
+	filter.fixedTaps.clear();
+	return false;
 }
 
-#ifndef M_PI
-#define M_PI 3.14159265358979323846
-#endif
-inline double ConvertAngleDtoR(double alpha)
+#if defined(__SSE2__)
+//
+// Divide 4 accumulators, truncate and keep the low byte like the scalar cast does
+inline __m128i FixedDivide(__m128i acc, __m128 divisor)
 {
-	return alpha * M_PI / 180.0;
+	return _mm_and_si128(_mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(acc), divisor)), _mm_set1_epi32(0xff));
 }
-inline double ConvertAngleRtoD(double alpha)
+#endif
+
+//
+// Convolve one Indexed8 row, rows[y] points to the first bordered sample used by tap row y
+void ConvolveRowFixed(const uint8_t* const* rows, uint8_t* out, uint32_t width, const Convolution::CompiledFilter& filter)
 {
-	return alpha / 180.0 / M_PI;
+	uint32_t i = 0;
+	uint32_t tapCount = (uint32_t)filter.fixedTaps.size();
+#if defined(__AVX2__)
+	__m256 divisor256 = _mm256_set1_ps(filter.fixedDivisor);
+	__m256i mask256 = _mm256_set1_epi32(0xff);
+	for(; i + 32 <= width; i += 32)
+	{
+		__m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256(), acc2 = _mm256_setzero_si256(), acc3 = _mm256_setzero_si256();
+		for(uint32_t t = 0; t < tapCount; t += 2)
+		{
+			const Convolution::CompiledFilter::FixedTap& a = filter.fixedTaps[t];
+			const Convolution::CompiledFilter::FixedTap& b = filter.fixedTaps[t + 1];
+			const uint8_t* pa = rows[a.y] + i + a.x;
+			const uint8_t* pb = rows[b.y] + i + b.x;
+			__m256i weights = _mm256_set1_epi32((uint16_t)a.weight | ((uint32_t)(uint16_t)b.weight << 16));
+			__m256i a0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)pa));
+			__m256i b0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)pb));
+			__m256i a1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(pa + 16)));
+			__m256i b1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(pb + 16)));
+			acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(a0, b0), weights));
+			acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(a0, b0), weights));
+			acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi16(a1, b1), weights));
+			acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi16(a1, b1), weights));
+		}
+		acc0 = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(acc0), divisor256)), mask256);
+		acc1 = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(acc1), divisor256)), mask256);
+		acc2 = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(acc2), divisor256)), mask256);
+		acc3 = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(acc3), divisor256)), mask256);
+		// Packing works per 128 bits lane, the final permutation restores the pixel order
+		__m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(acc0, acc1), _mm256_packs_epi32(acc2, acc3));
+		_mm256_storeu_si256((__m256i*)(out + i), _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+	}
+#endif
+#if defined(__SSE2__)
+	__m128 divisor128 = _mm_set1_ps(filter.fixedDivisor);
+	__m128i zero = _mm_setzero_si128();
+	for(; i + 16 <= width; i += 16)
+	{
+		__m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128(), acc2 = _mm_setzero_si128(), acc3 = _mm_setzero_si128();
+		for(uint32_t t = 0; t < tapCount; t += 2)
+		{
+			const Convolution::CompiledFilter::FixedTap& a = filter.fixedTaps[t];
+			const Convolution::CompiledFilter::FixedTap& b = filter.fixedTaps[t + 1];
+			__m128i weights = _mm_set1_epi32((uint16_t)a.weight | ((uint32_t)(uint16_t)b.weight << 16));
+			__m128i pa = _mm_loadu_si128((const __m128i*)(rows[a.y] + i + a.x));
+			__m128i pb = _mm_loadu_si128((const __m128i*)(rows[b.y] + i + b.x));
+			__m128i aLow = _mm_unpacklo_epi8(pa, zero), aHigh = _mm_unpackhi_epi8(pa, zero);
+			__m128i bLow = _mm_unpacklo_epi8(pb, zero), bHigh = _mm_unpackhi_epi8(pb, zero);
+			acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(aLow, bLow), weights));
+			acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(aLow, bLow), weights));
+			acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(aHigh, bHigh), weights));
+			acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(aHigh, bHigh), weights));
+		}
+		__m128i low = _mm_packs_epi32(FixedDivide(acc0, divisor128), FixedDivide(acc1, divisor128));
+		__m128i high = _mm_packs_epi32(FixedDivide(acc2, divisor128), FixedDivide(acc3, divisor128));
+		_mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(low, high));
+	}
+#endif
+	for(; i < width; ++i)
+	{
+		int32_t acc = 0;
+		for(uint32_t t = 0; t < tapCount; ++t)
+		{
+			acc += rows[filter.fixedTaps[t].y][i + filter.fixedTaps[t].x] * filter.fixedTaps[t].weight;
+		}
+		out[i] = (uint8_t)(int32_t)((float)acc / filter.fixedDivisor);
+	}
 }
 
 //
-//
-// COHEN-SUTHERLAND ALGORITHM TO CLIP LINE IN IMAGE
-
-typedef int OutCode;
-
-const int INSIDE = 0; // 0000
-const int LEFT = 1;   // 0001
-const int RIGHT = 2;  // 0010
-const int BOTTOM = 4; // 0100
-const int TOP = 8;    // 1000
-
-// Compute the bit code for a point (x, y) using the clip rectangle
-// bounded diagonally by (xmin, ymin), and (xmax, ymax)
-
-// ASSUME THAT xmax, xmin, ymax and ymin are global constants.
+// Sum of the taps of a Size x Size kernel, unrolled at compile time. Taps are added in the same order as the generic
+// loop (columns outer, rows inner) so both give the same result.
+template<uint32_t Size, uint32_t PixelSize, uint32_t N>
+struct TapSum
+{
+	static inline double Sum(const uint8_t* const* rows, uint32_t offset, const double* kernel)
+	{
+		return TapSum<Size, PixelSize, N - 1>::Sum(rows, offset, kernel)
+				+ rows[(N - 1) % Size][offset + PixelSize * ((N - 1) / Size)] * kernel[(N - 1) / Size + ((N - 1) % Size) * Size];
+	}
+};
 
-OutCode ComputeOutCode(double x, double y, double xmin, double xmax, double ymin, double ymax)
+template<uint32_t Size, uint32_t PixelSize>
+struct TapSum<Size, PixelSize, 0>
 {
-	OutCode code;
+	static inline double Sum(const uint8_t* const*, uint32_t, const double*)
+	{
+		return 0.0;
+	}
+};
 
-	code = INSIDE;          // initialised as being inside of [[clip window]]
+//
+// Convolve one row, rows[y] points to the first bordered sample used by tap row y
+typedef void (*RowKernel)(const uint8_t* const* rows, uint8_t* out, uint32_t width, const double* kernel, double divisor);
 
-	if (x < xmin)           // to the left of clip window
-		code |= LEFT;
-	else if (x > xmax)      // to the right of clip window
-		code |= RIGHT;
-	if (y < ymin)           // below the clip window
-		code |= BOTTOM;
-	else if (y > ymax)      // above the clip window
-		code |= TOP;
+template<uint32_t Size, uint32_t PixelSize>
+void ConvolveRow(const uint8_t* const* rows, uint8_t* out, uint32_t width, const double* kernel, double divisor)
+{
+	for(uint32_t i = 0; i < width; ++i)
+	{
+		for(uint32_t k = 0; k < PixelSize; ++k)
+		{
+			double acc = TapSum<Size, PixelSize, Size * Size>::Sum(rows, PixelSize * i + k, kernel);
+			out[PixelSize * i + k] = (uint8_t)(acc / divisor);
+		}
+	}
+}
 
-	return code;
+template<uint32_t Size>
+RowKernel SelectRowKernel(Convolution::Image::Format format)
+{
+	switch(format)
+	{
+	case Convolution::Image::Format::RGB:		return &ConvolveRow<Size, 3>;
+	case Convolution::Image::Format::ARGB:		return &ConvolveRow<Size, 4>;
+	case Convolution::Image::Format::Indexed8:	return &ConvolveRow<Size, 1>;
+	}
+	return nullptr;
 }
 
-// Cohen–Sutherland clipping algorithm clips a line from
-// P0 = (x0, y0) to P1 = (x1, y1) against a rectangle with
-// diagonal from (xmin, ymin) to (xmax, ymax).
-bool CohenSutherlandLineClip(	double x0, double y0, double x1, double y1,
-								double&x0o,double&y0o,double&x1o,double&y1o,
-								double xmin, double xmax, double ymin, double ymax)
+//
+// Specialized row kernel for the filter sizes supported by the filter editor, nullptr for the generic loop
+RowKernel SelectRowKernel(uint32_t size, Convolution::Image::Format format)
 {
-	// compute outcodes for P0, P1, and whatever point lies outside the clip rectangle
-	OutCode outcode0 = ComputeOutCode(x0, y0, xmin, xmax, ymin, ymax);
+	switch(size)
+	{
+	case 1:	return SelectRowKernel<1>(format);
+	case 3:	return SelectRowKernel<3>(format);
+	case 5:	return SelectRowKernel<5>(format);
+	case 7:	return SelectRowKernel<7>(format);
+	case 9:	return SelectRowKernel<9>(format);
+	}
+	return nullptr;
+}
+
+//
+// Apply the eight rotated kernels of a multiconvolution to one row and keep the greatest result. Each sample is
+// loaded once, and each rotation sums its taps in the same order as the single kernel loops.
+typedef void (*MultiRowKernel)(const uint8_t* const* rows, uint8_t* out, uint32_t width, const double* rotations, const double* divisors);
+
+inline void ConvolveRowMulti(const uint8_t* const* rows, uint8_t* out, uint32_t width, uint32_t size, uint32_t pixelSize, const double* rotations, const double* divisors)
+{
+	uint32_t taps = size * size;
+	for(uint32_t i = 0; i < width; ++i)
+	{
+		for(uint32_t k = 0; k < pixelSize; ++k)
+		{
+			double acc[8] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+			for(uint32_t x = 0; x < size; ++x)
+			{
+				for(uint32_t y = 0; y < size; ++y)
+				{
+					double sample = rows[y][pixelSize * (i + x) + k];
+					for(uint32_t r = 0; r < 8; ++r)
+					{
+						acc[r] += sample * rotations[r * taps + x + y * size];
+					}
+				}
+			}
+			uint8_t max = 0;
+			for(uint32_t r = 0; r < 8; ++r)
+			{
+				uint8_t value = (uint8_t)(acc[r] / divisors[r]);
+				if(value > max)
+				{
+					max = value;
+				}
+			}
+			out[pixelSize * i + k] = max;
+		}
+	}
+}
+
+template<uint32_t Size, uint32_t PixelSize>
+void ConvolveRowMulti(const uint8_t* const* rows, uint8_t* out, uint32_t width, const double* rotations, const double* divisors)
+{
+	ConvolveRowMulti(rows, out, width, Size, PixelSize, rotations, divisors);
+}
+
+template<uint32_t Size>
+MultiRowKernel SelectMultiRowKernel(Convolution::Image::Format format)
+{
+	switch(format)
+	{
+	case Convolution::Image::Format::RGB:		return &ConvolveRowMulti<Size, 3>;
+	case Convolution::Image::Format::ARGB:		return &ConvolveRowMulti<Size, 4>;
+	case Convolution::Image::Format::Indexed8:	return &ConvolveRowMulti<Size, 1>;
+	}
+	return nullptr;
+}
+
+MultiRowKernel SelectMultiRowKernel(uint32_t size, Convolution::Image::Format format)
+{
+	switch(size)
+	{
+	case 1:	return SelectMultiRowKernel<1>(format);
+	case 3:	return SelectMultiRowKernel<3>(format);
+	case 5:	return SelectMultiRowKernel<5>(format);
+	case 7:	return SelectMultiRowKernel<7>(format);
+	case 9:	return SelectMultiRowKernel<9>(format);
+	}
+	return nullptr;
+}
+
+//
+// Find the factors of a rank-1 kernel, its greatest tap row and column are used as factors
+bool SeparateKernel(Convolution::CompiledFilter& filter)
+{
+	filter.horizontal.clear();
+	filter.vertical.clear();
+	if(filter.size < 3)
+	{
+		return false;
+	}
+
+	uint32_t pivot = 0;
+	double maxValue = 0.0;
+	for(uint32_t i = 0; i < filter.size * filter.size; ++i)
+	{
+		if(fabs(filter.kernel[i]) > maxValue)
+		{
+			maxValue = fabs(filter.kernel[i]);
+			pivot = i;
+		}
+	}
+	if(maxValue == 0.0)
+	{
+		return false;
+	}
+	uint32_t pivotX = pivot % filter.size;
+	uint32_t pivotY = pivot / filter.size;
+
+	filter.horizontal.resize(filter.size);
+	filter.vertical.resize(filter.size);
+	for(uint32_t i = 0; i < filter.size; ++i)
+	{
+		filter.horizontal[i] = filter.kernel[i + pivotY * filter.size];
+		filter.vertical[i] = filter.kernel[pivotX + i * filter.size] / filter.kernel[pivot];
+	}
+
+	//
+	// The kernel is separable if it is the outer product of both factors
+	double epsilon = maxValue * 1e-9;
+	for(uint32_t y = 0; y < filter.size; ++y)
+	{
+		for(uint32_t x = 0; x < filter.size; ++x)
+		{
+			if(fabs(filter.kernel[x + y * filter.size] - filter.vertical[y] * filter.horizontal[x]) > epsilon)
+			{
+				filter.horizontal.clear();
+				filter.vertical.clear();
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+Convolution::CompiledFilter::CompiledFilter(const Convolution::Filter& filter)
+	: size(filter.size)
+	, kernel(filter.kernel, filter.kernel + filter.size * filter.size)
+	, divisor(filter.divisor)
+	, separable(false)
+	, fixed(false)
+	, fixedDivisor(0.0f)
+{
+	//
+	// Resolve the divisor, summing in the same order as the convolution loops
+	if(divisor == 0.0)
+	{
+		for(uint32_t x = 0; x < size; ++x)
+		{
+			for(uint32_t y = 0; y < size; ++y)
+			{
+				divisor += fabs(kernel[x + y * size]);
+			}
+		}
+	}
+	for(uint32_t x = 0; x < size; ++x)
+	{
+		for(uint32_t y = 0; y < size; ++y)
+		{
+			if(kernel[x + y * size] != 0.0)
+			{
+				Convolution::CompiledFilter::Tap tap = { x, y, kernel[x + y * size] };
+				taps.push_back(tap);
+			}
+		}
+	}
+	separable = SeparateKernel(*this);
+	fixed = QuantizeKernel(*this);
+
+	//
+	// Bank of the eight rotations used by multiconvolution, each one with its own resolved divisor
+	uint32_t taps = size * size;
+	rotations.resize(8 * taps);
+	Convolution::Filter rotated = { size, rotations.data(), filter.divisor };
+	for(uint32_t i = 0; i < taps; ++i)
+	{
+		rotations[i] = kernel[i];
+	}
+	for(uint32_t r = 0; r < 8; ++r)
+	{
+		if(r > 0)
+		{
+			Convolution::Filter* next = Convolution::Rotate(rotated);
+			rotated.kernel = rotations.data() + r * taps;
+			for(uint32_t i = 0; i < taps; ++i)
+			{
+				rotated.kernel[i] = next->kernel[i];
+			}
+			delete [] next->kernel;
+			delete next;
+		}
+		rotationDivisors[r] = filter.divisor;
+		if(rotationDivisors[r] == 0.0)
+		{
+			for(uint32_t x = 0; x < size; ++x)
+			{
+				for(uint32_t y = 0; y < size; ++y)
+				{
+					rotationDivisors[r] += fabs(rotated.kernel[x + y * size]);
+				}
+			}
+		}
+	}
+}
+
+/*static*/ Convolution::Image* Convolution::ApplyFilter(const Convolution::Image& image, const Convolution::Filter& filter, Convolution::Filter::SideHandle sideHandle, bool multi, uint32_t threadCount)
+{
+	Convolution::CompiledFilter compiled(filter);
+	return ApplyFilter(image, compiled, sideHandle, multi, threadCount);
+}
+
+/*static*/ Convolution::Image* Convolution::ApplyFilter(const Convolution::Image& image, const Convolution::CompiledFilter& filter, Convolution::Filter::SideHandle sideHandle, bool multi, uint32_t threadCount)
+{
+	Convolution::Image* out = new Convolution::Image();
+	ApplyFilter(image, filter, sideHandle, *out, multi, threadCount);
+	return out;
+}
+
+/*static*/ void Convolution::ApplyFilter(const Convolution::Image& image, const Convolution::CompiledFilter& filter, Convolution::Filter::SideHandle sideHandle, Convolution::Image& out, bool multi, uint32_t threadCount)
+{
+	//
+	// Select output image size, the output buffer is reused when it already has the right size
+	if(sideHandle == Convolution::Filter::SideHandle::Crop)
+	{
+		out.Resize(image.width - (filter.size - 1), image.height - (filter.size - 1), image.format);
+	}
+	else
+	{
+		out.Resize(image.width, image.height, image.format);
+	}
+
+	//
+	// Select pixel size and fill indexed color tables
+	uint32_t pixelSize = Convolution::PixelSize(image.format);
+	if(image.format == Convolution::Image::Format::Indexed8)
+	{
+		for(uint32_t i = 0; i < 256; ++i)
+		{
+			out.colorTable[i] = image.colorTable[i];
+		}
+	}
+
+	//
+	// Sides are wrapped according to side handle through remap tables
+	BorderLayout layout(image, filter.size, sideHandle, out.width, out.height);
+
+	//
+	// Output rows are split in bands processed by the worker threads
+	uint32_t bandHeight = BandHeight(out.width * pixelSize);
+
+	RowKernel rowKernel = SelectRowKernel(filter.size, image.format);
+	MultiRowKernel multiRowKernel = SelectMultiRowKernel(filter.size, image.format);
+	if(filter.separable && !multi && !(image.format == Convolution::Image::Format::Indexed8 && filter.fixed) && (filter.size > 3 || rowKernel == nullptr))
+	{
+		//
+		// Separable kernel (3x3 kernels are faster unrolled): horizontal pass on every source row, then vertical pass.
+		// The constant border row, if any, is filtered as an extra row after the image rows.
+		uint32_t rowCount = image.height + (layout.hasConstantRow ? 1 : 0);
+		PooledArray<double> rows(out.width * rowCount * pixelSize);
+		Convolution::ParallelFor(rowCount, bandHeight, threadCount, [&](uint32_t begin, uint32_t end)
+		{
+			PooledArray<const uint8_t*> rowPointers(1);
+			PooledArray<uint8_t> scratch(pixelSize * layout.EdgeWidth());
+			for(uint32_t j = begin; j < end; ++j)
+			{
+				const uint8_t* source = (j < image.height) ? image.pixels + pixelSize * j * image.width : layout.constant.data;
+				double* row = rows.data + pixelSize * j * out.width;
+				ApplyOnRow(layout, &source, 1, rowPointers, scratch, [&](const uint8_t* const* samples, uint32_t first, uint32_t count)
+				{
+					for(uint32_t i = 0; i < count; ++i)
+					{
+						for(uint32_t k = 0; k < pixelSize; ++k)
+						{
+							double acc = 0.0;
+							for(uint32_t x = 0; x < filter.size; ++x)
+							{
+								acc += samples[0][pixelSize * (i + x) + k] * filter.horizontal[x];
+							}
+							row[pixelSize * (first + i) + k] = acc;
+						}
+					}
+				});
+			}
+		});
+		Convolution::ParallelFor(out.height, bandHeight, threadCount, [&](uint32_t begin, uint32_t end)
+		{
+			PooledArray<const double*> rowPointers(filter.size);
+			for(uint32_t j = begin; j < end; ++j)
+			{
+				for(uint32_t y = 0; y < filter.size; ++y)
+				{
+					int32_t source = layout.rows[j + y];
+					rowPointers[y] = rows.data + pixelSize * ((source < 0) ? image.height : (uint32_t)source) * out.width;
+				}
+				for(uint32_t i = 0; i < out.width; ++i)
+				{
+					for(uint32_t k = 0; k < pixelSize; ++k)
+					{
+						double acc = 0.0;
+						for(uint32_t y = 0; y < filter.size; ++y)
+						{
+							acc += rowPointers[y][pixelSize * i + k] * filter.vertical[y];
+						}
+						out.pixels[pixelSize * (i + j * out.width) + k] = (uint8_t)(acc / filter.divisor);
+					}
+				}
+			}
+		});
+		return;
+	}
+
+	Convolution::ParallelFor(out.height, bandHeight, threadCount, [&](uint32_t begin, uint32_t end)
+	{
+		PooledArray<const uint8_t*> sources(filter.size);
+		PooledArray<const uint8_t*> rowPointers(filter.size);
+		PooledArray<uint8_t> scratch(pixelSize * filter.size * layout.EdgeWidth());
+		for(uint32_t j = begin; j < end; ++j)
+		{
+			for(uint32_t y = 0; y < filter.size; ++y)
+			{
+				sources[y] = layout.Row(j + y);
+			}
+			uint8_t* row = out.pixels + pixelSize * j * out.width;
+			if(multi)
+			{
+				//
+				// Multiconvolution: the eight rotated kernels are applied to each neighborhood in a single pass,
+				// only the greatest result is written
+				ApplyOnRow(layout, sources.data, filter.size, rowPointers, scratch, [&](const uint8_t* const* samples, uint32_t first, uint32_t count)
+				{
+					if(multiRowKernel != nullptr)
+					{
+						multiRowKernel(samples, row + pixelSize * first, count, filter.rotations.data(), filter.rotationDivisors);
+					}
+					else
+					{
+						ConvolveRowMulti(samples, row + pixelSize * first, count, filter.size, pixelSize, filter.rotations.data(), filter.rotationDivisors);
+					}
+				});
+			}
+			else if(image.format == Convolution::Image::Format::Indexed8 && filter.fixed)
+			{
+				//
+				// Grayscale image and kernel exactly representable in fixed point: vectorized integer convolution
+				ApplyOnRow(layout, sources.data, filter.size, rowPointers, scratch, [&](const uint8_t* const* samples, uint32_t first, uint32_t count)
+				{
+					ConvolveRowFixed(samples, row + first, count, filter);
+				});
+			}
+			else if(rowKernel != nullptr)
+			{
+				//
+				// Apply convolution with the kernel specialized for the filter size and pixel format
+				ApplyOnRow(layout, sources.data, filter.size, rowPointers, scratch, [&](const uint8_t* const* samples, uint32_t first, uint32_t count)
+				{
+					rowKernel(samples, row + pixelSize * first, count, filter.kernel.data(), filter.divisor);
+				});
+			}
+			else
+			{
+				//
+				// Apply convolution
+				ApplyOnRow(layout, sources.data, filter.size, rowPointers, scratch, [&](const uint8_t* const* samples, uint32_t first, uint32_t count)
+				{
+					ConvolveRowTaps(samples, row + pixelSize * first, count, pixelSize, filter);
+				});
+			}
+		}
+	});
+}
+
+void PermuteMatrix(double* in, double* out, int size, int* permutation)
+{
+	for(int i = 0; i < size; ++i)
+	{
+		out[i] = in[permutation[i]];
+	}
+}
+
+int perm3 [9] = {
+	3, 0, 1,
+	6, 4, 2,
+	7, 8, 5 };
+
+int perm5 [25] = {
+	10,  5,  0,  1,  2,
+	15, 11,  6,  7,  3,
+	20, 16, 12,  8,  4,
+	21, 17, 18, 13,  9,
+	22, 23, 24, 19, 14 };
+
+int perm7 [49] = {
+	21, 14,  7,  0,  1,  2,  3,
+	28, 22, 15,  8,  9, 10,  4,
+	35, 29, 23, 16, 17, 11,  5,
+	42, 36, 30, 24, 18, 12,  6,
+	43, 37, 31, 32, 25, 19, 13,
+	44, 38, 39, 40, 33, 26, 20,
+	45, 46, 47, 48, 41, 34, 27 };
+
+int perm9 [81] = {
+	36, 27, 18,  9,  0,  1,  2,  3,  4,
+	45, 37, 28, 19, 10, 11, 12, 13,  5,
+	54, 46, 38, 29, 20, 21, 22, 14,  6,
+	63, 55, 47, 39, 30, 31, 23, 15,  7,
+	72, 64, 56, 48, 40, 32, 24, 16,  8,
+	73, 65, 57, 49, 50, 41, 33, 25, 17,
+	74, 66, 58, 59, 60, 51, 42, 34, 26,
+	75, 67, 68, 69, 70, 61, 52, 43, 35,
+	76, 77, 78, 79, 80, 71, 62, 53, 44 };
+
+
+/*static*/ Convolution::Filter* Convolution::Rotate(const Convolution::Filter& filter)
+{
+	Convolution::Filter* out = new Convolution::Filter();
+	out->divisor = filter.divisor;
+	out->size = filter.size;
+	out->kernel = new double[out->size * out->size];
+	switch(out->size)
+	{
+	case 1:
+		out->kernel[0] = filter.kernel[0];
+		break;
+	case 3:
+		PermuteMatrix(filter.kernel, out->kernel, 9, perm3);
+		break;
+	case 5:
+		PermuteMatrix(filter.kernel, out->kernel, 25, perm5);
+		break;
+	case 7:
+		PermuteMatrix(filter.kernel, out->kernel, 49, perm7);
+		break;
+	case 9:
+		PermuteMatrix(filter.kernel, out->kernel, 81, perm9);
+		break;
+	}
+	return out;
+}
+
+//
+// Filters available out of the box, the caller owns the kernels
+/*static*/ std::map<std::string, Convolution::Filter> Convolution::DefaultFilters(void)
+{
+	std::map<std::string, Convolution::Filter> filters;
+	Convolution::Filter f;
+	f.divisor = 6;
+	f.size = 3;
+	f.kernel = new double[9];
+	f.kernel[0] = f.kernel[2] = f.kernel[6] = f.kernel[8] = 0.0;
+	f.kernel[1] = f.kernel[3] = f.kernel[5] = f.kernel[7] = -1.0;
+	f.kernel[4] = 4;
+	filters["Laplacian"] = f;
+
+	f.divisor = 9;
+	f.size = 3;
+	f.kernel = new double[9];
+	f.kernel[0] = f.kernel[1] = f.kernel[2] = f.kernel[3] = f.kernel[4] = f.kernel[5] = f.kernel[6] = f.kernel[7] = f.kernel[8] = 1;
+	filters["Box Blur"] = f;
+
+	f.divisor = 3;
+	f.size = 3;
+	f.kernel = new double[9];
+	f.kernel[0] = f.kernel[1] = f.kernel[2] = 1;
+	f.kernel[3] = f.kernel[4] = f.kernel[5] = 0;
+	f.kernel[6] = f.kernel[7] = f.kernel[8] = -1;
+	filters["Prewitt"] = f;
+
+	f.divisor = 4;
+	f.size = 3;
+	f.kernel = new double[9];
+	f.kernel[0] = f.kernel[2] = 1;
+	f.kernel[3] = f.kernel[4] = f.kernel[5] = 0;
+	f.kernel[6] = f.kernel[8] = -1;
+	f.kernel[1] = 2;
+	f.kernel[7] = -2;
+	filters["Sobel"] = f;
+
+	f.divisor = 15;
+	f.size = 3;
+	f.kernel = new double[9];
+	f.kernel[0] = f.kernel[1] = f.kernel[2] = 5;
+	f.kernel[3] = f.kernel[5] = f.kernel[6] = f.kernel[7] = f.kernel[8] = -3;
+	f.kernel[4] = 0;
+	filters["Kirsch"] = f;
+
+	f.divisor = 256;
+	f.size = 5;
+	f.kernel = new double[25];
+	f.kernel[0] = f.kernel[4] = f.kernel[20] = f.kernel[24] = 1;
+	f.kernel[1] = f.kernel[3] = f.kernel[5] = f.kernel[9] = f.kernel[15] = f.kernel[19] = f.kernel[21] = f.kernel[23] = 4;
+	f.kernel[2] = f.kernel[10] = f.kernel[14] = f.kernel[22] = 6;
+	f.kernel[6] = f.kernel[8] = f.kernel[16] = f.kernel[18] = 16;
+	f.kernel[7] = f.kernel[11] = f.kernel[13] = f.kernel[17] = 24;
+	f.kernel[12] = 36;
+	filters["Gaussian Blur"] = f;
+
+	return filters;
+}
+
+/*static*/ Convolution::Image* Convolution::Refine(const Convolution::Image& tresholded, const Convolution::Image& gradient)
+{
+	Convolution::Image* out = new Convolution::Image();
+	Refine(tresholded, gradient, *out);
+	return out;
+}
+
+/*static*/ void Convolution::Refine(const Convolution::Image& tresholded, const Convolution::Image& gradient, Convolution::Image& out)
+{
+	out.Resize(tresholded.width, tresholded.height, Convolution::Image::Format::Indexed8);
+
+	for(int j = 0; j < (int)out.height && KeepRunning(j, out.height); ++j)
+	{
+		for(int i = 0; i < (int)out.width; ++i)
+		{
+			if(tresholded.pixels[(i + j * out.width)] != 0)
+			{
+				bool found = false;
+				for(int x = -1; x < 2 && !found; ++x)
+				{
+					for(int y = -1; y < 2 && !found; ++y)
+					{
+						if(i + x < 0 || i + x >= (int)out.width || j + y < 0 || j + y >= (int)out.height)
+						{
+							continue;
+						}
+						if(tresholded.pixels[(i + x) + (j + y) * out.width] != 0 && gradient.pixels[(i + x) + (j + y) * out.width] > gradient.pixels[i + j * out.width])
+						{
+							found = true;
+						}
+					}
+				}
+				if(found)
+				{
+					out.pixels[i + j * out.width] = 0;
+				}
+				else
+				{
+					out.pixels[i + j * out.width] = 255;
+				}
+			}
+			else
+			{
+				out.pixels[i + j * out.width] = 0;
+			}
+		}
+	}
+}
+
+/*static*/ Convolution::Image* Convolution::ToGrayScale(const Convolution::Image& in)
+{
+	Convolution::Image* out = new Convolution::Image();
+	ToGrayScale(in, *out);
+	return out;
+}
+
+/*static*/ void Convolution::ToGrayScale(const Convolution::Image& in, Convolution::Image& out)
+{
+	out.Resize(in.width, in.height, Convolution::Image::Format::Indexed8);
+	uint8_t gray = 0;
+	for(int j = 0; j < (int)out.height && KeepRunning(j, out.height); ++j)
+	{
+		for(int i = 0; i < (int)out.width; ++i)
+		{
+			switch(in.format)
+			{
+			case Convolution::Image::Format::RGB:
+				gray = GrayScale(
+							in.pixels[(i + j * out.width) * 3],
+							in.pixels[(i + j * out.width) * 3 + 1],
+							in.pixels[(i + j * out.width) * 3 + 2]);
+				out.pixels[i + j * out.width] = gray;
+				break;
+			case Convolution::Image::Format::ARGB:
+				gray = GrayScale(
+							in.pixels[(i + j * out.width) * 4 + 1],
+							in.pixels[(i + j * out.width) * 4 + 2],
+							in.pixels[(i + j * out.width) * 4 + 3]);
+				out.pixels[i + j * out.width] = gray;
+				break;
+			case Convolution::Image::Format::Indexed8:
+				out.pixels[i + j * out.width] = in.pixels[i + j * out.width];
+				break;
+			}
+		}
+	}
+}
+
+//
+// Average of the factor x factor blocks of each channel, the blocks of the last column and row may be smaller
+/*static*/ void Convolution::Downscale(const Convolution::Image& in, uint32_t factor, Convolution::Image& out, uint32_t threadCount)
+{
+	factor = std::max(factor, (uint32_t)1);
+	uint32_t pixelSize = PixelSize(in.format);
+	out.Resize((in.width + factor - 1) / factor, (in.height + factor - 1) / factor, in.format);
+	memcpy(out.colorTable, in.colorTable, sizeof(out.colorTable));
+	ParallelFor(out.height, BandHeight(in.width * pixelSize * factor), threadCount, [&](uint32_t begin, uint32_t end)
+	{
+		PooledArray<uint32_t> sums(out.width * pixelSize);
+		for(uint32_t j = begin; j < end; ++j)
+		{
+			uint32_t top = j * factor;
+			uint32_t bottom = std::min(top + factor, in.height);
+			memset(sums.data, 0, sums.size * sizeof(uint32_t));
+			for(uint32_t y = top; y < bottom; ++y)
+			{
+				const uint8_t* row = in.pixels + (size_t)y * in.width * pixelSize;
+				for(uint32_t i = 0; i < out.width; ++i)
+				{
+					uint32_t* sum = &sums[i * pixelSize];
+					uint32_t right = std::min((i + 1) * factor, in.width);
+					for(uint32_t x = i * factor; x < right; ++x)
+					{
+						for(uint32_t c = 0; c < pixelSize; ++c)
+						{
+							sum[c] += row[x * pixelSize + c];
+						}
+					}
+				}
+			}
+			uint8_t* outRow = out.pixels + (size_t)j * out.width * pixelSize;
+			for(uint32_t i = 0; i < out.width; ++i)
+			{
+				uint32_t count = (std::min((i + 1) * factor, in.width) - i * factor) * (bottom - top);
+				for(uint32_t c = 0; c < pixelSize; ++c)
+				{
+					outRow[i * pixelSize + c] = (uint8_t)((sums[i * pixelSize + c] + count / 2) / count);
+				}
+			}
+		}
+	});
+}
+
+void LoadRGB32(Convolution::Image** out, const QImage& in)
+{
+	*out = new Convolution::Image(in.width(), in.height(), Convolution::Image::Format::RGB);
+	const uchar* bits = in.constBits();
+	uint32_t size = (*out)->width * (*out)->height * 3;
+	for(uint32_t i = 0; i < size; ++i)
+	{
+		(*out)->pixels[i] = bits[((i / 3) * 4) + 2 - (i % 3)];
+	}
+}
+
+void LoadARGB32(Convolution::Image** out, const QImage& in)
+{
+	*out = new Convolution::Image(in.width(), in.height(), Convolution::Image::Format::ARGB);
+	const uchar* bits = in.constBits();
+	uint32_t size = (*out)->width * (*out)->height * 4;
+	memcpy((*out)->pixels, bits, size);
+}
+
+void LoadIndexed8(Convolution::Image** out, const QImage& in)
+{
+	*out = new Convolution::Image(in.width(), in.height(), Convolution::Image::Format::Indexed8);
+	const uchar* bits = in.constBits();
+	uint32_t size = (*out)->width * (*out)->height;
+	memcpy((*out)->pixels, bits, size);
+}
+
+/*static*/ Convolution::Image* Convolution::LoadImage(const std::string& file)
+{
+	Convolution::Image* out = nullptr;
+	
+	QImage in(file.c_str());
+
+	switch(in.format())
+	{
+	case QImage::Format_RGB32:
+		LoadRGB32(&out, in);
+		break;
+	case QImage::Format_ARGB32:
+		LoadARGB32(&out, in);
+		break;
+	case QImage::Format_Indexed8:
+		LoadIndexed8(&out, in);
+		break;
+	default:
+		//
+		// No dialog in batch mode, the caller reports the failure
+		if(qobject_cast<QApplication*>(QCoreApplication::instance()) != nullptr)
+		{
+			QMessageBox::warning(nullptr, QObject::tr("Unsupported format"), QObject::tr("The image format is not supported by application"), QMessageBox::Ok);
+		}
+		break;
+	}
+	
+	return out;
+}
+
+/*static*/ QImage Convolution::ToQImage(const Convolution::Image& image)
+{
+	QImage out;
+	QVector<QRgb> colorTable(256);
+	uint32_t dimension = image.width * image.height;
+	uint32_t size = dimension * Convolution::PixelSize(image.format);
+	uchar* buffer = nullptr;
+	switch(image.format)
+	{
+	case Convolution::Image::Format::RGB:
+		buffer = new uchar[dimension * 4];
+		for(uint32_t i = 0; i < dimension; ++i)
+		{
+			buffer[i * 4 + 3] = 0xff;
+		}
+		for(uint32_t i = 0; i < size; ++i)
+		{
+			buffer[((i / 3) * 4) + 2 - (i % 3)] = image.pixels[i];
+		}
+		out = QImage(image.width, image.height, QImage::Format_RGB32);
+		memcpy(out.bits(), buffer, dimension * 4);
+		break;
+	case Convolution::Image::Format::ARGB:
+		buffer = new uchar[dimension * 4];
+		memcpy(buffer, image.pixels, size);
+		out = QImage(image.width, image.height, QImage::Format_ARGB32);
+		memcpy(out.bits(), buffer, dimension * 4);
+		break;
+	case Convolution::Image::Format::Indexed8:
+		buffer = new uchar[dimension];
+		memcpy(buffer, image.pixels, size);
+		out = QImage(image.width, image.height, QImage::Format_Indexed8);
+		memcpy(out.bits(), buffer, dimension);
+		for(uint32_t i = 0; i < 256; ++i)
+		{
+			colorTable[i] = image.colorTable[i];
+		}
+		out.setColorCount(256);
+		out.setColorTable(colorTable);
+		break;
+	}
+	delete [] buffer;
+	return out;
+}
+
+/*static*/ bool Convolution::SaveImage(const Convolution::Image& image, const std::string& file)
+{
+	QImage out = ToQImage(image);
+	return out.save(file.c_str());
+}
+
+//
+// Look up the gray level of each pixel of row j
+void LutRow(const Convolution::Image& image, uint32_t j, const uint8_t* lut, uint8_t* out)
+{
+	const uint8_t* row = image.pixels + (size_t)j * image.width * Convolution::PixelSize(image.format);
+	switch(image.format)
+	{
+	case Convolution::Image::Format::RGB:
+		for(uint32_t i = 0; i < image.width; ++i)
+		{
+			out[i] = lut[(int)GrayScale(row[i * 3], row[i * 3 + 1], row[i * 3 + 2])];
+		}
+		break;
+	case Convolution::Image::Format::ARGB:
+		for(uint32_t i = 0; i < image.width; ++i)
+		{
+			out[i] = lut[(int)GrayScale(row[i * 4 + 1], row[i * 4 + 2], row[i * 4 + 3])];
+		}
+		break;
+	case Convolution::Image::Format::Indexed8:
+		for(uint32_t i = 0; i < image.width; ++i)
+		{
+			out[i] = lut[row[i]];
+		}
+		break;
+	}
+}
+
+/*static*/ Convolution::Image* Convolution::Treshold(Convolution::Image* image, int tresholdMin, int tresholdMax, uint32_t threadCount)
+{
+	Convolution::Image* out = new Convolution::Image();
+	Treshold(*image, tresholdMin, tresholdMax, *out, threadCount);
+	return out;
+}
+
+//
+// Root of the set of a pixel in the hysteresis union-find, halving the path on the way when it may be written
+inline uint32_t FindRoot(uint32_t* parent, uint32_t pixel)
+{
+	while(parent[pixel] != pixel)
+	{
+		parent[pixel] = parent[parent[pixel]];
+		pixel = parent[pixel];
+	}
+	return pixel;
+}
+
+inline uint32_t FindRoot(const uint32_t* parent, uint32_t pixel)
+{
+	while(parent[pixel] != pixel)
+	{
+		pixel = parent[pixel];
+	}
+	return pixel;
+}
+
+//
+// Merges the sets of two pixels, the smallest index becomes the root and, when given, is strong if either set was
+inline void Unite(uint32_t* parent, uint8_t* strong, uint32_t a, uint32_t b)
+{
+	a = FindRoot(parent, a);
+	b = FindRoot(parent, b);
+	if(a == b)
+	{
+		return;
+	}
+	if(b < a)
+	{
+		std::swap(a, b);
+	}
+	parent[b] = a;
+	if(strong != nullptr)
+	{
+		strong[a] |= strong[b];
+	}
+}
+
+//
+// Unites the pixels of a row that are not black with their neighbours on the left and, unless the row starts a band,
+// in the row above. With 8-connectivity, a pixel joined to the one above is already connected through it to its other
+// neighbours.
+void UniteRow(const Convolution::Image& out, uint32_t j, bool above, bool eightConnected, uint32_t* parent, uint8_t* strong)
+{
+	const uint8_t* row = out.pixels + (size_t)j * out.width;
+	const uint8_t* up = row - out.width;
+	uint32_t first = j * out.width;
+	for(uint32_t i = 0; i < out.width; ++i)
+	{
+		if(row[i] == 0)
+		{
+			continue;
+		}
+		if(above && up[i] != 0)
+		{
+			Unite(parent, strong, first + i, first - out.width + i);
+			if(eightConnected)
+			{
+				continue;
+			}
+		}
+		if(i > 0 && row[i - 1] != 0)
+		{
+			Unite(parent, strong, first + i, first + i - 1);
+		}
+		if(!eightConnected)
+		{
+			continue;
+		}
+		if(above && i > 0 && up[i - 1] != 0)
+		{
+			Unite(parent, strong, first + i, first - out.width + i - 1);
+		}
+		if(above && i + 1 < out.width && up[i + 1] != 0)
+		{
+			Unite(parent, strong, first + i, first - out.width + i + 1);
+		}
+	}
+}
+
+//
+// Starts the hysteresis sets of a row of out whose pixels are 0, 150 or 255, and unites them with the row above unless
+// the row starts a band
+void HysteresisRow(const Convolution::Image& out, uint32_t j, bool above, uint32_t* parent, uint8_t* strong)
+{
+	const uint8_t* row = out.pixels + (size_t)j * out.width;
+	uint32_t first = j * out.width;
+	for(uint32_t i = 0; i < out.width; ++i)
+	{
+		parent[first + i] = first + i;
+		strong[first + i] = (row[i] == 255);
+	}
+	UniteRow(out, j, above, true, parent, strong);
+}
+
+//
+// Unites the bands of bandHeight rows along their seams, then whitens the pixels whose set holds a strong one and
+// blackens the others
+void HysteresisResolve(Convolution::Image& out, uint32_t bandHeight, uint32_t* parent, uint8_t* strong, uint32_t threadCount)
+{
+	for(uint32_t j = bandHeight; j < out.height; j += bandHeight)
+	{
+		UniteRow(out, j, true, true, parent, strong);
+	}
+	const uint32_t* roots = parent;
+	Convolution::ParallelFor(out.height, bandHeight, threadCount, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t j = begin; j < end; ++j)
+		{
+			uint8_t* row = out.pixels + (size_t)j * out.width;
+			uint32_t first = j * out.width;
+			for(uint32_t i = 0; i < out.width; ++i)
+			{
+				if(row[i] != 0)
+				{
+					row[i] = strong[FindRoot(roots, first + i)] ? 255 : 0;
+				}
+			}
+		}
+	});
+}
+
+//
+// Gray levels up to tresholdMin become black and the others white. With a tresholdMax, the levels up to it are only
+// kept when they are 8-connected to a level over it, through any number of such pixels.
+// Hysteresis labels the pixels that are not black with a union-find, in bands of rows run in parallel, then unites
+// the bands along their seams. A pixel is white when the root of its set is.
+/*static*/ void Convolution::Treshold(const Convolution::Image& image, int tresholdMin, int tresholdMax, Convolution::Image& out, uint32_t threadCount)
+{
+	uint8_t lut[256];
+	TresholdLut(tresholdMin, tresholdMax, lut);
+	if(tresholdMin == tresholdMax)
+	{
+		ApplyLut(image, lut, out, threadCount);
+		return;
+	}
+	out.Resize(image.width, image.height, Convolution::Image::Format::Indexed8);
+	size_t size = (size_t)out.width * out.height;
+	PooledArray<uint32_t> parent(size);
+	PooledArray<uint8_t> strong(size);
+	uint32_t bandHeight = BandHeight(out.width);
+	ParallelFor(out.height, bandHeight, threadCount, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t j = begin; j < end; ++j)
+		{
+			LutRow(image, j, lut, out.pixels + (size_t)j * out.width);
+			HysteresisRow(out, j, j > begin, parent.data, strong.data);
+		}
+	});
+	if(!Cancelled())
+	{
+		HysteresisResolve(out, bandHeight, parent.data, strong.data, threadCount);
+	}
+}
+
+//
+// Least number of rows of a Canny band, so that the rows read around it by the Gaussian and Sobel kernels stay a small
+// part of the work
+const uint32_t CANNY_MIN_BAND_ROWS = 32;
+
+//
+// Horizontal pass of the 1 4 6 4 1 Gaussian kernel, the row is extended by repeating its ends
+void CannyBlurRow(const uint8_t* gray, uint32_t width, uint16_t* out)
+{
+	for(uint32_t i = 0; i < width; ++i)
+	{
+		if(i == 2 && width > 4)
+		{
+			//
+			// Interior without bounds tests
+			for(; i < width - 2; ++i)
+			{
+				out[i] = gray[i - 2] + 4 * gray[i - 1] + 6 * gray[i] + 4 * gray[i + 1] + gray[i + 2];
+			}
+			if(i >= width)
+			{
+				break;
+			}
+		}
+		uint32_t sum = 0;
+		for(int k = -2; k <= 2; ++k)
+		{
+			int x = std::min(std::max((int)i + k, 0), (int)width - 1);
+			sum += gray[x] * ((k == 0) ? 6 : ((k == -1 || k == 1) ? 4 : 1));
+		}
+		out[i] = sum;
+	}
+}
+
+//
+// Sobel gradient of a blurred row from the rows around it, as the L1 norm divided by 8 so that it stays in [0, 255],
+// and the direction of the gradient in 4 bins: 0 horizontal, 1 diagonal down right, 2 vertical, 3 diagonal down left
+void CannyGradientRow(const uint8_t* above, const uint8_t* row, const uint8_t* below, uint32_t width, uint8_t* magnitude, uint8_t* direction)
+{
+	for(uint32_t i = 0; i < width; ++i)
+	{
+		uint32_t left = (i > 0) ? i - 1 : i;
+		uint32_t right = (i + 1 < width) ? i + 1 : i;
+		int gx = (above[right] + 2 * row[right] + below[right]) - (above[left] + 2 * row[left] + below[left]);
+		int gy = (below[left] + 2 * below[i] + below[right]) - (above[left] + 2 * above[i] + above[right]);
+		int ax = abs(gx);
+		int ay = abs(gy);
+		magnitude[i] = (uint8_t)((ax + ay) >> 3);
+
+		//
+		// tan(22.5) ~ 53 / 128 and tan(67.5) ~ 309 / 128
+		if(ay * 128 <= ax * 53)
+		{
+			direction[i] = 0;
+		}
+		else if(ay * 128 >= ax * 309)
+		{
+			direction[i] = 2;
+		}
+		else
+		{
+			direction[i] = ((gx > 0) == (gy > 0)) ? 1 : 3;
+		}
+	}
+}
+
+//
+// Edges of an image with the Canny method: gray levels, 5x5 Gaussian blur, Sobel gradient, suppression of the pixels
+// that are not a maximum of the gradient along its direction, and hysteresis between tresholdMin and tresholdMax on
+// the gradient, the borders of the image being extended by repetition.
+// Everything up to the suppression runs on bands of rows in buffers of their own, recomputing the few rows the
+// kernels read around each band, so that the intermediate images never go through the memory. The bands also start
+// the hysteresis sets, only the seams and the final labelling are left to do on the whole image.
+/*static*/ void Convolution::Canny(const Convolution::Image& image, int tresholdMin, int tresholdMax, Convolution::Image& out, uint32_t threadCount)
+{
+	out.Resize(image.width, image.height, Convolution::Image::Format::Indexed8);
+	uint32_t width = image.width;
+	uint32_t height = image.height;
+	if(width == 0 || height == 0)
+	{
+		return;
+	}
+	uint8_t identity[256];
+	for(uint32_t i = 0; i < 256; ++i)
+	{
+		identity[i] = (uint8_t)i;
+	}
+	uint8_t lut[256];
+	TresholdLut(tresholdMin, tresholdMax, lut);
+	size_t size = (size_t)width * height;
+	PooledArray<uint32_t> parent(size);
+	PooledArray<uint8_t> strong(size);
+	uint32_t bandHeight = std::max(BandHeight(width * 6), CANNY_MIN_BAND_ROWS);
+	ParallelFor(height, bandHeight, threadCount, [&](uint32_t begin, uint32_t end)
+	{
+		//
+		// Band rows plus 4 rows on each side for the gray levels, 2 for the blur and 1 for the gradient
+		PooledArray<uint8_t> gray((size_t)(bandHeight + 8) * width);
+		PooledArray<uint16_t> horizontal((size_t)(bandHeight + 8) * width);
+		PooledArray<uint8_t> blurred((size_t)(bandHeight + 4) * width);
+		PooledArray<uint8_t> magnitude((size_t)(bandHeight + 2) * width);
+		PooledArray<uint8_t> direction((size_t)(bandHeight + 2) * width);
+		for(uint32_t top = begin; top < end; top += bandHeight)
+		{
+			uint32_t rows = std::min(bandHeight, end - top);
+			for(uint32_t r = 0; r < rows + 8; ++r)
+			{
+				uint32_t j = (uint32_t)std::min(std::max((int)(top + r) - 4, 0), (int)height - 1);
+				uint8_t* row = gray.data + (size_t)r * width;
+				if(image.format == Convolution::Image::Format::Indexed8)
+				{
+					memcpy(row, image.pixels + (size_t)j * width, width);
+				}
+				else
+				{
+					LutRow(image, j, identity, row);
+				}
+				CannyBlurRow(row, width, horizontal.data + (size_t)r * width);
+			}
+			for(uint32_t r = 0; r < rows + 4; ++r)
+			{
+				const uint16_t* h = horizontal.data + (size_t)r * width;
+				uint8_t* row = blurred.data + (size_t)r * width;
+				for(uint32_t i = 0; i < width; ++i)
+				{
+					row[i] = (uint8_t)((h[i] + 4 * h[i + width] + 6 * h[i + 2 * width] + 4 * h[i + 3 * width] + h[i + 4 * width] + 128) >> 8);
+				}
+			}
+			//
+			// Rows outside the image repeat its first or last row at each stage, not only in the gray levels
+			auto Clamp = [&](int j, int first) -> size_t
+			{
+				return (size_t)(std::min(std::max(j, 0), (int)height - 1) - first) * width;
+			};
+			uint32_t first = (top > 0) ? top - 1 : 0;
+			uint32_t last = std::min(top + rows, height - 1);
+			for(uint32_t j = first; j <= last; ++j)
+			{
+				CannyGradientRow(blurred.data + Clamp(j - 1, (int)top - 2), blurred.data + Clamp(j, (int)top - 2), blurred.data + Clamp(j + 1, (int)top - 2),
+					width, magnitude.data + (size_t)(j - first) * width, direction.data + (size_t)(j - first) * width);
+			}
+
+			//
+			// A pixel is kept when it is greater than its neighbour before it along the gradient direction and not less
+			// than the one after it, so that one pixel of a plateau is kept
+			for(uint32_t r = 0; r < rows; ++r)
+			{
+				int j = top + r;
+				const uint8_t* above = magnitude.data + Clamp(j - 1, first);
+				const uint8_t* m = magnitude.data + Clamp(j, first);
+				const uint8_t* below = magnitude.data + Clamp(j + 1, first);
+				const uint8_t* d = direction.data + Clamp(j, first);
+				uint8_t* row = out.pixels + (size_t)j * width;
+				for(uint32_t i = 0; i < width; ++i)
+				{
+					int before = 0;
+					int after = 0;
+					int dx = (d[i] == 2) ? 0 : ((d[i] == 3) ? -1 : 1);
+					const uint8_t* beforeRow = (d[i] == 0) ? m : above;
+					const uint8_t* afterRow = (d[i] == 0) ? m : below;
+					if((int)i - dx >= 0 && (int)i - dx < (int)width)
+					{
+						before = beforeRow[(int)i - dx];
+					}
+					if((int)i + dx >= 0 && (int)i + dx < (int)width)
+					{
+						after = afterRow[(int)i + dx];
+					}
+					row[i] = (m[i] > before && m[i] >= after) ? lut[m[i]] : 0;
+				}
+				if(tresholdMin != tresholdMax)
+				{
+					HysteresisRow(out, top + r, r > 0, parent.data, strong.data);
+				}
+			}
+		}
+	});
+	if(tresholdMin != tresholdMax && !Cancelled())
+	{
+		HysteresisResolve(out, bandHeight, parent.data, strong.data, threadCount);
+	}
+}
+
+//
+// Sets of 4- or 8-connected pixels that are not black in an Indexed8 image. Labels are numbered from 1 in the raster
+// order of the first pixel of each component, 0 is the background, and components[label - 1] describes a label.
+// Bands of rows are labelled in parallel with a union-find whose roots are the smallest indices of their sets, the
+// bands are then united along their seams. Roots are counted and numbered by band, before every pixel takes the
+// label of its root. Other formats give no component.
+/*static*/ void Convolution::LabelComponents(const Convolution::Image& in, std::vector<uint32_t>& labels, std::vector<Convolution::Component>& components, bool eightConnected, uint32_t threadCount)
+{
+	components.clear();
+	if(in.format != Convolution::Image::Format::Indexed8)
+	{
+		labels.assign((size_t)in.width * in.height, 0);
+		return;
+	}
+	size_t size = (size_t)in.width * in.height;
+	labels.resize(size);
+	PooledArray<uint32_t> parent(size);
+	uint32_t bandHeight = BandHeight(in.width);
+	uint32_t bands = (in.height + bandHeight - 1) / bandHeight;
+	ParallelFor(in.height, bandHeight, threadCount, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t j = begin; j < end; ++j)
+		{
+			uint32_t first = j * in.width;
+			for(uint32_t i = 0; i < in.width; ++i)
+			{
+				parent[first + i] = first + i;
+			}
+			UniteRow(in, j, j > begin, eightConnected, parent.data, nullptr);
+		}
+	});
+	if(Cancelled())
+	{
+		return;
+	}
+	for(uint32_t j = bandHeight; j < in.height; j += bandHeight)
+	{
+		UniteRow(in, j, true, eightConnected, parent.data, nullptr);
+	}
+
+	std::vector<uint32_t> firstLabels(bands + 1, 0);
+	ParallelFor(bands, 1, threadCount, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t band = begin; band < end; ++band)
+		{
+			size_t last = std::min((size_t)(band + 1) * bandHeight * in.width, size);
+			for(size_t p = (size_t)band * bandHeight * in.width; p < last; ++p)
+			{
+				firstLabels[band + 1] += (in.pixels[p] != 0 && parent[p] == p);
+			}
+		}
+	});
+	for(uint32_t band = 0; band < bands; ++band)
+	{
+		firstLabels[band + 1] += firstLabels[band];
+	}
+
+	//
+	// Roots are labelled before the other pixels read them
+	const uint32_t* roots = parent.data;
+	for(int pass = 0; pass < 2 && !Cancelled(); ++pass)
+	{
+		ParallelFor(bands, 1, threadCount, [&](uint32_t begin, uint32_t end)
+		{
+			for(uint32_t band = begin; band < end; ++band)
+			{
+				uint32_t label = firstLabels[band];
+				size_t last = std::min((size_t)(band + 1) * bandHeight * in.width, size);
+				for(size_t p = (size_t)band * bandHeight * in.width; p < last; ++p)
+				{
+					bool root = (roots[p] == p);
+					if(in.pixels[p] == 0)
+					{
+						labels[p] = 0;
+					}
+					else if(pass == 0 && root)
+					{
+						labels[p] = ++label;
+					}
+					else if(pass == 1 && !root)
+					{
+						labels[p] = labels[FindRoot(roots, p)];
+					}
+				}
+			}
+		});
+	}
+	if(Cancelled())
+	{
+		return;
+	}
+
+	Convolution::Component empty = { 0, in.width, in.height, 0, 0, 0.0, 0.0 };
+	components.assign(firstLabels[bands], empty);
+	for(uint32_t j = 0; j < in.height; ++j)
+	{
+		const uint32_t* row = labels.data() + (size_t)j * in.width;
+		for(uint32_t i = 0; i < in.width; ++i)
+		{
+			if(row[i] == 0)
+			{
+				continue;
+			}
+			Convolution::Component& component = components[row[i] - 1];
+			++component.area;
+			component.left = std::min(component.left, i);
+			component.top = std::min(component.top, j);
+			component.right = std::max(component.right, i);
+			component.bottom = std::max(component.bottom, j);
+			component.centroidX += i;
+			component.centroidY += j;
+		}
+	}
+	for(size_t c = 0; c < components.size(); ++c)
+	{
+		components[c].centroidX /= components[c].area;
+		components[c].centroidY /= components[c].area;
+	}
+}
+
+//
+// Gray levels up to the minimum become black, above the maximum white, and 150 in between for the hysteresis
+/*static*/ void Convolution::TresholdLut(int tresholdMin, int tresholdMax, uint8_t lut[256])
+{
+	for(int gray = 0; gray < 256; ++gray)
+	{
+		if(gray <= tresholdMin)
+		{
+			lut[gray] = 0;
+		}
+		else if(gray > tresholdMax)
+		{
+			lut[gray] = 255;
+		}
+		else
+		{
+			lut[gray] = 150;
+		}
+	}
+}
+
+//
+// Indexed8 image of the lut entries of the gray levels
+/*static*/ void Convolution::ApplyLut(const Convolution::Image& image, const uint8_t lut[256], Convolution::Image& out, uint32_t threadCount)
+{
+	out.Resize(image.width, image.height, Convolution::Image::Format::Indexed8);
+	ParallelFor(image.height, BandHeight(image.width * PixelSize(image.format)), threadCount, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t j = begin; j < end; ++j)
+		{
+			LutRow(image, j, lut, out.pixels + (size_t)j * out.width);
+		}
+	});
+}
+
+//
+// Count of each gray level
+/*static*/ void Convolution::Histogram(const Convolution::Image& image, uint32_t histogram[256])
+{
+	memset(histogram, 0, 256 * sizeof(uint32_t));
+	uint8_t identity[256];
+	for(uint32_t i = 0; i < 256; ++i)
+	{
+		identity[i] = (uint8_t)i;
+	}
+	PooledArray<uint8_t> gray(image.width);
+	for(uint32_t j = 0; j < image.height; ++j)
+	{
+		const uint8_t* row = image.pixels + (size_t)j * image.width;
+		if(image.format != Convolution::Image::Format::Indexed8)
+		{
+			LutRow(image, j, identity, gray.data);
+			row = gray.data;
+		}
+		for(uint32_t i = 0; i < image.width; ++i)
+		{
+			++histogram[row[i]];
+		}
+	}
+}
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+inline double ConvertAngleDtoR(double alpha)
+{
+	return alpha * M_PI / 180.0;
+}
+inline double ConvertAngleRtoD(double alpha)
+{
+	return alpha / 180.0 / M_PI;
+}
+
+//
+//
+// COHEN-SUTHERLAND ALGORITHM TO CLIP LINE IN IMAGE
+
+typedef int OutCode;
+
+const int INSIDE = 0; // 0000
+const int LEFT = 1;   // 0001
+const int RIGHT = 2;  // 0010
+const int BOTTOM = 4; // 0100
+const int TOP = 8;    // 1000
+
+// Compute the bit code for a point (x, y) using the clip rectangle
+// bounded diagonally by (xmin, ymin), and (xmax, ymax)
+
+// ASSUME THAT xmax, xmin, ymax and ymin are global constants.
+
+OutCode ComputeOutCode(double x, double y, double xmin, double xmax, double ymin, double ymax)
+{
+	OutCode code;
+
+	code = INSIDE;          // initialised as being inside of [[clip window]]
+
+	if (x < xmin)           // to the left of clip window
+		code |= LEFT;
+	else if (x > xmax)      // to the right of clip window
+		code |= RIGHT;
+	if (y < ymin)           // below the clip window
+		code |= BOTTOM;
+	else if (y > ymax)      // above the clip window
+		code |= TOP;
+
+	return code;
+}
+
+// Cohen–Sutherland clipping algorithm clips a line from
+// P0 = (x0, y0) to P1 = (x1, y1) against a rectangle with
+// diagonal from (xmin, ymin) to (xmax, ymax).
+bool CohenSutherlandLineClip(	double x0, double y0, double x1, double y1,
+								double&x0o,double&y0o,double&x1o,double&y1o,
+								double xmin, double xmax, double ymin, double ymax)
+{
+	// compute outcodes for P0, P1, and whatever point lies outside the clip rectangle
+	OutCode outcode0 = ComputeOutCode(x0, y0, xmin, xmax, ymin, ymax);
 	OutCode outcode1 = ComputeOutCode(x1, y1, xmin, xmax, ymin, ymax);
 	bool accept = false;
 
-	while (true) {
-		if (!(outcode0 | outcode1)) { // Bitwise OR is 0. Trivially accept and get out of loop
-			accept = true;
-			break;
-		} else if (outcode0 & outcode1) { // Bitwise AND is not 0. Trivially reject and get out of loop
-			break;
-		} else {
-			// failed both tests, so calculate the line segment to clip
-			// from an outside point to an intersection with clip edge
-			double x, y;
+	while (true) {
+		if (!(outcode0 | outcode1)) { // Bitwise OR is 0. Trivially accept and get out of loop
+			accept = true;
+			break;
+		} else if (outcode0 & outcode1) { // Bitwise AND is not 0. Trivially reject and get out of loop
+			break;
+		} else {
+			// failed both tests, so calculate the line segment to clip
+			// from an outside point to an intersection with clip edge
+			double x, y;
+
+			// At least one endpoint is outside the clip rectangle; pick it.
+			OutCode outcodeOut = outcode0 ? outcode0 : outcode1;
+
+			// Now find the intersection point;
+			// use formulas y = y0 + slope * (x - x0), x = x0 + (1 / slope) * (y - y0)
+			if (outcodeOut & TOP) {           // point is above the clip rectangle
+				x = x0 + (x1 - x0) * (ymax - y0) / (y1 - y0);
+				y = ymax;
+			} else if (outcodeOut & BOTTOM) { // point is below the clip rectangle
+				x = x0 + (x1 - x0) * (ymin - y0) / (y1 - y0);
+				y = ymin;
+			} else if (outcodeOut & RIGHT) {  // point is to the right of clip rectangle
+				y = y0 + (y1 - y0) * (xmax - x0) / (x1 - x0);
+				x = xmax;
+			} else if (outcodeOut & LEFT) {   // point is to the left of clip rectangle
+				y = y0 + (y1 - y0) * (xmin - x0) / (x1 - x0);
+				x = xmin;
+			}
+
+			// Now we move outside point to intersection point to clip
+			// and get ready for next pass.
+			if (outcodeOut == outcode0) {
+				x0 = x;
+				y0 = y;
+				outcode0 = ComputeOutCode(x0, y0, xmin, xmax, ymin, ymax);
+			} else {
+				x1 = x;
+				y1 = y;
+				outcode1 = ComputeOutCode(x1, y1, xmin, xmax, ymin, ymax);
+			}
+		}
+	}
+	if (accept) {
+		x0o = x0;
+		y0o = y0;
+		x1o = x1;
+		y1o = y1;
+	}
+	return accept;
+}
+
+// END COHEN-SUTHERLAND ALGORITHM
+//
+//
+
+void SetPixel(Convolution::Image* image, int x, int y, int color)
+{
+	if(x < 0 || x >= image->width || y < 0 || y >= image->height)
+	{
+		return;
+	}
+	switch(image->format)
+	{
+	case Convolution::Image::Format::RGB:
+		image->pixels[(x + y * image->width) * 3] =		(uint8_t)((color & 0xff0000) >> 16);
+		image->pixels[(x + y * image->width) * 3 + 1] = (uint8_t)((color & 0xff00) >> 8);
+		image->pixels[(x + y * image->width) * 3 + 2] = (uint8_t)((color & 0xff));
+		break;
+	case Convolution::Image::Format::ARGB:
+		image->pixels[(x + y * image->width) * 4] = 0xff;
+		image->pixels[(x + y * image->width) * 4 + 1] = (uint8_t)((color & 0xff0000) >> 16);
+		image->pixels[(x + y * image->width) * 4 + 2] = (uint8_t)((color & 0xff00) >> 8);
+		image->pixels[(x + y * image->width) * 4 + 3] = (uint8_t)((color & 0xff));
+		break;
+	case Convolution::Image::Format::Indexed8:
+		image->pixels[x + y * image->width] = color & 0xff;
+		break;
+	}
+}
+
+//
+//
+// BRESENHAM ALGORITHM TO DRAW A LINE
+
+void Bresenham(int x1, int y1, int const x2, int const y2, int color, Convolution::Image* image)
+{
+	int delta_x(x2 - x1);
+	// if x1 == x2, then it does not matter what we set here
+	signed char const ix((delta_x > 0) - (delta_x < 0));
+	delta_x = std::abs(delta_x) << 1;
+
+	int delta_y(y2 - y1);
+	// if y1 == y2, then it does not matter what we set here
+	signed char const iy((delta_y > 0) - (delta_y < 0));
+	delta_y = std::abs(delta_y) << 1;
+
+	SetPixel(image, x1, y1, color);
+
+	if (delta_x >= delta_y)
+	{
+		// error may go below zero
+		int error(delta_y - (delta_x >> 1));
+
+		while (x1 != x2)
+		{
+			if ((error >= 0) && (error || (ix > 0)))
+			{
+				error -= delta_x;
+				y1 += iy;
+			}
+			// else do nothing
+
+			error += delta_y;
+			x1 += ix;
+
+			SetPixel(image, x1, y1, color);
+		}
+	}
+	else
+	{
+		// error may go below zero
+		int error(delta_x - (delta_y >> 1));
+
+		while (y1 != y2)
+		{
+			if ((error >= 0) && (error || (iy > 0)))
+			{
+				error -= delta_y;
+				x1 += ix;
+			}
+			// else do nothing
+
+			error += delta_x;
+			y1 += iy;
+
+			SetPixel(image, x1, y1, color);
+		}
+	}
+}
+//
+// Orientation of the pixels without gradient
+const uint8_t ORIENTATION_NONE = 255;
+
+//
+// Direction of the gray level gradient of each pixel, from Sobel derivatives, in degrees modulo 180. This is the angle
+// of the normal to the edge going through the pixel, as used by Hough. Pixels without gradient are set to 255.
+/*static*/ void Convolution::Orientation(const Convolution::Image& image, Convolution::Image& out, uint32_t threadCount)
+{
+	Convolution::Image gray;
+	if(image.format == Convolution::Image::Format::Indexed8)
+	{
+		gray = image;
+	}
+	else
+	{
+		ToGrayScale(image, gray);
+	}
+	out.Resize(image.width, image.height, Convolution::Image::Format::Indexed8);
+	ParallelFor(gray.height, BandHeight(gray.width), threadCount, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t j = begin; j < end; ++j)
+		{
+			const uint8_t* above = gray.pixels + (size_t)((j > 0) ? j - 1 : j) * gray.width;
+			const uint8_t* row = gray.pixels + (size_t)j * gray.width;
+			const uint8_t* below = gray.pixels + (size_t)((j + 1 < gray.height) ? j + 1 : j) * gray.width;
+			uint8_t* outRow = out.pixels + (size_t)j * out.width;
+			for(uint32_t i = 0; i < gray.width; ++i)
+			{
+				uint32_t left = (i > 0) ? i - 1 : i;
+				uint32_t right = (i + 1 < gray.width) ? i + 1 : i;
+				int gx = (above[right] + 2 * row[right] + below[right]) - (above[left] + 2 * row[left] + below[left]);
+				int gy = (below[left] + 2 * below[i] + below[right]) - (above[left] + 2 * above[i] + above[right]);
+				if(gx == 0 && gy == 0)
+				{
+					outRow[i] = ORIENTATION_NONE;
+					continue;
+				}
+				int angle = (int)lround(atan2((double)gy, (double)gx) * 180.0 / M_PI);
+				outRow[i] = (uint8_t)(((angle % 180) + 180) % 180);
+			}
+		}
+	});
+}
+
+//
+// Orientation bins of the suppression along the gradient direction: the normal is within 22.5 degrees of 0, 45, 90 or
+// 135, the orientations being rounded to integers
+inline int RefineBin(uint8_t orientation)
+{
+	return (orientation < 23 || orientation >= 158) ? 0 : ((orientation < 68) ? 1 : ((orientation < 113) ? 2 : 3));
+}
+
+//
+// Suppression of one pixel along its normal, with the neighbours outside of the image counted as 0. Pixels without
+// orientation have no neighbour to compare to and are kept.
+inline uint8_t RefinePixel(const Convolution::Image& tresholded, const Convolution::Image& gradient, const Convolution::Image& orientation, uint32_t i, uint32_t j)
+{
+	static const int NORMAL_X[4] = { 1, 1, 0, -1 };
+	static const int NORMAL_Y[4] = { 0, 1, 1, 1 };
+	size_t index = i + (size_t)j * tresholded.width;
+	if(tresholded.pixels[index] == 0)
+	{
+		return 0;
+	}
+	if(orientation.pixels[index] == ORIENTATION_NONE)
+	{
+		return 255;
+	}
+	int bin = RefineBin(orientation.pixels[index]);
+	int values[2] = { 0, 0 };
+	for(int side = 0; side < 2; ++side)
+	{
+		int x = (int)i + (side ? NORMAL_X[bin] : -NORMAL_X[bin]);
+		int y = (int)j + (side ? NORMAL_Y[bin] : -NORMAL_Y[bin]);
+		if(x >= 0 && x < (int)tresholded.width && y >= 0 && y < (int)tresholded.height)
+		{
+			values[side] = gradient.pixels[x + (size_t)y * tresholded.width];
+		}
+	}
+	uint8_t magnitude = gradient.pixels[index];
+	return (magnitude > values[0] && magnitude >= values[1]) ? 255 : 0;
+}
+
+#if defined(__SSE2__)
+//
+// Unsigned byte comparison a >= b
+inline __m128i GreaterOrEqualU8(__m128i a, __m128i b)
+{
+	return _mm_cmpeq_epi8(_mm_max_epu8(a, b), a);
+}
 
-			// At least one endpoint is outside the clip rectangle; pick it.
-			OutCode outcodeOut = outcode0 ? outcode0 : outcode1;
+//
+// Suppression of 16 interior pixels starting at column i: every bin selects its pair of neighbours through masks
+void RefineInterior16(const uint8_t* tresholded, const uint8_t* above, const uint8_t* row, const uint8_t* below, const uint8_t* orientation, uint32_t i, uint8_t* out)
+{
+	__m128i o = _mm_loadu_si128((const __m128i*)(orientation + i));
+	__m128i bin1 = GreaterOrEqualU8(o, _mm_set1_epi8(23));
+	__m128i bin2 = GreaterOrEqualU8(o, _mm_set1_epi8(68));
+	__m128i bin3 = GreaterOrEqualU8(o, _mm_set1_epi8(113));
+	__m128i bin0 = GreaterOrEqualU8(o, _mm_set1_epi8((char)158));
+	__m128i none = _mm_cmpeq_epi8(o, _mm_set1_epi8((char)ORIENTATION_NONE));
+	bin0 = _mm_or_si128(bin0, _mm_xor_si128(bin1, _mm_set1_epi8((char)0xff)));
+	bin3 = _mm_andnot_si128(bin0, bin3);
+	bin2 = _mm_andnot_si128(_mm_or_si128(bin0, bin3), bin2);
+	bin1 = _mm_andnot_si128(_mm_or_si128(_mm_or_si128(bin0, bin2), bin3), bin1);
+
+	__m128i before = _mm_and_si128(bin0, _mm_loadu_si128((const __m128i*)(row + i - 1)));
+	before = _mm_or_si128(before, _mm_and_si128(bin1, _mm_loadu_si128((const __m128i*)(above + i - 1))));
+	before = _mm_or_si128(before, _mm_and_si128(bin2, _mm_loadu_si128((const __m128i*)(above + i))));
+	before = _mm_or_si128(before, _mm_and_si128(bin3, _mm_loadu_si128((const __m128i*)(above + i + 1))));
+	__m128i after = _mm_and_si128(bin0, _mm_loadu_si128((const __m128i*)(row + i + 1)));
+	after = _mm_or_si128(after, _mm_and_si128(bin1, _mm_loadu_si128((const __m128i*)(below + i + 1))));
+	after = _mm_or_si128(after, _mm_and_si128(bin2, _mm_loadu_si128((const __m128i*)(below + i))));
+	after = _mm_or_si128(after, _mm_and_si128(bin3, _mm_loadu_si128((const __m128i*)(below + i - 1))));
+
+	__m128i magnitude = _mm_loadu_si128((const __m128i*)(row + i));
+	__m128i keep = _mm_andnot_si128(GreaterOrEqualU8(before, magnitude), GreaterOrEqualU8(magnitude, after));
+	keep = _mm_or_si128(keep, none);
+	__m128i edge = _mm_xor_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(tresholded + i)), _mm_setzero_si128()), _mm_set1_epi8((char)0xff));
+	_mm_storeu_si128((__m128i*)(out + i), _mm_and_si128(keep, edge));
+}
+#endif
 
-			// Now find the intersection point;
-			// use formulas y = y0 + slope * (x - x0), x = x0 + (1 / slope) * (y - y0)
-			if (outcodeOut & TOP) {           // point is above the clip rectangle
-				x = x0 + (x1 - x0) * (ymax - y0) / (y1 - y0);
-				y = ymax;
-			} else if (outcodeOut & BOTTOM) { // point is below the clip rectangle
-				x = x0 + (x1 - x0) * (ymin - y0) / (y1 - y0);
-				y = ymin;
-			} else if (outcodeOut & RIGHT) {  // point is to the right of clip rectangle
-				y = y0 + (y1 - y0) * (xmax - x0) / (x1 - x0);
-				x = xmax;
-			} else if (outcodeOut & LEFT) {   // point is to the left of clip rectangle
-				y = y0 + (y1 - y0) * (xmin - x0) / (x1 - x0);
-				x = xmin;
+//
+// Thinning of the edges by non maximum suppression along the gradient direction: an edge pixel is kept when its
+// gradient is greater than the one of its neighbour behind it along the normal and not less than the one in front of
+// it, so that one pixel of a plateau survives. The orientation, as computed by Orientation, is quantized in 4 bins.
+// The first and last rows and columns are handled apart so that the interior needs no bounds test.
+// The gradient and the orientation must be gray scale images of the size of tresholded: without such a gradient no
+// edge is kept, without such an orientation the edges are refined against all their neighbours.
+/*static*/ void Convolution::Refine(const Convolution::Image& tresholded, const Convolution::Image& gradient, const Convolution::Image& orientation, Convolution::Image& out, uint32_t threadCount)
+{
+	uint32_t width = tresholded.width;
+	uint32_t height = tresholded.height;
+	if(gradient.format != Convolution::Image::Format::Indexed8 || gradient.width != width || gradient.height != height)
+	{
+		out.Resize(width, height, Convolution::Image::Format::Indexed8);
+		memset(out.pixels, 0, (size_t)width * height);
+		return;
+	}
+	if(orientation.format != Convolution::Image::Format::Indexed8 || orientation.width != width || orientation.height != height)
+	{
+		Refine(tresholded, gradient, out);
+		return;
+	}
+	out.Resize(width, height, Convolution::Image::Format::Indexed8);
+
+	//
+	// Offsets of the neighbours behind the pixel along the normal of each bin, the ones in front are opposite
+	const ptrdiff_t offsets[4] = { -1, -(ptrdiff_t)width - 1, -(ptrdiff_t)width, -(ptrdiff_t)width + 1 };
+	ParallelFor(height, BandHeight(width * 4), threadCount, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t j = begin; j < end && !Cancelled(); ++j)
+		{
+			uint8_t* outRow = out.pixels + (size_t)j * width;
+			if(j == 0 || j + 1 == height || width < 3)
+			{
+				for(uint32_t i = 0; i < width; ++i)
+				{
+					outRow[i] = RefinePixel(tresholded, gradient, orientation, i, j);
+				}
+				continue;
+			}
+			const uint8_t* edges = tresholded.pixels + (size_t)j * width;
+			const uint8_t* row = gradient.pixels + (size_t)j * width;
+			const uint8_t* above = row - width;
+			const uint8_t* below = row + width;
+			const uint8_t* normals = orientation.pixels + (size_t)j * width;
+			outRow[0] = RefinePixel(tresholded, gradient, orientation, 0, j);
+			uint32_t i = 1;
+#if defined(__SSE2__)
+			for(; i + 17 <= width; i += 16)
+			{
+				RefineInterior16(edges, above, row, below, normals, i, outRow);
+			}
+#endif
+			for(; i + 1 < width; ++i)
+			{
+				ptrdiff_t offset = offsets[RefineBin(normals[i])];
+				uint8_t magnitude = row[i];
+				bool keep = (normals[i] == ORIENTATION_NONE) || (magnitude > row[i + offset] && magnitude >= row[i - offset]);
+				outRow[i] = (edges[i] != 0 && keep) ? 255 : 0;
+			}
+			outRow[width - 1] = RefinePixel(tresholded, gradient, orientation, width - 1, j);
+		}
+	});
+}
+
+/*static*/ Convolution::Image* Convolution::Hough(const Convolution::Image& in, const Convolution::Image& original, Convolution::Image** accumulator, int alphaPrecision, int treshold, int maximas, int lineColor, uint32_t threadCount, const Convolution::Image* orientation, int angleWindow)
+{
+	Convolution::Image* out = new Convolution::Image();
+	*accumulator = new Convolution::Image();
+	Hough(in, original, *out, *accumulator, alphaPrecision, treshold, maximas, lineColor, threadCount, orientation, angleWindow);
+	return out;
+}
+
+//
+// Vote of the edge pixels of rows [begin, end) in the accumulator. The products of the line equation are the ones
+// of the per angle formula, taken from tables, so that the votes land in the same cells. Votes falling outside of
+// the accumulator, for lines passing next to the corners, are dropped.
+// With an orientation plane, a pixel only votes for the angles within the window around its edge normal, and for
+// all of them when it has no orientation.
+void HoughVote(const Convolution::Image& in, uint32_t begin, uint32_t end, const double* cosTable, const double* sinTable, int alphaPrecision, int accHeight, const Convolution::Image* orientation, int angleWindow, int* accu, bool reportRows)
+{
+	int accHeight2 = accHeight * 2.0;
+	double centerX = in.width / 2;
+	double centerY = in.height / 2;
+	PooledArray<double> rowTerms(alphaPrecision);
+	for(uint32_t j = begin; j < end; ++j)
+	{
+		if(reportRows ? !KeepRunning(j, in.height) : Cancelled())
+		{
+			return;
+		}
+		for(int alpha = 0; alpha < alphaPrecision; ++alpha)
+		{
+			rowTerms[alpha] = ((double)j - centerY) * sinTable[alpha];
+		}
+		const uint8_t* row = in.pixels + (size_t)j * in.width;
+		const uint8_t* normals = (orientation != nullptr) ? orientation->pixels + (size_t)j * in.width : nullptr;
+		for(uint32_t i = 0; i < in.width; ++i)
+		{
+			if(row[i] != 255)
+			{
+				continue;
+			}
+			double x = (double)i - centerX;
+			auto vote = [&](int alpha)
+			{
+				double rotation = (x * cosTable[alpha]) + rowTerms[alpha];
+				long rho = lround(rotation + accHeight);
+				if(rho >= 0 && rho < accHeight2)
+				{
+					++accu[rho * alphaPrecision + alpha];
+				}
+			};
+			if(normals == nullptr || normals[i] == ORIENTATION_NONE || angleWindow >= 90)
+			{
+				for(int alpha = 0; alpha < alphaPrecision; ++alpha)
+				{
+					vote(alpha);
+				}
+				continue;
+			}
+			//
+			// Angles a and a + 180 describe the same lines
+			for(int delta = -angleWindow; delta <= angleWindow; ++delta)
+			{
+				for(int alpha = (normals[i] + delta + 180) % 180; alpha < alphaPrecision; alpha += 180)
+				{
+					vote(alpha);
+				}
 			}
+		}
+	}
+}
 
-			// Now we move outside point to intersection point to clip
-			// and get ready for next pass.
-			if (outcodeOut == outcode0) {
-				x0 = x;
-				y0 = y;
-				outcode0 = ComputeOutCode(x0, y0, xmin, xmax, ymin, ymax);
-			} else {
-				x1 = x;
-				y1 = y;
-				outcode1 = ComputeOutCode(x1, y1, xmin, xmax, ymin, ymax);
+//
+// Lines are drawn over a copy of the original image, the accumulator is only filled when given
+/*static*/ void Convolution::Hough(const Convolution::Image& in, const Convolution::Image& original, Convolution::Image& out, Convolution::Image* accumulator, int alphaPrecision, int treshold, int maximas, int lineColor, uint32_t threadCount, const Convolution::Image* orientation, int angleWindow)
+{
+	std::vector<Convolution::HoughLine> lines;
+	HoughLines(in, lines, accumulator, alphaPrecision, treshold, maximas, threadCount, orientation, angleWindow);
+	if(Cancelled())
+	{
+		return;
+	}
+	out.Resize(original.width, original.height, original.format);
+	for(uint32_t i = 0; i < 256; ++i)
+	{
+		out.colorTable[i] = original.colorTable[i];
+	}
+	memcpy(out.pixels, original.pixels, original.width * original.height * Convolution::PixelSize(original.format));
+	DrawHoughLines(lines, out, lineColor);
+}
+
+//
+// Lines of the edge image, made of its pixels at 255, whose accumulator cell reaches the treshold and is the greatest
+// of the cells around it, maximas being the size of that neighbourhood. They are sorted by decreasing votes.
+// Stripes of rows vote in accumulators of their own, which are then added in stripe order.
+// The orientation plane, when given, is the one computed by Orientation for an image of the same size, other sizes
+// are ignored.
+/*static*/ void Convolution::HoughLines(const Convolution::Image& in, std::vector<Convolution::HoughLine>& lines, Convolution::Image* accumulator, int alphaPrecision, int treshold, int maximas, uint32_t threadCount, const Convolution::Image* orientation, int angleWindow)
+{
+	lines.clear();
+	int accHeight = (sqrt(2.0) * (double)(in.height > in.width ? in.height : in.width)) / 2.0;
+	int accHeight2 = accHeight * 2.0;
+	int size = alphaPrecision * accHeight2;
+
+	PooledArray<double> cosTable(alphaPrecision);
+	PooledArray<double> sinTable(alphaPrecision);
+	for(int alpha = 0; alpha < alphaPrecision; ++alpha)
+	{
+		double alphaRad = ConvertAngleDtoR(alpha);
+		cosTable[alpha] = cos(alphaRad);
+		sinTable[alpha] = sin(alphaRad);
+	}
+
+	if(orientation != nullptr && (orientation->width != in.width || orientation->height != in.height))
+	{
+		orientation = nullptr;
+	}
+
+	uint32_t stripes = std::max(std::min(Convolution::ThreadCount(threadCount), in.height), (uint32_t)1);
+	PooledArray<int> accu((size_t)size * stripes);
+	ParallelFor(stripes, 1, threadCount, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t stripe = begin; stripe < end; ++stripe)
+		{
+			int* votes = accu.data + (size_t)size * stripe;
+			memset(votes, 0, size * sizeof(int));
+			HoughVote(in, stripe * in.height / stripes, (stripe + 1) * in.height / stripes, cosTable.data, sinTable.data, alphaPrecision, accHeight, orientation, std::max(angleWindow, 0), votes, stripes == 1);
+		}
+	});
+	if(stripes > 1)
+	{
+		ParallelFor(size, 64 * 1024, threadCount, [&](uint32_t begin, uint32_t end)
+		{
+			for(uint32_t stripe = 1; stripe < stripes; ++stripe)
+			{
+				const int* votes = accu.data + (size_t)size * stripe;
+				for(uint32_t i = begin; i < end; ++i)
+				{
+					accu[i] += votes[i];
+				}
+			}
+		});
+	}
+	if(Cancelled())
+	{
+		return;
+	}
+	if(maximas > 9)
+	{
+		maximas = 9;
+	}
+	else if(maximas < 1)
+	{
+		maximas = 1;
+	}
+
+	maximas /= 2;
+
+	//
+	// A cell is a peak when no cell of its neighbourhood is greater. The greatest cell of the neighbourhood comes from a
+	// maximum filter along the angles, then one along the distances done only for the cells over the treshold.
+	PooledArray<int> rowMaxima(size);
+	ParallelFor(accHeight2, BandHeight(alphaPrecision * sizeof(int)), threadCount, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t rotation = begin; rotation < end; ++rotation)
+		{
+			const int* row = accu.data + rotation * alphaPrecision;
+			int* maxima = rowMaxima.data + rotation * alphaPrecision;
+			for(int alpha = 0; alpha < alphaPrecision; ++alpha)
+			{
+				int greatest = row[alpha];
+				int last = std::min(alpha + maximas, alphaPrecision - 1);
+				for(int lx = std::max(alpha - maximas, 0); lx <= last; ++lx)
+				{
+					greatest = std::max(greatest, row[lx]);
+				}
+				maxima[alpha] = greatest;
+			}
+		}
+	});
+	for(int rotation = 0; rotation < accHeight2; ++rotation)
+	{
+		for(int alpha = 0; alpha < alphaPrecision; ++alpha)
+		{
+			int votes = accu[rotation * alphaPrecision + alpha];
+			if(votes < treshold)
+			{
+				continue;
+			}
+			bool peak = true;
+			int last = std::min(rotation + maximas, accHeight2 - 1);
+			for(int ly = std::max(rotation - maximas, 0); ly <= last && peak; ++ly)
+			{
+				peak = (rowMaxima[ly * alphaPrecision + alpha] <= votes);
+			}
+			if(peak)
+			{
+				Convolution::HoughLine line = { rotation - accHeight, alpha, votes };
+				lines.push_back(line);
+			}
+		}
+	}
+	std::stable_sort(lines.begin(), lines.end(), [](const Convolution::HoughLine& a, const Convolution::HoughLine& b)
+	{
+		return a.votes > b.votes;
+	});
+
+	if(accumulator != nullptr)
+	{
+		int maxHough = 0;
+		for(int i = 0; i < size; ++i)
+		{
+			maxHough = std::max(maxHough, accu[i]);
+		}
+		accumulator->Resize(alphaPrecision, accHeight * 2.0, Convolution::Image::Format::Indexed8);
+
+		double multiplier = (maxHough > 0) ? 255.0 / maxHough : 0.0;
+		for(int i = 0; i < size; ++i)
+		{
+			accumulator->pixels[i] = accu[i] * multiplier;
+		}
+	}
+}
+
+//
+// Draw lines found in an image of the size of out
+/*static*/ void Convolution::DrawHoughLines(const std::vector<Convolution::HoughLine>& lines, Convolution::Image& out, int lineColor)
+{
+	for(uint32_t i = 0; i < lines.size(); ++i)
+	{
+		int alpha = lines[i].theta;
+		double rho = lines[i].rho;
+		int x1, y1, x2, y2;
+		x1 = y1 = x2 = y2 = 0;
+		double alphaRad = ConvertAngleDtoR(alpha);
+
+		if(alpha >= 45 && alpha <= 135)
+		{
+			 x1 = 0;
+			 y1 = (rho - (((double)x1 - (out.width / 2.0) ) * cos(alphaRad))) / sin(alphaRad) + (out.height / 2.0);
+			 x2 = out.width;
+			 y2 = (rho - (((double)x2 - (out.width / 2.0) ) * cos(alphaRad))) / sin(alphaRad) + (out.height / 2.0);
+		}
+		else
+		{
+			 y1 = 0;
+			 x1 = (rho - (((double)y1 - (out.height / 2.0) ) * sin(alphaRad))) / cos(alphaRad) + (out.width / 2.0);
+			 y2 = out.height;
+			 x2 = (rho - (((double)y2 - (out.height / 2.0) ) * sin(alphaRad))) / cos(alphaRad) + (out.width / 2.0);
+		}
+
+		double drawX1 = 0, drawX2 = 0, drawY1 = 0, drawY2 = 0;
+		if(CohenSutherlandLineClip(x1, y1, x2, y2, drawX1, drawY1, drawX2, drawY2, 0, out.width, 0, out.height))
+		{
+			Bresenham(drawX1, drawY1, drawX2, drawY2, lineColor, &out);
+		}
+	}
+}
+
+//
+// State of the edge pixels in the probabilistic Hough transformation
+const uint8_t HOUGH_POINT_NONE = 0;
+const uint8_t HOUGH_POINT_WAITING = 1;
+const uint8_t HOUGH_POINT_VOTED = 2;
+
+//
+// Pixels a segment may miss before its walk stops
+const int PROBABILISTIC_HOUGH_GAP = 3;
+
+//
+// Fixed so that a given image always gives the same lines
+const uint32_t PROBABILISTIC_HOUGH_SEED = 0x5eed;
+
+//
+// Progressive probabilistic Hough transformation: edge pixels are visited in a random order and vote one at a time.
+// As soon as a vote brings a cell to the treshold, the segment of that line going through the pixel is followed in
+// the edge image, drawn, and its pixels are removed, taking their votes back. At most sampleBudget pixels vote,
+// every pixel when it is 0, which bounds the time spent on dense edge images.
+/*static*/ void Convolution::ProbabilisticHough(const Convolution::Image& in, const Convolution::Image& original, Convolution::Image& out, int alphaPrecision, int treshold, uint32_t sampleBudget, int lineColor)
+{
+	int accHeight = (sqrt(2.0) * (double)(in.height > in.width ? in.height : in.width)) / 2.0;
+	int accHeight2 = accHeight * 2.0;
+	int size = alphaPrecision * accHeight2;
+	PooledArray<int> accu(size);
+	memset(accu.data, 0, size * sizeof(int));
+
+	PooledArray<double> cosTable(alphaPrecision);
+	PooledArray<double> sinTable(alphaPrecision);
+	for(int alpha = 0; alpha < alphaPrecision; ++alpha)
+	{
+		double alphaRad = ConvertAngleDtoR(alpha);
+		cosTable[alpha] = cos(alphaRad);
+		sinTable[alpha] = sin(alphaRad);
+	}
+	double centerX = in.width / 2;
+	double centerY = in.height / 2;
+
+	PooledArray<uint8_t> mask((size_t)in.width * in.height);
+	std::vector<uint32_t> points;
+	for(uint32_t i = 0; i < in.width * in.height; ++i)
+	{
+		mask[i] = (in.pixels[i] == 255) ? HOUGH_POINT_WAITING : HOUGH_POINT_NONE;
+		if(mask[i] != HOUGH_POINT_NONE)
+		{
+			points.push_back(i);
+		}
+	}
+	std::mt19937 random(PROBABILISTIC_HOUGH_SEED);
+	std::shuffle(points.begin(), points.end(), random);
+
+	out.Resize(original.width, original.height, original.format);
+	memcpy(out.colorTable, original.colorTable, sizeof(out.colorTable));
+	memcpy(out.pixels, original.pixels, (size_t)original.width * original.height * Convolution::PixelSize(original.format));
+
+	//
+	// Add or take back the votes of a pixel, returns the greatest cell it voted for
+	auto vote = [&](uint32_t point, int increment, int& bestAlpha) -> int
+	{
+		double x = (double)(point % in.width) - centerX;
+		double y = (double)(point / in.width) - centerY;
+		int best = 0;
+		for(int alpha = 0; alpha < alphaPrecision; ++alpha)
+		{
+			long rho = lround((x * cosTable[alpha]) + (y * sinTable[alpha]) + accHeight);
+			if(rho >= 0 && rho < accHeight2)
+			{
+				int v = (accu[rho * alphaPrecision + alpha] += increment);
+				if(v > best)
+				{
+					best = v;
+					bestAlpha = alpha;
+				}
+			}
+		}
+		return best;
+	};
+
+	uint32_t samples = 0;
+	for(size_t p = 0; p < points.size() && (sampleBudget == 0 || samples < sampleBudget); ++p)
+	{
+		if((p & 1023) == 0 && !KeepRunning(p, points.size()))
+		{
+			return;
+		}
+		uint32_t point = points[p];
+		if(mask[point] != HOUGH_POINT_WAITING)
+		{
+			continue;
+		}
+		++samples;
+		mask[point] = HOUGH_POINT_VOTED;
+		int alpha = 0;
+		if(vote(point, 1, alpha) < treshold)
+		{
+			continue;
+		}
+
+		//
+		// Follow the line from the pixel in both directions, one pixel along its main axis at each step
+		double dx = -sinTable[alpha];
+		double dy = cosTable[alpha];
+		double step = std::max(fabs(dx), fabs(dy));
+		dx /= step;
+		dy /= step;
+		int x0 = point % in.width;
+		int y0 = point / in.width;
+		int ends[2][2] = { { x0, y0 }, { x0, y0 } };
+		for(int side = 0; side < 2; ++side)
+		{
+			double sign = (side == 0) ? 1.0 : -1.0;
+			int gap = 0;
+			for(int k = 1; gap <= PROBABILISTIC_HOUGH_GAP; ++k)
+			{
+				long x = lround(x0 + sign * k * dx);
+				long y = lround(y0 + sign * k * dy);
+				if(x < 0 || y < 0 || x >= (long)in.width || y >= (long)in.height)
+				{
+					break;
+				}
+				if(mask[y * in.width + x] != HOUGH_POINT_NONE)
+				{
+					gap = 0;
+					ends[side][0] = x;
+					ends[side][1] = y;
+				}
+				else
+				{
+					++gap;
+				}
+			}
+		}
+
+		//
+		// The pixels of the segment cannot be part of another line
+		int removedAlpha = 0;
+		int length = std::max(abs(ends[1][0] - ends[0][0]), abs(ends[1][1] - ends[0][1]));
+		for(int k = 0; k <= length; ++k)
+		{
+			double t = (length == 0) ? 0.0 : (double)k / length;
+			long x = lround(ends[0][0] + t * (ends[1][0] - ends[0][0]));
+			long y = lround(ends[0][1] + t * (ends[1][1] - ends[0][1]));
+			uint32_t index = y * in.width + x;
+			if(mask[index] == HOUGH_POINT_VOTED)
+			{
+				vote(index, -1, removedAlpha);
 			}
+			mask[index] = HOUGH_POINT_NONE;
+		}
+		if(mask[point] == HOUGH_POINT_VOTED)
+		{
+			vote(point, -1, removedAlpha);
+			mask[point] = HOUGH_POINT_NONE;
 		}
+		Bresenham(ends[0][0], ends[0][1], ends[1][0], ends[1][1], lineColor, &out);
 	}
-	if (accept) {
-		x0o = x0;
-		y0o = y0;
-		x1o = x1;
-		y1o = y1;
-	}
-	return accept;
 }
 
-// END COHEN-SUTHERLAND ALGORITHM
 //
+// Memory the centre accumulators of the circle Hough transformation may use together, the threads voting for
+// different radii are limited by it, one accumulator being always allowed
+const size_t HOUGH_CIRCLE_ACCUMULATORS_BYTES = 256 * 1024 * 1024;
+
 //
+// Edge pixel voting in the circle Hough transformation, with the angle of its gradient direction in degrees
+struct HoughCirclePoint
+{
+	int		x;
+	int		y;
+	int		normal;
+};
 
-void SetPixel(Convolution::Image* image, int x, int y, int color)
+//
+// Votes of the points for the centres of the circles of a radius, both ways along their gradient direction, the
+// offsets to the centres being tabulated by angle for the radius.
+// The increment is added to the cells, or they are set to 0 when it is 0. Cells reaching the treshold are listed.
+void HoughCircleVote(const std::vector<HoughCirclePoint>& points, const int* offsetX, const int* offsetY, uint32_t width, uint32_t height, int increment, int treshold, int* accu, std::vector<uint32_t>& reached)
 {
-	if(x < 0 || x >= image->width || y < 0 || y >= image->height)
-	{
-		return;
-	}
-	switch(image->format)
+	for(size_t p = 0; p < points.size(); ++p)
 	{
-	case Convolution::Image::Format::RGB:
-		image->pixels[(x + y * image->width) * 3] =		(uint8_t)((color & 0xff0000) >> 16);
-		image->pixels[(x + y * image->width) * 3 + 1] = (uint8_t)((color & 0xff00) >> 8);
-		image->pixels[(x + y * image->width) * 3 + 2] = (uint8_t)((color & 0xff));
-		break;
-	case Convolution::Image::Format::ARGB:
-		image->pixels[(x + y * image->width) * 4] = 0xff;
-		image->pixels[(x + y * image->width) * 4 + 1] = (uint8_t)((color & 0xff0000) >> 16);
-		image->pixels[(x + y * image->width) * 4 + 2] = (uint8_t)((color & 0xff00) >> 8);
-		image->pixels[(x + y * image->width) * 4 + 3] = (uint8_t)((color & 0xff));
-		break;
-	case Convolution::Image::Format::Indexed8:
-		image->pixels[x + y * image->width] = color & 0xff;
-		break;
+		for(int side = -1; side <= 1; side += 2)
+		{
+			int cx = points[p].x + side * offsetX[points[p].normal];
+			int cy = points[p].y + side * offsetY[points[p].normal];
+			if(cx < 0 || cy < 0 || cx >= (int)width || cy >= (int)height)
+			{
+				continue;
+			}
+			uint32_t index = cy * width + cx;
+			if(increment == 0)
+			{
+				accu[index] = 0;
+			}
+			else if((accu[index] += increment) == treshold)
+			{
+				reached.push_back(index);
+			}
+		}
 	}
 }
 
 //
-//
-// BRESENHAM ALGORITHM TO DRAW A LINE
-
-void Bresenham(int x1, int y1, int const x2, int const y2, int color, Convolution::Image* image)
+// Circles of radius in [minRadius, maxRadius] going through the edge pixels of in, made of its pixels at 255. Each
+// pixel votes, for every radius, for the two centres along its gradient direction, taken from the orientation plane
+// computed by Orientation for an image of the same size. Pixels without orientation do not vote.
+// Radii are voted for one at a time in a centre accumulator of width * height ints, so the memory does not depend on
+// the number of radii. Each thread voting has its own accumulator, and fewer threads vote when their accumulators
+// would not fit in HOUGH_CIRCLE_ACCUMULATORS_BYTES: the peak is the greater of that budget and a single accumulator,
+// 80 MB for a 20 megapixels image. A centre is kept when its cell reaches the treshold and is the greatest of
+// the cells around it, maximas being the size of that neighbourhood, then when no stronger circle has a centre and a
+// radius that close. They are sorted by decreasing votes.
+/*static*/ void Convolution::HoughCircles(const Convolution::Image& in, const Convolution::Image& orientation, std::vector<Convolution::HoughCircle>& circles, int minRadius, int maxRadius, int treshold, int maximas, uint32_t threadCount)
 {
-	int delta_x(x2 - x1);
-	// if x1 == x2, then it does not matter what we set here
-	signed char const ix((delta_x > 0) - (delta_x < 0));
-	delta_x = std::abs(delta_x) << 1;
-
-	int delta_y(y2 - y1);
-	// if y1 == y2, then it does not matter what we set here
-	signed char const iy((delta_y > 0) - (delta_y < 0));
-	delta_y = std::abs(delta_y) << 1;
-
-	SetPixel(image, x1, y1, color);
+	circles.clear();
+	minRadius = std::max(minRadius, 1);
+	if(maxRadius < minRadius || orientation.width != in.width || orientation.height != in.height)
+	{
+		return;
+	}
+	treshold = std::max(treshold, 1);
+	maximas = std::min(std::max(maximas, 1), 9) / 2;
 
-	if (delta_x >= delta_y)
+	double cosTable[180];
+	double sinTable[180];
+	for(int alpha = 0; alpha < 180; ++alpha)
 	{
-		// error may go below zero
-		int error(delta_y - (delta_x >> 1));
+		double alphaRad = ConvertAngleDtoR(alpha);
+		cosTable[alpha] = cos(alphaRad);
+		sinTable[alpha] = sin(alphaRad);
+	}
+	std::vector<HoughCirclePoint> points;
+	for(uint32_t i = 0; i < in.width * in.height; ++i)
+	{
+		uint8_t normal = orientation.pixels[i];
+		if(in.pixels[i] == 255 && normal < 180)
+		{
+			HoughCirclePoint point = { (int)(i % in.width), (int)(i / in.width), normal };
+			points.push_back(point);
+		}
+	}
 
-		while (x1 != x2)
+	//
+	// Stripes take every stripes-th radius, the candidates are stored by radius so that the result does not depend on
+	// the number of threads
+	uint32_t radii = maxRadius - minRadius + 1;
+	size_t accumulatorBytes = (size_t)in.width * in.height * sizeof(int);
+	size_t affordable = std::max(HOUGH_CIRCLE_ACCUMULATORS_BYTES / std::max(accumulatorBytes, (size_t)1), (size_t)1);
+	uint32_t stripes = (uint32_t)std::min((size_t)std::min(Convolution::ThreadCount(threadCount), radii), affordable);
+	stripes = std::max(stripes, (uint32_t)1);
+	std::vector<std::vector<Convolution::HoughCircle> > candidates(radii);
+	ParallelFor(stripes, 1, stripes, [&](uint32_t begin, uint32_t end)
+	{
+		PooledArray<int> accu((size_t)in.width * in.height);
+		memset(accu.data, 0, accu.size * sizeof(int));
+		std::vector<uint32_t> reached;
+		for(uint32_t stripe = begin; stripe < end; ++stripe)
 		{
-			if ((error >= 0) && (error || (ix > 0)))
+			for(uint32_t r = stripe; r < radii; r += stripes)
 			{
-				error -= delta_x;
-				y1 += iy;
-			}
-			// else do nothing
-
-			error += delta_y;
-			x1 += ix;
+				if((stripes == 1) ? !KeepRunning(r, radii) : Cancelled())
+				{
+					return;
+				}
+				int radius = minRadius + r;
+				int offsetX[180];
+				int offsetY[180];
+				for(int alpha = 0; alpha < 180; ++alpha)
+				{
+					offsetX[alpha] = (int)lround(radius * cosTable[alpha]);
+					offsetY[alpha] = (int)lround(radius * sinTable[alpha]);
+				}
+				reached.clear();
+				HoughCircleVote(points, offsetX, offsetY, in.width, in.height, 1, treshold, accu.data, reached);
+				for(size_t c = 0; c < reached.size(); ++c)
+				{
+					int x = reached[c] % in.width;
+					int y = reached[c] / in.width;
+					int votes = accu[reached[c]];
+					bool peak = true;
+					for(int ly = std::max(y - maximas, 0); ly <= std::min(y + maximas, (int)in.height - 1) && peak; ++ly)
+					{
+						for(int lx = std::max(x - maximas, 0); lx <= std::min(x + maximas, (int)in.width - 1) && peak; ++lx)
+						{
+							peak = (accu[ly * in.width + lx] <= votes);
+						}
+					}
+					if(peak)
+					{
+						Convolution::HoughCircle circle = { x, y, radius, votes };
+						candidates[r].push_back(circle);
+					}
+				}
 
-			SetPixel(image, x1, y1, color);
+				//
+				// Only the voted cells are cleared for the next radius, unless there are more votes than cells
+				if(points.size() * 2 < accu.size)
+				{
+					HoughCircleVote(points, offsetX, offsetY, in.width, in.height, 0, treshold, accu.data, reached);
+				}
+				else
+				{
+					memset(accu.data, 0, accu.size * sizeof(int));
+				}
+			}
 		}
+	});
+	if(Cancelled())
+	{
+		return;
 	}
-	else
+
+	std::vector<Convolution::HoughCircle> sorted;
+	for(uint32_t r = 0; r < radii; ++r)
 	{
-		// error may go below zero
-		int error(delta_x - (delta_y >> 1));
+		sorted.insert(sorted.end(), candidates[r].begin(), candidates[r].end());
+	}
+	std::stable_sort(sorted.begin(), sorted.end(), [](const Convolution::HoughCircle& a, const Convolution::HoughCircle& b)
+	{
+		return a.votes > b.votes;
+	});
+	for(size_t c = 0; c < sorted.size(); ++c)
+	{
+		bool kept = true;
+		for(size_t k = 0; k < circles.size() && kept; ++k)
+		{
+			kept = abs(circles[k].x - sorted[c].x) > maximas || abs(circles[k].y - sorted[c].y) > maximas || abs(circles[k].radius - sorted[c].radius) > maximas;
+		}
+		if(kept)
+		{
+			circles.push_back(sorted[c]);
+		}
+	}
+}
 
-		while (y1 != y2)
+//
+// Midpoint circle algorithm, the parts out of the image are skipped
+/*static*/ void Convolution::DrawHoughCircles(const std::vector<Convolution::HoughCircle>& circles, Convolution::Image& out, int circleColor)
+{
+	for(size_t c = 0; c < circles.size(); ++c)
+	{
+		int cx = circles[c].x;
+		int cy = circles[c].y;
+		int x = circles[c].radius;
+		int y = 0;
+		int error = 1 - x;
+		while(x >= y)
 		{
-			if ((error >= 0) && (error || (iy > 0)))
+			SetPixel(&out, cx + x, cy + y, circleColor);
+			SetPixel(&out, cx + y, cy + x, circleColor);
+			SetPixel(&out, cx - y, cy + x, circleColor);
+			SetPixel(&out, cx - x, cy + y, circleColor);
+			SetPixel(&out, cx - x, cy - y, circleColor);
+			SetPixel(&out, cx - y, cy - x, circleColor);
+			SetPixel(&out, cx + y, cy - x, circleColor);
+			SetPixel(&out, cx + x, cy - y, circleColor);
+			++y;
+			if(error < 0)
 			{
-				error -= delta_y;
-				x1 += ix;
+				error += 2 * y + 1;
 			}
-			// else do nothing
+			else
+			{
+				--x;
+				error += 2 * (y - x) + 1;
+			}
+		}
+	}
+}
 
-			error += delta_x;
-			y1 += iy;
+//
+// Offsets of the neighbours of a pixel in circular order starting on the right, the even ones share a side with it
+const int CONTOUR_NEIGHBOURS[8][2] = { { 1, 0 }, { 1, 1 }, { 0, 1 }, { -1, 1 }, { -1, 0 }, { -1, -1 }, { 0, -1 }, { 1, -1 } };
 
-			SetPixel(image, x1, y1, color);
+//
+// Points back from the end of a contour its direction is measured on when closing a gap
+const uint32_t CONTOUR_DIRECTION_POINTS = 5;
+
+inline bool IsEdge(const Convolution::Image& edges, int x, int y)
+{
+	return x >= 0 && y >= 0 && x < (int)edges.width && y < (int)edges.height && edges.pixels[x + y * edges.width] != 0;
+}
+
+//
+// End of a contour: an edge pixel with a single neighbour, or with two neighbours following each other
+bool IsContourEnd(const Convolution::Image& edges, int x, int y)
+{
+	int count = 0;
+	int first = 0;
+	int last = 0;
+	for(int k = 0; k < 8; ++k)
+	{
+		if(IsEdge(edges, x + CONTOUR_NEIGHBOURS[k][0], y + CONTOUR_NEIGHBOURS[k][1]))
+		{
+			first = (count == 0) ? k : first;
+			last = k;
+			++count;
 		}
 	}
+	return count == 1 || (count == 2 && (last - first == 1 || (first == 0 && last == 7)));
 }
-#include <iostream>
-/*static*/ Convolution::Image* Convolution::Hough(const Convolution::Image& in, const Convolution::Image& original, Convolution::Image** accumulator, int alphaPrecision, int treshold, int maximas, int lineColor)
+
+//
+// Appends the unvisited edge pixels met stepping from start to a neighbour each time, side neighbours first
+void FollowContour(const Convolution::Image& edges, uint8_t* visited, uint32_t start, std::vector<uint32_t>& points)
 {
-	int accHeight = (sqrt(2.0) * (double)(in.height > in.width ? in.height : in.width)) / 2.0;
-	int accHeight2 = accHeight * 2.0;
-	int size = alphaPrecision * accHeight2;
-	int* accu = new int[size];
-	for(int i = 0; i< size; ++i)
+	uint32_t current = start;
+	for(bool found = true; found;)
 	{
-		accu[i] = 0;
+		found = false;
+		int x = current % edges.width;
+		int y = current / edges.width;
+		for(int k = 0; k < 8 && !found; ++k)
+		{
+			//
+			// 0, 2, 4, 6 then 1, 3, 5, 7
+			int neighbour = (k < 4) ? k * 2 : (k - 4) * 2 + 1;
+			int nx = x + CONTOUR_NEIGHBOURS[neighbour][0];
+			int ny = y + CONTOUR_NEIGHBOURS[neighbour][1];
+			if(IsEdge(edges, nx, ny) && !visited[nx + ny * edges.width])
+			{
+				current = nx + ny * edges.width;
+				visited[current] = 1;
+				points.push_back(current);
+				found = true;
+			}
+		}
 	}
+}
 
-	double centerX = in.width / 2;
-	double centerY = in.height / 2;
-
-	int maxHough = 0;
-
-	for(int j = 0; j < in.height; ++j)
+//
+// Extends the ends of the open contours in their direction, one pixel at a time towards the strongest gradient of the
+// three pixels ahead. A bridge is kept when it reaches an other contour or bridge within maxGap pixels without going
+// through a gradient under minGradient, it is added as a contour going from the end to the pixel reached. Ends already
+// touching an other contour are left as they are.
+void CloseContourGaps(const Convolution::Image& edges, const Convolution::Image& gradient, Convolution::Contours& contours, int maxGap, int minGradient)
+{
+	PooledArray<uint32_t> owner((size_t)edges.width * edges.height);
+	memset(owner.data, 0, owner.size * sizeof(uint32_t));
+	uint32_t traced = contours.starts.size() - 1;
+	for(uint32_t c = 0; c < traced; ++c)
+	{
+		for(uint32_t p = contours.starts[c]; p < contours.starts[c + 1]; ++p)
+		{
+			owner[contours.points[p]] = c + 1;
+		}
+	}
+	std::vector<uint32_t> bridge;
+	for(uint32_t c = 0; c < traced; ++c)
 	{
-		for(int i = 0; i < in.width; ++i)
+		uint32_t first = contours.starts[c];
+		uint32_t count = contours.starts[c + 1] - first;
+		if(count < 2 || contours.closed[c])
+		{
+			continue;
+		}
+		for(int side = 0; side < 2; ++side)
 		{
-			if(in.pixels[i + j * in.width] == 255)
+			uint32_t back = std::min(CONTOUR_DIRECTION_POINTS, count - 1);
+			uint32_t end = contours.points[(side == 0) ? first + count - 1 : first];
+			uint32_t from = contours.points[(side == 0) ? first + count - 1 - back : first + back];
+			int x = end % edges.width;
+			int y = end / edges.width;
+			if(!IsContourEnd(edges, x, y))
 			{
-				for(int alpha = 0; alpha < alphaPrecision; ++alpha)
+				continue;
+			}
+			int dx = x - (int)(from % edges.width);
+			int dy = y - (int)(from / edges.width);
+			int direction = ((int)lround(atan2((double)dy, (double)dx) / (M_PI / 4.0)) + 8) % 8;
+			bridge.assign(1, end);
+			bool reached = false;
+			for(int step = 0; step < maxGap && !reached; ++step)
+			{
+				int best = -1;
+				int bestGradient = minGradient - 1;
+				for(int turn = 0; turn < 3 && !reached; ++turn)
 				{
-					double alphaRad = ConvertAngleDtoR(alpha);
-					double rotation = (((double)i - centerX) * cos(alphaRad)) + (((double)j - centerY) * sin(alphaRad));
-					int v = ++accu[(int)(round(rotation + accHeight) * alphaPrecision) + alpha];
-					if(v > maxHough)
+					//
+					// Straight ahead first, then 45 degrees on each side
+					int k = (direction + ((turn == 0) ? 0 : ((turn == 1) ? 7 : 1))) % 8;
+					int nx = x + CONTOUR_NEIGHBOURS[k][0];
+					int ny = y + CONTOUR_NEIGHBOURS[k][1];
+					if(nx < 0 || ny < 0 || nx >= (int)edges.width || ny >= (int)edges.height)
+					{
+						continue;
+					}
+					uint32_t n = nx + ny * edges.width;
+					if(owner[n] != 0 && owner[n] != c + 1)
 					{
-						maxHough = v;
+						best = n;
+						reached = true;
 					}
+					else if(owner[n] == 0 && gradient.pixels[n] > bestGradient)
+					{
+						best = n;
+						bestGradient = gradient.pixels[n];
+					}
+				}
+				if(best < 0)
+				{
+					break;
 				}
+				bridge.push_back(best);
+				x = best % edges.width;
+				y = best / edges.width;
 			}
+			if(!reached || bridge.size() < 3)
+			{
+				continue;
+			}
+			for(uint32_t b = 1; b + 1 < bridge.size(); ++b)
+			{
+				owner[bridge[b]] = c + 1;
+			}
+			contours.points.insert(contours.points.end(), bridge.begin(), bridge.end());
+			contours.starts.push_back(contours.points.size());
+			contours.closed.push_back(0);
 		}
 	}
-	Convolution::Image* out = new Convolution::Image(original);
+}
 
-	if(maximas > 9)
-	{
-		maximas = 9;
-	}
-	else if(maximas < 1)
+//
+// Polylines of the edge pixels, those that are not black, each pixel belonging to a single contour. Tracing starts at
+// the contour ends, then from the pixels left, which are on loops or branches, in both directions. Each edge pixel is
+// visited once. With a gradient image of the same size, gaps of up to maxGap pixels at the ends are closed.
+/*static*/ void Convolution::TraceContours(const Convolution::Image& edges, const Convolution::Image* gradient, Convolution::Contours& contours, int maxGap, int minGradient)
+{
+	contours.width = edges.width;
+	contours.points.clear();
+	contours.starts.assign(1, 0);
+	contours.closed.clear();
+	if(edges.format != Convolution::Image::Format::Indexed8)
 	{
-		maximas = 1;
+		return;
 	}
-
-	maximas /= 2;
-
-	for(int rotation = 0; rotation < accHeight2; ++rotation)
+	PooledArray<uint8_t> visited((size_t)edges.width * edges.height);
+	memset(visited.data, 0, visited.size);
+	std::vector<uint32_t> backward;
+	for(uint32_t pass = 0; pass < 2; ++pass)
 	{
-		for(int alpha = 0; alpha < alphaPrecision; ++alpha)
+		for(uint32_t j = 0; j < edges.height; ++j)
 		{
-			if(accu[alpha + rotation * alphaPrecision] >= treshold)
+			if(!KeepRunning(pass * edges.height + j, 2 * edges.height))
 			{
-				int max = accu[(rotation * alphaPrecision) + alpha];
-				for(int ly = -maximas; ly <= maximas; ++ly)
-				{
-					 for(int lx = -maximas; lx <= maximas; ++lx)
-					 {
-						  if((ly + rotation >= 0 && ly + rotation < accHeight2) && (lx + alpha >= 0 && lx + alpha < alphaPrecision))
-						  {
-							  int index = ((rotation + ly) * alphaPrecision) + (alpha + lx);
-							   if((int)accu[index] > max)
-							   {
-									max = accu[index];
-									ly = lx = maximas + 1; // break all loops
-							   }
-						  }
-					 }
-				}
-				if(max > accu[alpha + rotation * alphaPrecision])
+				return;
+			}
+			for(uint32_t i = 0; i < edges.width; ++i)
+			{
+				uint32_t start = i + j * edges.width;
+				if(edges.pixels[start] == 0 || visited[start] || (pass == 0 && !IsContourEnd(edges, i, j)))
 				{
 					continue;
 				}
-				int x1, y1, x2, y2;
-				x1 = y1 = x2 = y2 = 0;
-				double alphaRad = ConvertAngleDtoR(alpha);
+				visited[start] = 1;
+				size_t first = contours.points.size();
+				contours.points.push_back(start);
+				FollowContour(edges, visited.data, start, contours.points);
+				backward.clear();
+				FollowContour(edges, visited.data, start, backward);
+				contours.points.insert(contours.points.begin() + first, backward.rbegin(), backward.rend());
+
+				uint32_t head = contours.points[first];
+				uint32_t tail = contours.points.back();
+				int dx = abs((int)(head % edges.width) - (int)(tail % edges.width));
+				int dy = abs((int)(head / edges.width) - (int)(tail / edges.width));
+				contours.closed.push_back(contours.points.size() - first > 2 && dx <= 1 && dy <= 1);
+				contours.starts.push_back(contours.points.size());
+			}
+		}
+	}
+	if(gradient != nullptr && maxGap > 0 && gradient->format == Convolution::Image::Format::Indexed8 &&
+	   gradient->width == edges.width && gradient->height == edges.height)
+	{
+		CloseContourGaps(edges, *gradient, contours, maxGap, minGradient);
+	}
+}
 
-				if(alpha >= 45 && alpha <= 135)
-				{
-					 x1 = 0;
-					 y1 = ((double)(rotation - (accHeight2 / 2.0)) - (((double)x1 - (out->width / 2.0) ) * cos(alphaRad))) / sin(alphaRad) + (out->height / 2.0);
-					 x2 = out->width;
-					 y2 = ((double)(rotation - (accHeight2 / 2.0)) - (((double)x2 - (out->width / 2.0) ) * cos(alphaRad))) / sin(alphaRad) + (out->height / 2.0);
-				}
-				else
-				{
-					 y1 = 0;
-					 x1 = ((double)(rotation - (accHeight2 / 2.0)) - (((double)y1 - (out->height / 2.0) ) * sin(alphaRad))) / cos(alphaRad) + (out->width / 2.0);
-					 y2 = out->height;
-					 x2 = ((double)(rotation - (accHeight2 / 2.0)) - (((double)y2 - (out->height / 2.0) ) * sin(alphaRad))) / cos(alphaRad) + (out->width / 2.0);
-				}
+//
+// Points of the contours in an image of the width they were traced in
+/*static*/ void Convolution::DrawContours(const Convolution::Contours& contours, Convolution::Image& out, int color)
+{
+	for(size_t p = 0; p < contours.points.size(); ++p)
+	{
+		SetPixel(&out, contours.points[p] % contours.width, contours.points[p] / contours.width, color);
+	}
+}
 
-				double drawX1 = 0, drawX2 = 0, drawY1 = 0, drawY2 = 0;
-				if(CohenSutherlandLineClip(x1, y1, x2, y2, drawX1, drawY1, drawX2, drawY2, 0, out->width, 0, out->height))
-				{
-					Bresenham(drawX1, drawY1, drawX2, drawY2, lineColor, out);
-					std::cout << rotation << " " << alpha << std::endl;
-				}
-			}
+//
+// Size of the image data encoded in a block
+const uint32_t COMPRESSION_BLOCK_BYTES = 256 * 1024;
+
+//
+// PackBits like encoding: a control byte c < 128 is followed by c + 1 literal bytes,
+// c >= 128 is followed by a byte repeated c - 125 times. Literals are only broken by runs of 3 bytes or more
+// so that the encoded size never exceeds the size plus one byte every 128.
+void EncodeRuns(const uint8_t* in, uint32_t size, std::vector<uint8_t>& out)
+{
+	//
+	// Worst case is one control byte every 128 literals
+	out.resize(size + size / 128 + 1);
+	uint8_t* write = out.data();
+	uint32_t i = 0;
+	while(i < size)
+	{
+		uint32_t run = 1;
+		while(i + run < size && run < 130 && in[i + run] == in[i])
+		{
+			++run;
+		}
+		if(run >= 3)
+		{
+			*write++ = (uint8_t)(125 + run);
+			*write++ = in[i];
+			i += run;
+			continue;
+		}
+		uint32_t start = i;
+		while(i < size && i - start < 128 && !(i + 2 < size && in[i + 1] == in[i] && in[i + 2] == in[i]))
+		{
+			++i;
+		}
+		*write++ = (uint8_t)(i - start - 1);
+		memcpy(write, in + start, i - start);
+		write += i - start;
+	}
+	out.resize(write - out.data());
+}
+
+void DecodeRuns(const uint8_t* in, uint32_t size, uint8_t* out)
+{
+	const uint8_t* end = in + size;
+	while(in < end)
+	{
+		uint32_t control = *in++;
+		if(control < 128)
+		{
+			memcpy(out, in, control + 1);
+			in += control + 1;
+			out += control + 1;
+		}
+		else
+		{
+			memset(out, *in++, control - 125);
+			out += control - 125;
 		}
 	}
+}
 
-	*accumulator = new Convolution::Image(alphaPrecision, accHeight * 2.0, Convolution::Image::Format::Indexed8);
+/*static*/ void Convolution::Compress(const Convolution::Image& image, Convolution::CompressedImage& out, uint32_t threadCount)
+{
+	out.width = image.width;
+	out.height = image.height;
+	out.format = image.format;
+	memcpy(out.colorTable, image.colorTable, sizeof(out.colorTable));
+
+	uint32_t pixelSize = Convolution::PixelSize(image.format);
+	uint32_t size = image.width * image.height * pixelSize;
+	uint32_t blockCount = (size + COMPRESSION_BLOCK_BYTES - 1) / COMPRESSION_BLOCK_BYTES;
+	std::vector<std::vector<uint8_t> > encoded(blockCount);
+	out.delta.assign(blockCount, 0);
+	Convolution::ParallelFor(blockCount, 1, threadCount, [&](uint32_t begin, uint32_t end)
+	{
+		PooledArray<uint8_t> differences(COMPRESSION_BLOCK_BYTES);
+		std::vector<uint8_t> alternative;
+		for(uint32_t b = begin; b < end; ++b)
+		{
+			const uint8_t* block = image.pixels + b * COMPRESSION_BLOCK_BYTES;
+			uint32_t length = (size - b * COMPRESSION_BLOCK_BYTES < COMPRESSION_BLOCK_BYTES) ? size - b * COMPRESSION_BLOCK_BYTES : COMPRESSION_BLOCK_BYTES;
+			EncodeRuns(block, length, encoded[b]);
+			if(encoded[b].size() < length / 2)
+			{
+				continue;
+			}
 
-	double multiplier = 255.0 / maxHough;
-	for(int i = 0; i < size; ++i)
+			//
+			// Smooth areas give long runs of small differences
+			for(uint32_t i = 0; i < length; ++i)
+			{
+				differences[i] = (i < pixelSize) ? block[i] : (uint8_t)(block[i] - block[i - pixelSize]);
+			}
+			alternative.clear();
+			EncodeRuns(differences.data, length, alternative);
+			if(alternative.size() < encoded[b].size())
+			{
+				encoded[b].swap(alternative);
+				out.delta[b] = 1;
+			}
+		}
+	});
+
+	out.blocks.resize(blockCount + 1);
+	out.blocks[0] = 0;
+	for(uint32_t b = 0; b < blockCount; ++b)
+	{
+		out.blocks[b + 1] = out.blocks[b] + encoded[b].size();
+	}
+	out.data.resize(out.blocks[blockCount]);
+	for(uint32_t b = 0; b < blockCount; ++b)
 	{
-		(*accumulator)->pixels[i] = accu[i] * multiplier;
+		memcpy(out.data.data() + out.blocks[b], encoded[b].data(), encoded[b].size());
 	}
+}
 
-	return out;
+/*static*/ void Convolution::Decompress(const Convolution::CompressedImage& in, Convolution::Image& out, uint32_t threadCount)
+{
+	out.Resize(in.width, in.height, in.format);
+	memcpy(out.colorTable, in.colorTable, sizeof(out.colorTable));
+
+	uint32_t pixelSize = Convolution::PixelSize(in.format);
+	uint32_t size = in.width * in.height * pixelSize;
+	uint32_t blockCount = in.delta.size();
+	Convolution::ParallelFor(blockCount, 1, threadCount, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t b = begin; b < end; ++b)
+		{
+			uint8_t* block = out.pixels + b * COMPRESSION_BLOCK_BYTES;
+			uint32_t length = (size - b * COMPRESSION_BLOCK_BYTES < COMPRESSION_BLOCK_BYTES) ? size - b * COMPRESSION_BLOCK_BYTES : COMPRESSION_BLOCK_BYTES;
+			DecodeRuns(in.data.data() + in.blocks[b], in.blocks[b + 1] - in.blocks[b], block);
+			if(in.delta[b] != 0)
+			{
+				for(uint32_t i = pixelSize; i < length; ++i)
+				{
+					block[i] += block[i - pixelSize];
+				}
+			}
+		}
+	});
 }
@@ -1,8 +1,15 @@
 #ifndef __CONVOLUTION_H
 #define __CONVOLUTION_H
 
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <new>
 #include <string>
+#include <vector>
 
 #define GrayA(i, a) ((((a) & 0xff) << 24) | (((i) & 0xff) << 16) | (((i) & 0xff) << 8) | ((i) & 0xff))
 #define Gray(i) GrayA(i, 255)
@@ -14,6 +21,34 @@ class QImage;
 struct Convolution
 {
 
+	//
+	// Recycled pixel and scratch buffers keyed by their size in bytes. Images draw their pixels from the pool and give
+	// them back when resized or destroyed, so processing images of the same size stops allocating once the pool is warm.
+	struct Pool
+	{
+		struct Counters
+		{
+			uint64_t	acquisitions;	// Buffers handed out
+			uint64_t	allocations;	// Buffers that were not in the pool and had to be allocated
+			uint64_t	allocatedBytes;
+		};
+
+		static uint8_t*	Acquire			(size_t bytes);
+		static void		Release			(uint8_t* buffer, size_t bytes);
+		static void		Clear			(void);
+		static void		SetCapacity		(size_t bytes);
+		static size_t	PooledBytes		(void);
+
+		//
+		// Counters of the calling thread, the work done by ParallelFor workers is accounted to the thread that called it
+		static Counters	ThreadCounters	(void);
+		static Counters	TotalCounters	(void);
+		static void		Account			(const Counters& counters);
+	};
+
+	//
+	// Pixels are reference counted: copies share them until one of the images is resized or detached.
+	// Code writing into the pixels of an image that may be shared must call Detach first.
 	struct Image
 	{
 	
@@ -22,16 +57,33 @@ struct Convolution
 			RGB, ARGB, Indexed8
 		};
 		
-		inline 			Image	(void);
-		inline 			Image	(uint32_t w, uint32_t h, Format f = Format::Indexed8);
-		inline			Image	(const Image& rhs);
-		virtual inline 	~Image	(void);
+		inline 			Image		(void);
+		inline 			Image		(uint32_t w, uint32_t h, Format f = Format::Indexed8);
+		inline			Image		(const Image& rhs);
+		inline			Image		(Image&& rhs);
+		virtual inline 	~Image		(void);
+
+		inline Image&	operator=	(const Image& rhs);
+		inline Image&	operator=	(Image&& rhs);
+
+		inline void		Resize		(uint32_t w, uint32_t h, Format f);
+		inline void		Detach		(void);
+		inline bool		IsShared	(void) const;
 	
 		uint32_t 	width;
 		uint32_t 	height;
 		Format 		format;
 		uint8_t* 	pixels;
 		uint32_t	colorTable[256];
+
+	private:
+
+		static const size_t PIXELS_HEADER = 16;	// Reference count stored in front of the pixels, keeps them aligned
+
+		inline size_t							Bytes			(void) const;
+		static inline std::atomic<uint32_t>&	References		(uint8_t* pixels);
+		static inline uint8_t*					AllocatePixels	(size_t bytes);
+		static inline void						ReleasePixels	(uint8_t* pixels, size_t bytes);
 	
 	};
 	
@@ -54,17 +106,156 @@ struct Convolution
 		double 		divisor;
 	};
 
+	//
+	// Filter prepared for convolution, built once each time a filter is created or edited
+	struct CompiledFilter
+	{
+		struct Tap
+		{
+			uint32_t	x;
+			uint32_t	y;
+			double		weight;
+		};
+
+		struct FixedTap
+		{
+			uint32_t	x;
+			uint32_t	y;
+			int16_t		weight;
+		};
+
+		CompiledFilter(const Filter& filter);
+
+		uint32_t				size;
+		std::vector<double>		kernel;
+		double					divisor;		// Sum of the absolute taps when the filter divisor is 0
+		std::vector<Tap>		taps;			// Non-zero taps
+		bool					separable;
+		std::vector<double>		horizontal;		// Separable factors
+		std::vector<double>		vertical;
+		bool					fixed;			// Exact fixed point version available
+		std::vector<FixedTap>	fixedTaps;		// Non-zero taps scaled to int16, padded to an even count
+		float					fixedDivisor;
+		std::vector<double>		rotations;		// Eight kernels rotated by 45 degrees steps, for multiconvolution
+		double					rotationDivisors[8];
+	};
+
+	//
+	// Line found by the Hough transformation: the points (x, y) such that
+	// (x - width / 2) * cos(theta) + (y - height / 2) * sin(theta) = rho, theta in degrees
+	struct HoughLine
+	{
+		int		rho;
+		int		theta;
+		int		votes;
+	};
+
+	//
+	// Circle found by the circle Hough transformation, centre in pixels of the image
+	struct HoughCircle
+	{
+		int		x;
+		int		y;
+		int		radius;
+		int		votes;
+	};
+
+	//
+	// Connected pixels found by LabelComponents, the bounding box includes its bounds
+	struct Component
+	{
+		uint32_t	area;
+		uint32_t	left;
+		uint32_t	top;
+		uint32_t	right;
+		uint32_t	bottom;
+		double		centroidX;
+		double		centroidY;
+	};
+
+	//
+	// Polylines traced by TraceContours. The points of contour c are points[starts[c]] to points[starts[c + 1] - 1],
+	// stored as pixel indices x + y * width.
+	struct Contours
+	{
+		uint32_t				width;
+		std::vector<uint32_t>	points;
+		std::vector<uint32_t>	starts;		// One more than the number of contours
+		std::vector<uint8_t>	closed;		// By contour, 1 when its ends touch
+	};
+
+	//
+	// Run-length encoded image cut in independent blocks, so that compression and decompression run in parallel.
+	// Each block is encoded either as is or as differences with the previous pixel, whichever is smaller.
+	struct CompressedImage
+	{
+		uint32_t				width;
+		uint32_t				height;
+		Image::Format			format;
+		uint32_t				colorTable[256];
+		std::vector<uint32_t>	blocks;			// Offset of each block in data, followed by the data size
+		std::vector<uint8_t>	delta;			// By block, 1 when the block holds differences
+		std::vector<uint8_t>	data;
+	};
+
 	static inline uint32_t PixelSize(Image::Format format);
 
-	static Image* ApplyFilter(const Image& image, const Filter& filter, Filter::SideHandle sideHandle, bool multi = false);
+	//
+	// Cooperative cancellation and progress of the operations run by a thread. Operations poll the task set on their
+	// thread and ParallelFor hands it over to its workers. A cancelled operation returns early, its output is incomplete.
+	struct Task
+	{
+		Task(void);
+
+		void		Reset		(void);
+		void		Cancel		(void);
+		bool		IsCancelled	(void) const;
+		void		SetProgress	(uint32_t done, uint32_t total);
+		uint32_t	Progress	(void) const;	// Per mille of the running pass
+
+		static Task*	Current		(void);
+		static void		SetCurrent	(Task* task);
+
+		std::atomic<bool>		cancelled;
+		std::atomic<uint32_t>	progress;
+	};
+
+	static uint32_t ThreadCount(uint32_t threadCount);
+	static void ParallelFor(uint32_t count, uint32_t grain, uint32_t threadCount, const std::function<void(uint32_t begin, uint32_t end)>& body);
+
+	static Image* ApplyFilter(const Image& image, const Filter& filter, Filter::SideHandle sideHandle, bool multi = false, uint32_t threadCount = 1);
+	static Image* ApplyFilter(const Image& image, const CompiledFilter& filter, Filter::SideHandle sideHandle, bool multi = false, uint32_t threadCount = 1);
+	static void ApplyFilter(const Image& image, const CompiledFilter& filter, Filter::SideHandle sideHandle, Image& out, bool multi = false, uint32_t threadCount = 1);
 	static Filter* Rotate(const Filter& filter);
+	static std::map<std::string, Filter> DefaultFilters(void);
 	static Image* Refine(const Image& tresholded, const Image& gradient);
+	static void Refine(const Image& tresholded, const Image& gradient, Image& out);
+	static void Refine(const Image& tresholded, const Image& gradient, const Image& orientation, Image& out, uint32_t threadCount = 1);
 	static Image* ToGrayScale(const Image& in);
+	static void ToGrayScale(const Image& in, Image& out);
+	static void Downscale(const Image& in, uint32_t factor, Image& out, uint32_t threadCount = 1);
 	static Image* LoadImage(const std::string& file);
-	static void SaveImage(const Image& image, const std::string& file);
+	static bool SaveImage(const Image& image, const std::string& file);
 	static QImage ToQImage(const Image& image);
-	static Image* Treshold(Image* image, int tresholdMin, int tresholdMax);
-	static Image* Hough(const Image& in, const Image& original, Image** accumulator, int alphaPrecision, int treshold, int maximas, int lineColor = 0xffffff);
+	static Image* Treshold(Image* image, int tresholdMin, int tresholdMax, uint32_t threadCount = 1);
+	static void Treshold(const Image& image, int tresholdMin, int tresholdMax, Image& out, uint32_t threadCount = 1);
+	static void Canny(const Image& image, int tresholdMin, int tresholdMax, Image& out, uint32_t threadCount = 1);
+	static void LabelComponents(const Image& in, std::vector<uint32_t>& labels, std::vector<Component>& components, bool eightConnected = true, uint32_t threadCount = 1);
+	static void TresholdLut(int tresholdMin, int tresholdMax, uint8_t lut[256]);
+	static void ApplyLut(const Image& image, const uint8_t lut[256], Image& out, uint32_t threadCount = 1);
+	static void Histogram(const Image& image, uint32_t histogram[256]);
+	static void Orientation(const Image& image, Image& out, uint32_t threadCount = 1);
+	static Image* Hough(const Image& in, const Image& original, Image** accumulator, int alphaPrecision, int treshold, int maximas, int lineColor = 0xffffff, uint32_t threadCount = 1, const Image* orientation = nullptr, int angleWindow = 0);
+	static void Hough(const Image& in, const Image& original, Image& out, Image* accumulator, int alphaPrecision, int treshold, int maximas, int lineColor = 0xffffff, uint32_t threadCount = 1, const Image* orientation = nullptr, int angleWindow = 0);
+	static void HoughLines(const Image& in, std::vector<HoughLine>& lines, Image* accumulator, int alphaPrecision, int treshold, int maximas, uint32_t threadCount = 1, const Image* orientation = nullptr, int angleWindow = 0);
+	static void DrawHoughLines(const std::vector<HoughLine>& lines, Image& out, int lineColor = 0xffffff);
+	static void ProbabilisticHough(const Image& in, const Image& original, Image& out, int alphaPrecision, int treshold, uint32_t sampleBudget, int lineColor = 0xffffff);
+	static void HoughCircles(const Image& in, const Image& orientation, std::vector<HoughCircle>& circles, int minRadius, int maxRadius, int treshold, int maximas, uint32_t threadCount = 1);
+	static void DrawHoughCircles(const std::vector<HoughCircle>& circles, Image& out, int circleColor = 0xffffff);
+	static void TraceContours(const Image& edges, const Image* gradient, Contours& contours, int maxGap = 0, int minGradient = 1);
+	static void DrawContours(const Contours& contours, Image& out, int color = 0xffffff);
+	static void Compress(const Image& image, CompressedImage& out, uint32_t threadCount = 1);
+	static void Decompress(const CompressedImage& in, Image& out, uint32_t threadCount = 1);
 
 };
 
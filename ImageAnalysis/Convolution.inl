@@ -15,7 +15,6 @@ inline Convolution::Image::Image(uint32_t w, uint32_t h, Convolution::Image::For
 	, format(f)
 	, pixels(nullptr)
 {
-	uint32_t pixelSize = Convolution::PixelSize(format);
 	if(format == Convolution::Image::Format::Indexed8)
 	{
 		for(uint32_t i = 0; i < 256; ++i)
@@ -23,37 +22,146 @@ inline Convolution::Image::Image(uint32_t w, uint32_t h, Convolution::Image::For
 			colorTable[i] = Gray(i);
 		}
 	}
-	pixels = new uint8_t[width * height * pixelSize];
+	pixels = AllocatePixels(Bytes());
 }
 
+//
+// Copies share the pixels of the original image
 inline Convolution::Image::Image(const Convolution::Image& rhs)
 	: width(rhs.width)
 	, height(rhs.height)
 	, format(rhs.format)
-	, pixels(nullptr)
+	, pixels(rhs.pixels)
 {
-	for(uint32_t i = 0; i < 256; ++i)
+	memcpy(colorTable, rhs.colorTable, sizeof(colorTable));
+	if(pixels != nullptr)
 	{
-		colorTable[i] = rhs.colorTable[i];
+		++References(pixels);
 	}
-	if(width * height != 0)
+}
+
+inline Convolution::Image::Image(Convolution::Image&& rhs)
+	: width(rhs.width)
+	, height(rhs.height)
+	, format(rhs.format)
+	, pixels(rhs.pixels)
+{
+	memcpy(colorTable, rhs.colorTable, sizeof(colorTable));
+	rhs.width = 0;
+	rhs.height = 0;
+	rhs.pixels = nullptr;
+}
+
+/*virtual*/ inline Convolution::Image::~Image(void)
+{
+	ReleasePixels(pixels, Bytes());
+	pixels = nullptr;
+}
+
+inline Convolution::Image& Convolution::Image::operator=(const Convolution::Image& rhs)
+{
+	if(pixels != rhs.pixels)
 	{
-		uint32_t pixelSize = Convolution::PixelSize(format);
-		uint32_t size = width * height * pixelSize;
-		pixels = new uint8_t[size];
-		for(uint32_t i = 0; i < size; ++i)
+		if(rhs.pixels != nullptr)
 		{
-			pixels[i] = rhs.pixels[i];
+			++References(rhs.pixels);
 		}
+		ReleasePixels(pixels, Bytes());
+		pixels = rhs.pixels;
 	}
+	width = rhs.width;
+	height = rhs.height;
+	format = rhs.format;
+	memcpy(colorTable, rhs.colorTable, sizeof(colorTable));
+	return *this;
 }
 
-/*virtual*/ inline Convolution::Image::~Image(void)
+inline Convolution::Image& Convolution::Image::operator=(Convolution::Image&& rhs)
 {
-	if(pixels != nullptr)
+	if(this != &rhs)
+	{
+		ReleasePixels(pixels, Bytes());
+		width = rhs.width;
+		height = rhs.height;
+		format = rhs.format;
+		pixels = rhs.pixels;
+		memcpy(colorTable, rhs.colorTable, sizeof(colorTable));
+		rhs.width = 0;
+		rhs.height = 0;
+		rhs.pixels = nullptr;
+	}
+	return *this;
+}
+
+//
+// Change dimensions and format, the pixel buffer is kept when its size does not change and it is not shared,
+// so that images can be reused as outputs. The pixels are undefined afterwards.
+inline void Convolution::Image::Resize(uint32_t w, uint32_t h, Convolution::Image::Format f)
+{
+	size_t size = (size_t)w * h * Convolution::PixelSize(f);
+	if(pixels == nullptr || size != Bytes() || IsShared())
+	{
+		ReleasePixels(pixels, Bytes());
+		pixels = AllocatePixels(size);
+	}
+	width = w;
+	height = h;
+	format = f;
+	if(format == Convolution::Image::Format::Indexed8)
+	{
+		for(uint32_t i = 0; i < 256; ++i)
+		{
+			colorTable[i] = Gray(i);
+		}
+	}
+}
+
+//
+// Give the image its own copy of shared pixels before writing into them
+inline void Convolution::Image::Detach(void)
+{
+	if(IsShared())
+	{
+		uint8_t* shared = pixels;
+		pixels = AllocatePixels(Bytes());
+		memcpy(pixels, shared, Bytes());
+		ReleasePixels(shared, Bytes());
+	}
+}
+
+inline bool Convolution::Image::IsShared(void) const
+{
+	return pixels != nullptr && References(pixels) > 1;
+}
+
+inline size_t Convolution::Image::Bytes(void) const
+{
+	return (size_t)width * height * Convolution::PixelSize(format);
+}
+
+/*static*/ inline std::atomic<uint32_t>& Convolution::Image::References(uint8_t* pixels)
+{
+	return *reinterpret_cast<std::atomic<uint32_t>*>(pixels - PIXELS_HEADER);
+}
+
+//
+// Pixel storage comes from the pool with the reference count in front of it
+/*static*/ inline uint8_t* Convolution::Image::AllocatePixels(size_t bytes)
+{
+	if(bytes == 0)
+	{
+		return nullptr;
+	}
+	uint8_t* storage = Convolution::Pool::Acquire(bytes + PIXELS_HEADER);
+	new(storage) std::atomic<uint32_t>(1);
+	return storage + PIXELS_HEADER;
+}
+
+/*static*/ inline void Convolution::Image::ReleasePixels(uint8_t* pixels, size_t bytes)
+{
+	if(pixels != nullptr && --References(pixels) == 0)
 	{
-		delete [] pixels;
-		pixels = nullptr;
+		Convolution::Pool::Release(pixels - PIXELS_HEADER, bytes + PIXELS_HEADER);
 	}
 }
 
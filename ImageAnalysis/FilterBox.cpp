@@ -19,6 +19,13 @@ FilterBox::FilterBox(QWidget *parent)
 	connect(m_ui->ok_button, SIGNAL(clicked()), this, SLOT(OnValidate()));
 	connect(m_ui->cancel_button, SIGNAL(clicked()), this, SLOT(OnCancel()));
 
+	connect(m_ui->size_box, SIGNAL(valueChanged(int)), this, SLOT(OnChanged()));
+	connect(m_ui->divisor_box, SIGNAL(valueChanged(double)), this, SLOT(OnChanged()));
+	for(int i = 0; i < 81; ++i)
+	{
+		connect(m_kernel[i], SIGNAL(textChanged(QString)), this, SLOT(OnChanged()));
+	}
+
 	OnSizeChanged(3);
 }
 
@@ -64,6 +71,28 @@ const QString& FilterBox::GetName(void) const
 	return m_name;
 }
 
+//
+// Filter described by the dialog, the caller owns the kernel
+Convolution::Filter FilterBox::GetFilter(void) const
+{
+	Convolution::Filter filter;
+	filter.size = m_ui->size_box->value();
+	filter.kernel = new double[filter.size * filter.size];
+
+	int index = 0;
+	for(int i = 0; i < 81; ++i)
+	{
+		if((abs(i % 9 - 4) <= (int)(filter.size / 2)) && (abs(i / 9 - 4) <= (int)(filter.size / 2)))
+		{
+			filter.kernel[index] = m_kernel[i]->text().toDouble();
+			index++;
+		}
+	}
+
+	filter.divisor = m_ui->divisor_box->text().toDouble();
+	return filter;
+}
+
 void FilterBox::FillKernel(void)
 {
 	m_kernel.clear();
@@ -109,6 +138,11 @@ void FilterBox::OnDivisorChanged(double divisor)
 
 }
 
+void FilterBox::OnChanged(void)
+{
+	emit Changed();
+}
+
 void FilterBox::OnDefaultDivisor(void)
 {
 	int size = m_ui->size_box->value();
@@ -129,8 +163,6 @@ void FilterBox::OnDefaultDivisor(void)
 
 void FilterBox::OnValidate(void)
 {
-	Convolution::Filter filter;
-	Convolution::Filter* pFilter = &filter;
 	if(!m_modifying)
 	{
 		if(m_filters->contains(m_ui->name_edit->text()))
@@ -142,32 +174,13 @@ void FilterBox::OnValidate(void)
 	}
 	else
 	{
-		pFilter = &((*m_filters)[m_name]);
-		delete [] pFilter->kernel;
-	}
-	pFilter->size = m_ui->size_box->value();
-	pFilter->kernel = new double[pFilter->size * pFilter->size];
-
-	int index = 0;
-	for(int i = 0; i < 81; ++i)
-	{
-		if((abs(i % 9 - 4) <= (pFilter->size / 2)) && (abs(i / 9 - 4) <= (pFilter->size / 2)))
-		{
-			pFilter->kernel[index] = m_kernel[i]->text().toDouble();
-			index++;
-		}
+		delete [] (*m_filters)[m_name].kernel;
 	}
-
-	pFilter->divisor = m_ui->divisor_box->text().toDouble();
-	if(pFilter->divisor == 0.0)
+	if(m_ui->divisor_box->text().toDouble() == 0.0)
 	{
 		OnDefaultDivisor();
-		pFilter->divisor = m_ui->divisor_box->text().toDouble();
-	}
-	if(!m_modifying)
-	{
-		(*m_filters)[m_name] = filter;
 	}
+	(*m_filters)[m_name] = GetFilter();
 	close();
 }
 
@@ -24,6 +24,7 @@ public:
 
 	void Initialize(QMap<QString, Convolution::Filter>*	filters, const QString& modify = QString());
 	const QString& GetName(void) const;
+	Convolution::Filter GetFilter(void) const;
 
 	void FillKernel(void);
 
@@ -32,10 +33,17 @@ public slots:
 	void OnSizeChanged(int size);
 	void OnDivisorChanged(double divisor);
 	void OnDefaultDivisor(void);
+	void OnChanged(void);
 
 	void OnValidate(void);
 	void OnCancel(void);
 
+signals:
+
+	//
+	// Emitted when the size, the divisor or a coefficient of the kernel is edited
+	void Changed(void);
+
 private:
 
 	Ui::FilterBox*						m_ui;
@@ -0,0 +1,240 @@
+#include "History.h"
+
+#include <set>
+
+History::Snapshot::Snapshot(Convolution::Image* image)
+	: image(image)
+	, compressible(true)
+{
+
+}
+
+History::Snapshot::~Snapshot(void)
+{
+	delete image;
+}
+
+size_t History::Snapshot::Bytes(void) const
+{
+	if(image != nullptr)
+	{
+		return image->width * image->height * Convolution::PixelSize(image->format);
+	}
+	return compressed.data.size() + compressed.blocks.size() * sizeof(uint32_t) + compressed.delta.size();
+}
+
+//
+// The image is only replaced by its compressed version when it saves at least a quarter of the memory. Photographs barely
+// compress and would only slow undo down, their states are dropped instead when the budget is exceeded.
+void History::Snapshot::Compress(void)
+{
+	if(image == nullptr || !compressible)
+	{
+		return;
+	}
+	Convolution::Compress(*image, compressed, 0);
+	if(compressed.data.size() * 4 >= Bytes() * 3)
+	{
+		compressible = false;
+		compressed = Convolution::CompressedImage();
+		return;
+	}
+	delete image;
+	image = nullptr;
+}
+
+History::History(size_t budget)
+	: m_budget(budget)
+{
+
+}
+
+/*virtual*/ History::~History(void)
+{
+
+}
+
+void History::PushUndo(const History::State& state)
+{
+	Push(m_undo, state);
+	Enforce();
+}
+
+void History::PushRedo(const History::State& state)
+{
+	Push(m_redo, state);
+	Enforce();
+}
+
+bool History::PopUndo(History::State& state)
+{
+	return Pop(m_undo, state);
+}
+
+bool History::PopRedo(History::State& state)
+{
+	return Pop(m_redo, state);
+}
+
+void History::ClearRedo(void)
+{
+	m_redo.clear();
+}
+
+void History::Clear(void)
+{
+	m_undo.clear();
+	m_redo.clear();
+}
+
+uint32_t History::UndoCount(void) const
+{
+	return m_undo.size();
+}
+
+uint32_t History::RedoCount(void) const
+{
+	return m_redo.size();
+}
+
+void History::SetBudget(size_t budget)
+{
+	m_budget = budget;
+	Enforce();
+}
+
+size_t History::Budget(void) const
+{
+	return m_budget;
+}
+
+//
+// Snapshots shared by several states are counted once
+size_t History::MemoryUsage(void) const
+{
+	std::set<const Snapshot*> counted;
+	size_t usage = 0;
+	const std::vector<Entry>* stacks[2] = { &m_undo, &m_redo };
+	for(uint32_t k = 0; k < 2; ++k)
+	{
+		for(uint32_t i = 0; i < stacks[k]->size(); ++i)
+		{
+			const Snapshot* snapshots[2] = { (*stacks[k])[i].result.get(), (*stacks[k])[i].gradient.get() };
+			for(uint32_t s = 0; s < 2; ++s)
+			{
+				if(snapshots[s] != nullptr && counted.insert(snapshots[s]).second)
+				{
+					usage += snapshots[s]->Bytes();
+				}
+			}
+		}
+	}
+	return usage;
+}
+
+void History::Push(std::vector<History::Entry>& stack, const History::State& state)
+{
+	Entry entry;
+	entry.result = Share(state.result);
+	entry.gradient = Share(state.gradient);
+	entry.action = state.action;
+	entry.actionIsGradient = state.actionIsGradient;
+	stack.push_back(entry);
+}
+
+bool History::Pop(std::vector<History::Entry>& stack, History::State& state)
+{
+	if(stack.empty())
+	{
+		return false;
+	}
+	const Entry& entry = stack.back();
+	state.result = Restore(entry.result);
+	state.gradient = Restore(entry.gradient);
+	state.action = entry.action;
+	state.actionIsGradient = entry.actionIsGradient;
+	stack.pop_back();
+	return true;
+}
+
+//
+// An image sharing the pixels of an image already in the history, like a gradient kept across several actions,
+// reuses its snapshot
+std::shared_ptr<History::Snapshot> History::Share(Convolution::Image* image) const
+{
+	if(image == nullptr)
+	{
+		return std::shared_ptr<Snapshot>();
+	}
+	const std::vector<Entry>* stacks[2] = { &m_undo, &m_redo };
+	for(uint32_t k = 0; k < 2 && image->pixels != nullptr; ++k)
+	{
+		for(uint32_t i = 0; i < stacks[k]->size(); ++i)
+		{
+			const std::shared_ptr<Snapshot>* snapshots[2] = { &(*stacks[k])[i].result, &(*stacks[k])[i].gradient };
+			for(uint32_t s = 0; s < 2; ++s)
+			{
+				const Convolution::Image* shared = (*snapshots[s] != nullptr) ? (*snapshots[s])->image : nullptr;
+				if(shared != nullptr && shared->pixels == image->pixels && shared->width == image->width && shared->height == image->height && shared->format == image->format)
+				{
+					delete image;
+					return *snapshots[s];
+				}
+			}
+		}
+	}
+	return std::make_shared<Snapshot>(image);
+}
+
+Convolution::Image* History::Restore(const std::shared_ptr<History::Snapshot>& snapshot) const
+{
+	if(snapshot == nullptr)
+	{
+		return nullptr;
+	}
+	if(snapshot->image != nullptr)
+	{
+		return new Convolution::Image(*snapshot->image);
+	}
+	Convolution::Image* image = new Convolution::Image();
+	Convolution::Decompress(snapshot->compressed, *image, 0);
+	return image;
+}
+
+void History::Enforce(void)
+{
+	size_t usage = MemoryUsage();
+	std::vector<Entry>* stacks[2] = { &m_undo, &m_redo };
+
+	//
+	// Compress the states from the farthest to the second nearest of both stacks
+	uint32_t farthest = (m_undo.size() > m_redo.size()) ? m_undo.size() : m_redo.size();
+	for(uint32_t distance = farthest; distance >= 2 && usage > m_budget; --distance)
+	{
+		for(uint32_t k = 0; k < 2; ++k)
+		{
+			if(stacks[k]->size() >= distance)
+			{
+				Entry& entry = (*stacks[k])[stacks[k]->size() - distance];
+				if(entry.result != nullptr)
+				{
+					entry.result->Compress();
+				}
+				if(entry.gradient != nullptr)
+				{
+					entry.gradient->Compress();
+				}
+			}
+		}
+		usage = MemoryUsage();
+	}
+
+	//
+	// Then drop the farthest states, from the longest stack
+	while(usage > m_budget && (m_undo.size() > 1 || m_redo.size() > 1))
+	{
+		std::vector<Entry>& stack = (m_undo.size() >= m_redo.size()) ? m_undo : m_redo;
+		stack.erase(stack.begin());
+		usage = MemoryUsage();
+	}
+}
@@ -0,0 +1,82 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "Convolution.h"
+
+#include <QString>
+
+#include <memory>
+#include <vector>
+
+//
+// Undo and redo stacks of the main window, kept under a memory budget.
+// States holding the same pixels share a snapshot. Over the budget, the states farthest from the current one are
+// compressed first, then dropped. The states next to the current one are left as they are so that a single undo or redo
+// stays immediate.
+class History
+{
+
+public:
+
+	//
+	// Images are owned by the caller when taken from the history and by the history once given to it
+	struct State
+	{
+		Convolution::Image*	result;
+		Convolution::Image*	gradient;
+		QString				action;
+		bool				actionIsGradient;
+	};
+
+	explicit	History		(size_t budget);
+	virtual		~History	(void);
+
+	void		PushUndo	(const State& state);
+	void		PushRedo	(const State& state);
+	bool		PopUndo		(State& state);
+	bool		PopRedo		(State& state);
+	void		ClearRedo	(void);
+	void		Clear		(void);
+
+	uint32_t	UndoCount	(void) const;
+	uint32_t	RedoCount	(void) const;
+	void		SetBudget	(size_t budget);
+	size_t		Budget		(void) const;
+	size_t		MemoryUsage	(void) const;
+
+private:
+
+	struct Snapshot
+	{
+		Snapshot	(Convolution::Image* image);
+		~Snapshot	(void);
+
+		size_t		Bytes		(void) const;
+		void		Compress	(void);
+
+		Convolution::Image*				image;			// Null once compressed
+		Convolution::CompressedImage	compressed;
+		bool							compressible;
+	};
+
+	struct Entry
+	{
+		std::shared_ptr<Snapshot>	result;
+		std::shared_ptr<Snapshot>	gradient;
+		QString						action;
+		bool						actionIsGradient;
+	};
+
+	void						Push		(std::vector<Entry>& stack, const State& state);
+	bool						Pop			(std::vector<Entry>& stack, State& state);
+	std::shared_ptr<Snapshot>	Share		(Convolution::Image* image) const;
+	Convolution::Image*			Restore		(const std::shared_ptr<Snapshot>& snapshot) const;
+	void						Enforce		(void);
+
+	std::vector<Entry>	m_undo;
+	std::vector<Entry>	m_redo;
+	size_t				m_budget;
+
+};
+
+#endif // HISTORY_H
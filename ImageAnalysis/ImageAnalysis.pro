@@ -4,7 +4,7 @@
 #
 #-------------------------------------------------
 
-QT	   += core gui
+QT	   += core gui concurrent
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 greaterThan(QT_MAJOR_VERSION, 4): CONFIG += c++11
@@ -14,16 +14,22 @@ TEMPLATE = app
 
 
 SOURCES += \
+                Batch.cpp \
                 Convolution.cpp \
+                History.cpp \
                 main.cpp \
                 MainWindow.cpp \
+                Pipeline.cpp \
     FilterBox.cpp \
     TresholdBox.cpp
 
 HEADERS += \
+                Batch.h \
                 Convolution.h \
                 Convolution.inl \
+                History.h \
                 MainWindow.h \
+                Pipeline.h \
     FilterBox.h \
     TresholdBox.h
 
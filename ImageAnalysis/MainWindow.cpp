@@ -8,13 +8,41 @@
 #include <QMessageBox>
 #include <QCloseEvent>
 #include <QMenu>
+#include <QtConcurrent/QtConcurrentRun>
 
 #include "FilterBox.h"
 #include "TresholdBox.h"
 
+//
+// Memory the undo and redo states may use before being compressed or dropped
+const size_t DEFAULT_HISTORY_BUDGET = 512 * 1024 * 1024;
+
+//
+// Longest side of the proxy image the dialogs preview their parameters on
+const uint32_t PREVIEW_SIZE = 512;
+
+//
+// Angles in degrees on each side of the edge normal the oriented Hough transformation votes for
+const int HOUGH_ANGLE_WINDOW = 10;
+
+//
+// Edge pixels the probabilistic Hough transformation lets vote at most
+const uint32_t HOUGH_SAMPLE_BUDGET = 200000;
+
+//
+// Radii in pixels the circle Hough transformation looks for
+const int HOUGH_CIRCLE_MIN_RADIUS = 10;
+const int HOUGH_CIRCLE_MAX_RADIUS = 200;
+
+//
+// Longest gap at the ends of the contours that is closed, and weakest gradient the closure goes through
+const int CONTOUR_GAP = 10;
+const int CONTOUR_MIN_GRADIENT = 20;
+
 MainWindow::MainWindow(QWidget *parent)
 	: QMainWindow(parent)
 	, m_ui(new Ui::MainWindow)
+	, m_history(DEFAULT_HISTORY_BUDGET)
 {
 	m_ui->setupUi(this);
 	m_statusLabel = new QLabel(this);
@@ -30,6 +58,13 @@ MainWindow::MainWindow(QWidget *parent)
 	m_scaleFactor = 1.0;
 	m_lastAction = "";
 	m_actionIsGradient = false;
+	m_runningGradient = false;
+
+	m_progressBar = new QProgressBar(this);
+	m_progressBar->setRange(0, 1000);
+	m_progressBar->setTextVisible(false);
+	m_progressBar->setVisible(false);
+	m_ui->statusBar->addPermanentWidget(m_progressBar);
 
 	m_imageLabel[0]->setBackgroundRole(QPalette::Base);
 	m_imageLabel[0]->setSizePolicy(QSizePolicy::Ignored, QSizePolicy::Ignored);
@@ -55,18 +90,30 @@ MainWindow::MainWindow(QWidget *parent)
 
 	connect(m_ui->actionOpen, SIGNAL(triggered()), this, SLOT(Open()));
 	connect(m_ui->actionSave_As, SIGNAL(triggered()), this, SLOT(SaveAs()));
+	connect(m_ui->actionSave_Hough_Accumulator, SIGNAL(triggered()), this, SLOT(SaveHoughAccumulator()));
 	connect(m_ui->actionExit, SIGNAL(triggered()), this, SLOT(Exit()));
 
 	connect(m_ui->actionRefine, SIGNAL(triggered()), this, SLOT(Refine()));
+	connect(m_ui->actionOriented_Refine, SIGNAL(triggered()), this, SLOT(OrientedRefine()));
+	connect(m_ui->actionClose_Contours, SIGNAL(triggered()), this, SLOT(CloseContours()));
 	connect(m_ui->actionHough_Transform, SIGNAL(triggered()), this, SLOT(HoughTransform()));
+	connect(m_ui->actionOriented_Hough_Transform, SIGNAL(triggered()), this, SLOT(OrientedHoughTransform()));
+	connect(m_ui->actionProbabilistic_Hough_Transform, SIGNAL(triggered()), this, SLOT(ProbabilisticHoughTransform()));
+	connect(m_ui->actionCircle_Hough_Transform, SIGNAL(triggered()), this, SLOT(CircleHoughTransform()));
 
 	connect(m_ui->actionReset, SIGNAL(triggered()), this, SLOT(Reset()));
 	connect(m_ui->actionUndo, SIGNAL(triggered()), this, SLOT(Undo()));
 	connect(m_ui->actionRedo, SIGNAL(triggered()), this, SLOT(Redo()));
+	connect(m_ui->actionCancel, SIGNAL(triggered()), this, SLOT(Cancel()));
+
+	connect(&m_watcher, SIGNAL(finished()), this, SLOT(OperationFinished()));
+	connect(&m_progressTimer, SIGNAL(timeout()), this, SLOT(OperationProgress()));
+	connect(&m_previewWatcher, SIGNAL(finished()), this, SLOT(PreviewFinished()));
 
 	connect(m_ui->actionCreate, SIGNAL(triggered()), this, SLOT(CreateFilter()));
 	connect(m_ui->actionSimple, SIGNAL(triggered()), this, SLOT(ApplySimpleThreshold()));
 	connect(m_ui->actionHysteresis, SIGNAL(triggered()), this, SLOT(ApplyHysteresisThreshold()));
+	connect(m_ui->actionCanny, SIGNAL(triggered()), this, SLOT(Canny()));
 
 	connect(m_scrollArea[0]->verticalScrollBar(), SIGNAL(valueChanged(int)), this, SLOT(VerticalScroll(int)));
 	connect(m_scrollArea[1]->verticalScrollBar(), SIGNAL(valueChanged(int)), this, SLOT(VerticalScroll(int)));
@@ -81,11 +128,23 @@ MainWindow::MainWindow(QWidget *parent)
 
 MainWindow::~MainWindow(void)
 {
+	if(m_watcher.isRunning())
+	{
+		m_task.Cancel();
+		m_watcher.waitForFinished();
+		delete m_watcher.result();
+	}
+	StopPreview(false);
+	m_previewWatcher.waitForFinished();
 	delete m_ui;
 	for(QMap<QString, Convolution::Filter>::iterator it = m_filters.begin();it != m_filters.end(); ++it)
 	{
 		delete [] it->kernel;
 	}
+	for(QMap<QString, Convolution::CompiledFilter*>::iterator it = m_compiledFilters.begin();it != m_compiledFilters.end(); ++it)
+	{
+		delete it.value();
+	}
 	if(m_imageInternal[0] != nullptr)
 	{
 		delete m_imageInternal[0];
@@ -94,24 +153,13 @@ MainWindow::~MainWindow(void)
 	{
 		delete m_imageInternal[1];
 	}
-	ClearStack(m_undo);
-	ClearStack(m_redo);
+	delete m_gradient;
 }
 
-void MainWindow::ClearStack(QStack<MainWindow::Action>& s)
+void MainWindow::SetHistoryBudget(size_t bytes)
 {
-	while(s.size() > 0)
-	{
-		if(s.top().result != nullptr)
-		{
-			if(s.top().gradient != nullptr)
-			{
-				delete s.top().gradient;
-			}
-			delete s.top().result;
-		}
-		s.pop();
-	}
+	m_history.SetBudget(bytes);
+	UpdateActions();
 }
 
 void MainWindow::Open(void)
@@ -123,9 +171,6 @@ void MainWindow::Open(void)
 	QString fileName = QFileDialog::getOpenFileName(this, tr("Open Image"), tr("./"), "Images (*.png *.jpg *.jpeg *.bmp *.gif);;All files (*.*)");
 	if(!fileName.isNull())
 	{
-		ClearStack(m_undo);
-		ClearStack(m_redo);
-
 		Convolution::Image* newImage = Convolution::LoadImage(fileName.toStdString());
 		if (newImage == nullptr) {
 			QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
@@ -134,7 +179,6 @@ void MainWindow::Open(void)
 			return;
 		}
 		Do(newImage, false, QString("Open image: \"") + fileName + QString("\""), true);
-		delete newImage;
 	}
 }
 
@@ -148,9 +192,29 @@ void MainWindow::SaveAs(void)
 	QString fileName = QFileDialog::getSaveFileName(this, tr("Save Image"), tr("./"),
 													"Portable Network Graphics (*.png);;JPEG (*.jpg *.jpeg);;Bitmap (*.bmp);;GIF (*.gif);;All files (*.*)");
 
-	if(!fileName.isNull())
+	if(!fileName.isNull() && !Convolution::SaveImage(*m_imageInternal[1], fileName.toStdString()))
+	{
+		QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
+								 tr("Cannot save %1")
+								 .arg(QDir::toNativeSeparators(fileName)));
+	}
+}
+
+void MainWindow::SaveHoughAccumulator(void)
+{
+	if(m_houghAccumulator == nullptr || m_houghAccumulator->width == 0)
+	{
+		QMessageBox::information(this, tr("No accumulator"), tr("No Hough transformation has been completed."), QMessageBox::Ok);
+		return;
+	}
+	QString fileName = QFileDialog::getSaveFileName(this, tr("Save Hough Accumulator"), tr("./hough.png"),
+													"Portable Network Graphics (*.png);;Bitmap (*.bmp);;All files (*.*)");
+
+	if(!fileName.isNull() && !Convolution::SaveImage(*m_houghAccumulator, fileName.toStdString()))
 	{
-		Convolution::SaveImage(*m_imageInternal[1], fileName.toStdString());
+		QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
+								 tr("Cannot save %1")
+								 .arg(QDir::toNativeSeparators(fileName)));
 	}
 }
 
@@ -163,11 +227,14 @@ void MainWindow::CreateFilter(void)
 {
 	FilterBox f(this);
 	f.Initialize(&m_filters);
+	connect(&f, SIGNAL(Changed()), this, SLOT(PreviewFilter()));
 	f.setModal(true);
 	f.exec();
+	StopPreview(true);
 	QString name = f.GetName();
 	if(!name.isNull())
 	{
+		CompileFilter(name);
 		AddFilter(name);
 	}
 }
@@ -199,8 +266,11 @@ void MainWindow::EditFilter(void)
 	{
 		FilterBox f(this);
 		f.Initialize(&m_filters, filterName);
+		connect(&f, SIGNAL(Changed()), this, SLOT(PreviewFilter()));
 		f.setModal(true);
 		f.exec();
+		StopPreview(true);
+		CompileFilter(filterName);
 	}
 }
 
@@ -221,6 +291,7 @@ void MainWindow::DeleteFilter(void)
 	if(m_filters.contains(filterName))
 	{
 		m_filters.remove(filterName);
+		delete m_compiledFilters.take(filterName);
 		m_ui->menuApply_filter->removeAction(menu->menuAction());
 	}
 }
@@ -232,13 +303,27 @@ void MainWindow::ApplySimpleThreshold(void)
 		return;
 	}
 	TresholdBox t(this, true);
+	PrepareTreshold(t);
 	t.setModal(true);
 	t.exec();
-	if(t.IsValidated())
+	std::shared_ptr<Convolution::Image> preview = StopPreview(!t.IsValidated());
+	if(t.IsValidated() && preview != nullptr)
+	{
+		Do(new Convolution::Image(*preview), false, "Apply simple treshold");
+	}
+	else if(t.IsValidated())
 	{
-		Convolution::Image* result = Convolution::Treshold(m_imageInternal[1], t.GetMin(), t.GetMin());
-		Do(result, false, "Apply simple treshold");
+		Convolution::Image image(m_grayPlane);
+		uint8_t lut[256];
+		Convolution::TresholdLut(t.GetMin(), t.GetMin(), lut);
+		Run("Apply simple treshold", false, [image, lut]()
+		{
+			Convolution::Image* result = new Convolution::Image();
+			Convolution::ApplyLut(image, lut, *result, 0);
+			return result;
+		});
 	}
+	m_grayPlane = Convolution::Image();
 }
 
 void MainWindow::ApplyHysteresisThreshold(void)
@@ -248,13 +333,67 @@ void MainWindow::ApplyHysteresisThreshold(void)
 		return;
 	}
 	TresholdBox t(this, false);
+	PrepareTreshold(t);
 	t.setModal(true);
 	t.exec();
-	if(t.IsValidated())
+	std::shared_ptr<Convolution::Image> preview = StopPreview(!t.IsValidated());
+	if(t.IsValidated() && preview != nullptr)
 	{
-		Convolution::Image* result = Convolution::Treshold(m_imageInternal[1], t.GetMin(), t.GetMax());
-		Do(result, false, "Apply hysteresis treshold");
+		Do(new Convolution::Image(*preview), false, "Apply hysteresis treshold");
+	}
+	else if(t.IsValidated())
+	{
+		Convolution::Image image(m_grayPlane);
+		int tresholdMin = t.GetMin();
+		int tresholdMax = t.GetMax();
+		Run("Apply hysteresis treshold", false, [image, tresholdMin, tresholdMax]()
+		{
+			Convolution::Image* result = new Convolution::Image();
+			Convolution::Treshold(image, tresholdMin, tresholdMax, *result, 0);
+			return result;
+		});
 	}
+	m_grayPlane = Convolution::Image();
+}
+
+//
+// Edges of the result image in one pass, the tresholds apply to the gradient computed by the pass
+void MainWindow::Canny(void)
+{
+	if(m_imageInternal[1] == nullptr)
+	{
+		return;
+	}
+	if(m_imageInternal[1]->format == Convolution::Image::Format::Indexed8)
+	{
+		m_grayPlane = *m_imageInternal[1];
+	}
+	else
+	{
+		Convolution::ToGrayScale(*m_imageInternal[1], m_grayPlane);
+	}
+	TresholdBox t(this, false);
+	connect(&t, SIGNAL(Changed(int, int)), this, SLOT(PreviewCanny(int, int)));
+	t.setModal(true);
+	t.exec();
+	std::shared_ptr<Convolution::Image> preview = StopPreview(!t.IsValidated());
+	if(t.IsValidated() && preview != nullptr)
+	{
+		Do(new Convolution::Image(*preview), false, "Canny edges");
+	}
+	else if(t.IsValidated())
+	{
+		Convolution::Image image(m_grayPlane);
+		int tresholdMin = t.GetMin();
+		int tresholdMax = t.GetMax();
+		Run("Canny edges", false, [image, tresholdMin, tresholdMax]()
+		{
+			Convolution::Image* result = new Convolution::Image();
+			Convolution::Canny(image, tresholdMin, tresholdMax, *result, 0);
+			return result;
+		});
+	}
+	m_grayPlane = Convolution::Image();
 }
 
 void MainWindow::Refine(void)
@@ -269,17 +408,117 @@ void MainWindow::Refine(void)
 		QMessageBox::information(this, tr("No gradient"), tr("No gradient has been calcualted."), QMessageBox::Ok);
 		return;
 	}
-	Convolution::Image* result = Convolution::Refine(*m_imageInternal[1], *m_gradient);
-	Do(result, false, "Refine edges");
+	Convolution::Image image(*m_imageInternal[1]);
+	Convolution::Image gradient(*m_gradient);
+	Run("Refine edges", false, [image, gradient]()
+	{
+		Convolution::Image* result = new Convolution::Image();
+		Convolution::Refine(image, gradient, *result);
+		return result;
+	});
+}
+
+//
+// Refine suppressing the edge pixels along the gradient direction of the original image only
+void MainWindow::OrientedRefine(void)
+{
+	if(m_imageInternal[1] == nullptr)
+	{
+		return;
+	}
+
+	if(m_gradient == nullptr)
+	{
+		QMessageBox::information(this, tr("No gradient"), tr("No gradient has been calcualted."), QMessageBox::Ok);
+		return;
+	}
+	Convolution::Image image(*m_imageInternal[1]);
+	Convolution::Image gradient(*m_gradient);
+	Convolution::Image original(*m_imageInternal[0]);
+	Run("Oriented refine edges", false, [image, gradient, original]()
+	{
+		Convolution::Image orientation;
+		Convolution::Orientation(original, orientation, 0);
+		Convolution::Image* result = new Convolution::Image();
+		Convolution::Refine(image, gradient, orientation, *result, 0);
+		return result;
+	});
+}
+
+//
+// Contours of the refined edges, drawn with the gaps closed along the gradient
+void MainWindow::CloseContours(void)
+{
+	if(m_imageInternal[1] == nullptr)
+	{
+		return;
+	}
+
+	if(m_gradient == nullptr)
+	{
+		QMessageBox::information(this, tr("No gradient"), tr("No gradient has been calcualted."), QMessageBox::Ok);
+		return;
+	}
+	Convolution::Image image(*m_imageInternal[1]);
+	Convolution::Image gradient(*m_gradient);
+	Run("Close contours", false, [image, gradient]()
+	{
+		Convolution::Contours contours;
+		Convolution::TraceContours(image, &gradient, contours, CONTOUR_GAP, CONTOUR_MIN_GRADIENT);
+		Convolution::Image* result = new Convolution::Image(image.width, image.height);
+		memset(result->pixels, 0, (size_t)image.width * image.height);
+		Convolution::DrawContours(contours, *result, 0xffffff);
+		return result;
+	});
 }
 
 void MainWindow::HoughTransform(void)
 {
-	Convolution::Image* acc;
-	Convolution::Image* result = Convolution::Hough(*m_imageInternal[1], *m_imageInternal[0], &acc, 180, 100, 9, 0xff0000);
-	Convolution::SaveImage(*acc, "hough.png");
-	delete acc;
-	Do(result, false, "Hough transformation");
+	HoughTransformInternal(false);
+}
+
+void MainWindow::OrientedHoughTransform(void)
+{
+	HoughTransformInternal(true);
+}
+
+void MainWindow::ProbabilisticHoughTransform(void)
+{
+	if(m_imageInternal[1] == nullptr)
+	{
+		return;
+	}
+	Convolution::Image image(*m_imageInternal[1]);
+	Convolution::Image original(*m_imageInternal[0]);
+	Run("Probabilistic Hough transformation", false, [image, original]()
+	{
+		Convolution::Image* result = new Convolution::Image();
+		Convolution::ProbabilisticHough(image, original, *result, 180, 100, HOUGH_SAMPLE_BUDGET, 0xff0000);
+		return result;
+	});
+}
+
+//
+// Centres are voted for along the gradient directions of the source image
+void MainWindow::CircleHoughTransform(void)
+{
+	if(m_imageInternal[1] == nullptr)
+	{
+		return;
+	}
+	Convolution::Image image(*m_imageInternal[1]);
+	Convolution::Image original(*m_imageInternal[0]);
+	Run("Circle Hough transformation", false, [image, original]()
+	{
+		Convolution::Image orientation;
+		Convolution::Orientation(original, orientation, 0);
+		std::vector<Convolution::HoughCircle> circles;
+		Convolution::HoughCircles(image, orientation, circles, HOUGH_CIRCLE_MIN_RADIUS, HOUGH_CIRCLE_MAX_RADIUS, 100, 9, 0);
+		Convolution::Image* result = new Convolution::Image(original);
+		result->Detach();
+		Convolution::DrawHoughCircles(circles, *result, 0xff0000);
+		return result;
+	});
 }
 
 void MainWindow::Reset(void)
@@ -288,68 +527,168 @@ void MainWindow::Reset(void)
 	{
 		if(QMessageBox::Yes == QMessageBox::warning(this, tr("Reset ?"), tr("The Undo/Redo stack will be cleared. Are you sure you want to reset ?"), QMessageBox::Yes, QMessageBox::No))
 		{
-			while(m_undo.size() > 2)
-			{
-				if(m_undo.top().result != nullptr)
-				{
-					delete m_undo.top().result;
-				}
-				m_undo.pop();
-			}
-			if(m_undo.size() == 2)
-			{
-				Undo();
-			}
-			ClearStack(m_redo);
+			//
+			// The bottom of the undo stack may have been dropped to keep the history under its budget, the opened image
+			// is restored from the source instead
+			m_history.Clear();
+			delete m_imageInternal[1];
+			delete m_gradient;
+			m_gradient = nullptr;
+			m_actionIsGradient = false;
 			m_lastAction = "Reset image";
+			UpdateActions();
+			SetImage(new Convolution::Image(*m_imageInternal[0]), false);
 		}
 	}
 }
 
 void MainWindow::Undo(void)
 {
-	if(m_undo.size() <= 1)
+	History::State state;
+	if(!m_history.PopUndo(state))
 	{
 		return;
 	}
-	Action a = { m_imageInternal[1], m_lastAction, m_gradient, m_actionIsGradient };
-	m_redo.push(a);
-	a = m_undo.pop();
-	m_lastAction = a.action;
-	m_actionIsGradient = a.actionIsGradient;
-	m_gradient = a.gradient;
+	History::State current = { m_imageInternal[1], m_gradient, m_lastAction, m_actionIsGradient };
+	m_history.PushRedo(current);
+	m_lastAction = state.action;
+	m_actionIsGradient = state.actionIsGradient;
+	m_gradient = state.gradient;
 	UpdateActions();
-	SetImage(a.result, false);
+	SetImage(state.result, false);
 }
 
 void MainWindow::Redo(void)
 {
-	if(m_redo.size() == 0)
+	History::State state;
+	if(!m_history.PopRedo(state))
 	{
 		return;
 	}
-	Action a = { m_imageInternal[1], m_lastAction, m_gradient, m_actionIsGradient };
-	m_undo.push(a);
-	a = m_redo.pop();
-	m_lastAction = a.action;
-	m_actionIsGradient = a.actionIsGradient;
-	m_gradient = a.gradient;
+	History::State current = { m_imageInternal[1], m_gradient, m_lastAction, m_actionIsGradient };
+	m_history.PushUndo(current);
+	m_lastAction = state.action;
+	m_actionIsGradient = state.actionIsGradient;
+	m_gradient = state.gradient;
 	UpdateActions();
-	SetImage(a.result, false);
+	SetImage(state.result, false);
 }
 
+//
+// The window takes ownership of the image. The previous image and gradient go to the undo stack, the gradient is kept
+// for the new image as a copy sharing its pixels. A new source image starts a new history.
 void MainWindow::Do(Convolution::Image* image, bool gradient, const QString &action, bool source)
 {
-	ClearStack(m_redo);
-	Action a = { m_imageInternal[1], m_lastAction, m_gradient, m_actionIsGradient };
-	m_undo.push(a);
+	Convolution::Image* previousGradient = m_gradient;
+	m_gradient = gradient ? Convolution::ToGrayScale(*image) : ((m_gradient == nullptr || source) ? nullptr : new Convolution::Image(*m_gradient));
+	if(source)
+	{
+		m_history.Clear();
+		delete m_imageInternal[1];
+		delete previousGradient;
+	}
+	else
+	{
+		m_history.ClearRedo();
+		History::State previous = { m_imageInternal[1], previousGradient, m_lastAction, m_actionIsGradient };
+		m_history.PushUndo(previous);
+	}
 	m_lastAction = action;
-	m_gradient = gradient ? Convolution::ToGrayScale(*image) : (m_gradient == nullptr ? nullptr : new Convolution::Image(*m_gradient));
 	m_actionIsGradient = gradient;
 	UpdateActions();
 	SetImage(image, source);
 }
 
+void MainWindow::Cancel(void)
+{
+	if(m_watcher.isRunning())
+	{
+		m_task.Cancel();
+		m_statusLabel->setText("Cancelling [ " + m_runningAction + " ]");
+	}
+}
+
+void MainWindow::OperationProgress(void)
+{
+	m_progressBar->setValue(m_task.Progress());
+}
+
+void MainWindow::OperationFinished(void)
+{
+	Convolution::Image* result = m_watcher.result();
+	SetBusy(false);
+	if(m_task.IsCancelled())
+	{
+		delete result;
+		UpdateActions();
+		m_ui->statusBar->showMessage("Cancelled [ " + m_runningAction + " ]", 3000);
+		return;
+	}
+	Do(result, m_runningGradient, m_runningAction);
+}
+
+//
+// The simple treshold is a single lookup of the gray levels
+void MainWindow::PreviewTreshold(int tresholdMin, int tresholdMax)
+{
+	if(tresholdMin == tresholdMax)
+	{
+		uint8_t lut[256];
+		Convolution::TresholdLut(tresholdMin, tresholdMax, lut);
+		Preview(m_grayPlane, [lut](const Convolution::Image& in, Convolution::Image& out)
+		{
+			Convolution::ApplyLut(in, lut, out, 0);
+		});
+	}
+	else
+	{
+		Preview(m_grayPlane, [tresholdMin, tresholdMax](const Convolution::Image& in, Convolution::Image& out)
+		{
+			Convolution::Treshold(in, tresholdMin, tresholdMax, out, 0);
+		});
+	}
+}
+
+void MainWindow::PreviewCanny(int tresholdMin, int tresholdMax)
+{
+	Preview(m_grayPlane, [tresholdMin, tresholdMax](const Convolution::Image& in, Convolution::Image& out)
+	{
+		Convolution::Canny(in, tresholdMin, tresholdMax, out, 0);
+	});
+}
+
+void MainWindow::PreviewFilter(void)
+{
+	FilterBox* box = qobject_cast<FilterBox*>(sender());
+	if(box == nullptr || m_imageInternal[1] == nullptr)
+	{
+		return;
+	}
+	Convolution::Filter filter = box->GetFilter();
+	std::shared_ptr<Convolution::CompiledFilter> compiled = std::make_shared<Convolution::CompiledFilter>(filter);
+	delete [] filter.kernel;
+	if(compiled->divisor == 0.0)
+	{
+		return;
+	}
+	Preview(*m_imageInternal[1], [compiled](const Convolution::Image& in, Convolution::Image& out)
+	{
+		Convolution::ApplyFilter(in, *compiled, Convolution::Filter::SideHandle::Continuous, out, false, 0);
+	});
+}
+
+//
+// Results of cancelled previews are dropped by the worker, they are released with the future
+void MainWindow::PreviewFinished(void)
+{
+	std::shared_ptr<Convolution::Image> result = m_previewWatcher.result();
+	if(result != nullptr && m_previewTask != nullptr && !m_previewTask->IsCancelled())
+	{
+		m_previewResult = result;
+		ShowPreview(*result);
+	}
+}
+
 void MainWindow::About(void)
 {
 	QMessageBox::about(this, tr("About"), tr("<p>Image analysis M2 project - 2016</p><p><b>Chavot Joris</b> - <b>Kieffer Joseph</b></p>"));
@@ -422,8 +761,188 @@ void MainWindow::ApplyFilterInternal(bool multi)
 	QString filterName = menu->menuAction()->text();
 	if(m_filters.contains(filterName))
 	{
-		Convolution::Image* result = Convolution::ApplyFilter(*m_imageInternal[1], m_filters[filterName], Convolution::Filter::SideHandle::Continuous, multi);
-		Do(result, true, QString("Apply filter") + (multi ? " (multi):" : ":") + " \"" + filterName + QString("\""));
+		Convolution::Image image(*m_imageInternal[1]);
+		Convolution::CompiledFilter filter(*m_compiledFilters[filterName]);
+		Run(QString("Apply filter") + (multi ? " (multi):" : ":") + " \"" + filterName + QString("\""), true, [image, filter, multi]()
+		{
+			Convolution::Image* result = new Convolution::Image();
+			Convolution::ApplyFilter(image, filter, Convolution::Filter::SideHandle::Continuous, *result, multi, 0);
+			return result;
+		});
+	}
+}
+
+//
+// The oriented transformation takes the gradient directions from the source image, each edge pixel only votes for
+// the lines close to its edge
+void MainWindow::HoughTransformInternal(bool oriented)
+{
+	if(m_imageInternal[1] == nullptr)
+	{
+		return;
+	}
+	Convolution::Image image(*m_imageInternal[1]);
+	Convolution::Image original(*m_imageInternal[0]);
+	std::shared_ptr<Convolution::Image> accumulator = std::make_shared<Convolution::Image>();
+	m_houghAccumulator = accumulator;
+	Run(oriented ? "Oriented Hough transformation" : "Hough transformation", false, [image, original, oriented, accumulator]()
+	{
+		Convolution::Image* result = new Convolution::Image();
+		Convolution::Image orientation;
+		if(oriented)
+		{
+			Convolution::Orientation(original, orientation, 0);
+		}
+		Convolution::Hough(image, original, *result, accumulator.get(), 180, 100, 9, 0xff0000, 0, oriented ? &orientation : nullptr, HOUGH_ANGLE_WINDOW);
+		return result;
+	});
+}
+
+//
+// The operation runs on a worker thread with the task of the window, its result goes through Do once it completes.
+// The images it uses are copies sharing their pixels so that nothing the window does can change them meanwhile.
+void MainWindow::Run(const QString& action, bool gradient, const std::function<Convolution::Image*(void)>& operation)
+{
+	if(m_watcher.isRunning())
+	{
+		return;
+	}
+	m_runningAction = action;
+	m_runningGradient = gradient;
+	m_task.Reset();
+	SetBusy(true);
+	m_statusLabel->setText("Running [ " + action + " ]");
+	Convolution::Task* task = &m_task;
+	m_watcher.setFuture(QtConcurrent::run([task, operation]() -> Convolution::Image*
+	{
+		Convolution::Task::SetCurrent(task);
+		Convolution::Image* result = operation();
+		Convolution::Task::SetCurrent(nullptr);
+		return result;
+	}));
+}
+
+//
+// Parameters being tuned in a dialog are first applied to a downscaled proxy of the result image, shown right away,
+// then to the full image on a worker thread. Each new call cancels the full resolution pass of the previous one.
+void MainWindow::Preview(const Convolution::Image& source, const std::function<void(const Convolution::Image& in, Convolution::Image& out)>& operation)
+{
+	if(source.pixels == nullptr)
+	{
+		return;
+	}
+	if(m_proxy.pixels == nullptr || m_previewSource.pixels != source.pixels)
+	{
+		m_previewSource = source;
+		uint32_t size = std::max(m_previewSource.width, m_previewSource.height);
+		Convolution::Downscale(m_previewSource, (size + PREVIEW_SIZE - 1) / PREVIEW_SIZE, m_proxy, 0);
+	}
+	if(m_previewTask != nullptr)
+	{
+		m_previewTask->Cancel();
+	}
+	m_previewResult.reset();
+
+	Convolution::Image proxyResult;
+	operation(m_proxy, proxyResult);
+	ShowPreview(proxyResult);
+
+	std::shared_ptr<Convolution::Task> task = std::make_shared<Convolution::Task>();
+	Convolution::Image image(m_previewSource);
+	m_previewTask = task;
+	m_previewWatcher.setFuture(QtConcurrent::run([task, image, operation]() -> std::shared_ptr<Convolution::Image>
+	{
+		Convolution::Task::SetCurrent(task.get());
+		std::shared_ptr<Convolution::Image> result = std::make_shared<Convolution::Image>();
+		operation(image, *result);
+		Convolution::Task::SetCurrent(nullptr);
+		if(task->IsCancelled())
+		{
+			result.reset();
+		}
+		return result;
+	}));
+}
+
+//
+// Cancel the preview and return its full resolution result if it was completed. The result image is displayed again
+// when restore is set.
+std::shared_ptr<Convolution::Image> MainWindow::StopPreview(bool restore)
+{
+	bool previewing = (m_previewTask != nullptr);
+	if(previewing)
+	{
+		m_previewTask->Cancel();
+		m_previewTask.reset();
+	}
+	std::shared_ptr<Convolution::Image> result = m_previewResult;
+	m_previewResult.reset();
+	m_previewSource = Convolution::Image();
+	m_proxy = Convolution::Image();
+	if(previewing && restore && m_imageInternal[1] != nullptr)
+	{
+		SetImage(Convolution::ToQImage(*m_imageInternal[1]), false);
+	}
+	return result;
+}
+
+//
+// Proxy results are stretched to the size of the full resolution result
+void MainWindow::ShowPreview(const Convolution::Image& image)
+{
+	m_imageLabel[1]->setPixmap(QPixmap::fromImage(Convolution::ToQImage(image)));
+	m_imageLabel[1]->resize(m_previewSource.width, m_previewSource.height);
+}
+
+//
+// The gray levels of the result image are computed once for the whole dialog: the previews and the treshold itself
+// work on them, and their histogram is drawn in the dialog
+void MainWindow::PrepareTreshold(TresholdBox& box)
+{
+	if(m_imageInternal[1]->format == Convolution::Image::Format::Indexed8)
+	{
+		m_grayPlane = *m_imageInternal[1];
+	}
+	else
+	{
+		Convolution::ToGrayScale(*m_imageInternal[1], m_grayPlane);
+	}
+	uint32_t histogram[256];
+	Convolution::Histogram(m_grayPlane, histogram);
+	box.SetHistogram(histogram);
+	connect(&box, SIGNAL(Changed(int, int)), this, SLOT(PreviewTreshold(int, int)));
+}
+
+//
+// Actions changing the images or the filters wait for the running operation
+void MainWindow::SetBusy(bool busy)
+{
+	m_ui->actionOpen->setEnabled(!busy);
+	m_ui->actionSave_As->setEnabled(!busy);
+	m_ui->actionSave_Hough_Accumulator->setEnabled(!busy);
+	m_ui->menuApply_filter->menuAction()->setEnabled(!busy);
+	m_ui->menuApply_threshold->menuAction()->setEnabled(!busy);
+	m_ui->actionCanny->setEnabled(!busy);
+	m_ui->actionRefine->setEnabled(!busy);
+	m_ui->actionOriented_Refine->setEnabled(!busy);
+	m_ui->actionClose_Contours->setEnabled(!busy);
+	m_ui->actionHough_Transform->setEnabled(!busy);
+	m_ui->actionOriented_Hough_Transform->setEnabled(!busy);
+	m_ui->actionProbabilistic_Hough_Transform->setEnabled(!busy);
+	m_ui->actionCircle_Hough_Transform->setEnabled(!busy);
+	m_ui->actionReset->setEnabled(!busy);
+	m_ui->actionUndo->setEnabled(!busy);
+	m_ui->actionRedo->setEnabled(!busy);
+	m_ui->actionCancel->setEnabled(busy);
+	m_progressBar->setValue(0);
+	m_progressBar->setVisible(busy);
+	if(busy)
+	{
+		m_progressTimer.start(100);
+	}
+	else
+	{
+		m_progressTimer.stop();
 	}
 }
 
@@ -440,13 +959,16 @@ void MainWindow::SetImage(const QImage &newImage, bool source)
 	m_scrollArea[1]->setVisible(true);
 }
 
+//
+// The image becomes the displayed result, the source image shares its pixels when it is replaced as well
 void MainWindow::SetImage(Convolution::Image* newImage, bool source)
 {
 	if(source)
 	{
+		delete m_imageInternal[0];
 		m_imageInternal[0] = new Convolution::Image(*newImage);
 	}
-	m_imageInternal[1] = new Convolution::Image(*newImage);
+	m_imageInternal[1] = newImage;
 	SetImage(Convolution::ToQImage(*newImage), source);
 }
 
@@ -464,7 +986,8 @@ void MainWindow::UpdateActions(void)
 {
 	m_statusLabel->setText(QString(
 							   ((m_lastAction == "") ? "No Actions" : ("Last action [ " + m_lastAction + " ]")) +
-							   " | Gradient calculated : " + ((m_gradient == nullptr) ? "No" : "Yes")));
+							   " | Gradient calculated : " + ((m_gradient == nullptr) ? "No" : "Yes") +
+							   QString(" | History : %1 / %2 MB").arg(m_history.MemoryUsage() / (1024 * 1024)).arg(m_history.Budget() / (1024 * 1024))));
 }
 
 void MainWindow::AddFilter(const QString& filterName)
@@ -491,60 +1014,21 @@ void MainWindow::AddFilter(const QString& filterName)
 
 void MainWindow::CreateDefaultFilters(void)
 {
-	Convolution::Filter f;
-	f.divisor = 6;
-	f.size = 3;
-	f.kernel = new double[9];
-	f.kernel[0] = f.kernel[2] = f.kernel[6] = f.kernel[8] = 0.0;
-	f.kernel[1] = f.kernel[3] = f.kernel[5] = f.kernel[7] = -1.0;
-	f.kernel[4] = 4;
-	m_filters["Laplacian"] = f;
-
-	f.divisor = 9;
-	f.size = 3;
-	f.kernel = new double[9];
-	f.kernel[0] = f.kernel[1] = f.kernel[2] = f.kernel[3] = f.kernel[4] = f.kernel[5] = f.kernel[6] = f.kernel[7] = f.kernel[8] = 1;
-	m_filters["Box Blur"] = f;
-
-	f.divisor = 3;
-	f.size = 3;
-	f.kernel = new double[9];
-	f.kernel[0] = f.kernel[1] = f.kernel[2] = 1;
-	f.kernel[3] = f.kernel[4] = f.kernel[5] = 0;
-	f.kernel[6] = f.kernel[7] = f.kernel[8] = -1;
-	m_filters["Prewitt"] = f;
-
-	f.divisor = 4;
-	f.size = 3;
-	f.kernel = new double[9];
-	f.kernel[0] = f.kernel[2] = 1;
-	f.kernel[3] = f.kernel[4] = f.kernel[5] = 0;
-	f.kernel[6] = f.kernel[8] = -1;
-	f.kernel[1] = 2;
-	f.kernel[7] = -2;
-	m_filters["Sobel"] = f;
-
-	f.divisor = 15;
-	f.size = 3;
-	f.kernel = new double[9];
-	f.kernel[0] = f.kernel[1] = f.kernel[2] = 5;
-	f.kernel[3] = f.kernel[5] = f.kernel[6] = f.kernel[7] = f.kernel[8] = -3;
-	f.kernel[4] = 0;
-	m_filters["Kirsch"] = f;
-
-	f.divisor = 159;
-	f.size = 5;
-	f.kernel = new double[25];
-	f.kernel[0] = f.kernel[4] = f.kernel[20] = f.kernel[24] = 2;
-	f.kernel[1] = f.kernel[3] = f.kernel[5] = f.kernel[9] = f.kernel[15] = f.kernel[19] = f.kernel[21] = f.kernel[23] = 4;
-	f.kernel[2] = f.kernel[10] = f.kernel[14] = f.kernel[22] = 5;
-	f.kernel[6] = f.kernel[8] = f.kernel[16] = f.kernel[18] = 9;
-	f.kernel[7] = f.kernel[11] = f.kernel[13] = f.kernel[17] = 12;
-	f.kernel[12] = 15;
-	m_filters["Gaussian Blur"] = f;
+	std::map<std::string, Convolution::Filter> filters = Convolution::DefaultFilters();
+	for(std::map<std::string, Convolution::Filter>::iterator it = filters.begin();it != filters.end(); ++it)
+	{
+		QString name = QString::fromStdString(it->first);
+		m_filters[name] = it->second;
+		CompileFilter(name);
+		AddFilter(name);
+	}
+}
 
-	for(QMap<QString, Convolution::Filter>::iterator it = m_filters.begin();it != m_filters.end(); ++it)
+void MainWindow::CompileFilter(const QString& filterName)
+{
+	delete m_compiledFilters.take(filterName);
+	if(m_filters.contains(filterName))
 	{
-		AddFilter(it.key());
+		m_compiledFilters[filterName] = new Convolution::CompiledFilter(m_filters[filterName]);
 	}
 }
@@ -2,43 +2,42 @@
 #define MAINWINDOW_H
 
 #include "Convolution.h"
+#include "History.h"
 
 #include <QMainWindow>
 #include <QImage>
 #include <QScrollBar>
 #include <QLabel>
 #include <QScrollArea>
-#include <QStack>
 #include <QMap>
+#include <QFutureWatcher>
+#include <QProgressBar>
+#include <QTimer>
+
+#include <functional>
+#include <memory>
 
 namespace Ui {
 class MainWindow;
 }
 
+class TresholdBox;
+
 class MainWindow : public QMainWindow
 {
 	Q_OBJECT
 
-private:
-
-	struct Action
-	{
-		Convolution::Image* result;
-		QString action;
-		Convolution::Image* gradient;
-		bool actionIsGradient;
-	};
-
 public:
 	explicit MainWindow				(QWidget *parent = 0);
 	virtual	~MainWindow				(void);
 
-	void	ClearStack				(QStack<Action>& s);
+	void	SetHistoryBudget		(size_t bytes);
 
 public slots:
 
 	void	Open					(void);
 	void	SaveAs					(void);
+	void	SaveHoughAccumulator	(void);
 	void	Exit					(void);
 
 	void	CreateFilter			(void);
@@ -49,14 +48,27 @@ public slots:
 
 	void	ApplySimpleThreshold	(void);
 	void	ApplyHysteresisThreshold(void);
+	void	Canny					(void);
 
 	void	Refine					(void);
+	void	OrientedRefine			(void);
+	void	CloseContours			(void);
 	void	HoughTransform			(void);
+	void	OrientedHoughTransform	(void);
+	void	ProbabilisticHoughTransform(void);
+	void	CircleHoughTransform	(void);
 
 	void	Reset					(void);
 	void	Undo					(void);
 	void	Redo					(void);
 	void	Do						(Convolution::Image* image, bool gradient, const QString& action, bool source = false);
+	void	Cancel					(void);
+	void	OperationProgress		(void);
+	void	OperationFinished		(void);
+	void	PreviewTreshold			(int tresholdMin, int tresholdMax);
+	void	PreviewCanny			(int tresholdMin, int tresholdMax);
+	void	PreviewFilter			(void);
+	void	PreviewFinished			(void);
 
 	void	About					(void);
 	void	AboutQt					(void);
@@ -73,6 +85,13 @@ public slots:
 private:
 
 	void	ApplyFilterInternal		(bool multi);
+	void	HoughTransformInternal	(bool oriented);
+	void	Run						(const QString& action, bool gradient, const std::function<Convolution::Image*(void)>& operation);
+	void	SetBusy					(bool busy);
+	void	Preview					(const Convolution::Image& source, const std::function<void(const Convolution::Image& in, Convolution::Image& out)>& operation);
+	std::shared_ptr<Convolution::Image>	StopPreview	(bool restore);
+	void	ShowPreview				(const Convolution::Image& image);
+	void	PrepareTreshold			(TresholdBox& box);
 	void	SetImage				(const QImage& newImage, bool source = true);
 	void	SetImage				(Convolution::Image* newImage, bool source = true);
 	void	ScaleImage				(double factor);
@@ -80,6 +99,7 @@ private:
 	void	UpdateActions			(void);
 	void	AddFilter				(const QString& filterName);
 	void	CreateDefaultFilters	(void);
+	void	CompileFilter			(const QString& filterName);
 
 	Ui::MainWindow*						m_ui;
 
@@ -89,12 +109,28 @@ private:
 	QScrollArea*						m_scrollArea[2];
 	double								m_scaleFactor;
 	QMap<QString, Convolution::Filter>	m_filters;
+	QMap<QString, Convolution::CompiledFilter*>	m_compiledFilters;
 	QString								m_lastAction;
 	QLabel*								m_statusLabel;
 	bool								m_actionIsGradient;
 
-	QStack<Action> m_undo;
-	QStack<Action> m_redo;
+	History								m_history;
+
+	Convolution::Task					m_task;
+	QFutureWatcher<Convolution::Image*>	m_watcher;
+	QTimer								m_progressTimer;
+	QProgressBar*						m_progressBar;
+	QString								m_runningAction;
+	bool								m_runningGradient;
+
+	Convolution::Image					m_grayPlane;		// Gray levels of the result image while a treshold dialog is open
+	Convolution::Image					m_previewSource;	// Shares the pixels the proxy was computed from
+	Convolution::Image					m_proxy;
+	std::shared_ptr<Convolution::Task>	m_previewTask;
+	QFutureWatcher<std::shared_ptr<Convolution::Image> >	m_previewWatcher;
+	std::shared_ptr<Convolution::Image>	m_previewResult;	// Full resolution result of the last previewed parameters
+
+	std::shared_ptr<Convolution::Image>	m_houghAccumulator;	// Filled by the last Hough transformation
 
 };
 
@@ -0,0 +1,675 @@
+#include "Pipeline.h"
+
+#include <QFile>
+#include <QXmlStreamReader>
+
+#include <chrono>
+
+const int NO_STEP = -2;
+const int MAX_FILTER_SIZE = 9;
+
+QString XmlError(const QXmlStreamReader& xml, const QString& message)
+{
+	return QString("Line %1: %2").arg(xml.lineNumber()).arg(message);
+}
+
+//
+// Index of the step with the given name, SOURCE for the processed image
+int StepIndex(const std::vector<Pipeline::Step>& steps, const QString& name)
+{
+	if(name == "source")
+	{
+		return Pipeline::SOURCE;
+	}
+	for(uint32_t i = 0; i < steps.size(); ++i)
+	{
+		if(steps[i].name == name.toStdString())
+		{
+			return i;
+		}
+	}
+	return NO_STEP;
+}
+
+//
+// Optional integer attribute, the value is left untouched when the attribute is missing
+bool ReadInteger(const QXmlStreamAttributes& attributes, const char* name, int& value)
+{
+	if(!attributes.hasAttribute(name))
+	{
+		return true;
+	}
+	QString text = attributes.value(name).toString().trimmed();
+	bool valid = false;
+	if(text.startsWith("#"))
+	{
+		value = text.mid(1).toInt(&valid, 16);
+	}
+	else
+	{
+		value = text.toInt(&valid, 0);
+	}
+	return valid;
+}
+
+bool ReadSideHandle(const QString& text, Convolution::Filter::SideHandle& sideHandle)
+{
+	const char* names[] = { "zeros", "ones", "black", "white", "continuous", "mirror", "repeat", "crop" };
+	const Convolution::Filter::SideHandle values[] = {
+		Convolution::Filter::SideHandle::Zeros,
+		Convolution::Filter::SideHandle::Ones,
+		Convolution::Filter::SideHandle::Black,
+		Convolution::Filter::SideHandle::White,
+		Convolution::Filter::SideHandle::Continuous,
+		Convolution::Filter::SideHandle::Mirror,
+		Convolution::Filter::SideHandle::Repeat,
+		Convolution::Filter::SideHandle::Crop };
+	for(uint32_t i = 0; i < 8; ++i)
+	{
+		if(text == names[i])
+		{
+			sideHandle = values[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+//
+// <filter name="" size="" divisor=""> followed by size * size <point value=""/>, replaces a filter with the same name
+// The size is limited to the 9x9 filters Convolution::Rotate and the filter box handle
+bool ReadFilter(QXmlStreamReader& xml, std::map<std::string, Convolution::Filter>& filters, QString& error)
+{
+	QXmlStreamAttributes attributes = xml.attributes();
+	std::string name = attributes.value("name").toString().toStdString();
+	bool validSize = false;
+	bool validDivisor = false;
+	int size = attributes.value("size").toString().toInt(&validSize);
+	double divisor = attributes.value("divisor").toString().toDouble(&validDivisor);
+	if(name.empty() || !validSize || size < 1 || size > MAX_FILTER_SIZE || size % 2 == 0 || !validDivisor)
+	{
+		error = XmlError(xml, "filter needs a name, an odd size up to 9 and a divisor");
+		return false;
+	}
+
+	std::vector<double> kernel;
+	while(xml.readNextStartElement())
+	{
+		if(xml.name() == QLatin1String("point"))
+		{
+			bool valid = false;
+			kernel.push_back(xml.attributes().value("value").toString().toDouble(&valid));
+			if(!valid)
+			{
+				error = XmlError(xml, "invalid point value");
+				return false;
+			}
+		}
+		xml.skipCurrentElement();
+	}
+	if(xml.hasError())
+	{
+		return false;
+	}
+	if(kernel.size() != (uint32_t)(size * size))
+	{
+		error = XmlError(xml, QString("filter \"%1\" needs %2 points").arg(QString::fromStdString(name)).arg(size * size));
+		return false;
+	}
+
+	Convolution::Filter filter;
+	filter.size = size;
+	filter.divisor = divisor;
+	filter.kernel = new double[kernel.size()];
+	for(uint32_t i = 0; i < kernel.size(); ++i)
+	{
+		filter.kernel[i] = kernel[i];
+	}
+	if(filters.count(name) != 0)
+	{
+		delete [] filters[name].kernel;
+	}
+	filters[name] = filter;
+	return true;
+}
+
+//
+// Expected size in bytes of the result of a step, used to hand it a buffer which will not need to be reallocated
+uint32_t ResultBytes(const Pipeline::Step& step, const Convolution::Image& input, const Convolution::Image& original, uint32_t filterSize)
+{
+	switch(step.operation)
+	{
+	case Pipeline::Step::Operation::GrayScale:
+	case Pipeline::Step::Operation::Treshold:
+	case Pipeline::Step::Operation::Canny:
+	case Pipeline::Step::Operation::Refine:
+	case Pipeline::Step::Operation::CloseContours:
+	case Pipeline::Step::Operation::Orientation:
+		return input.width * input.height;
+	case Pipeline::Step::Operation::Filter:
+		if(step.sideHandle == Convolution::Filter::SideHandle::Crop)
+		{
+			return (input.width - (filterSize - 1)) * (input.height - (filterSize - 1)) * Convolution::PixelSize(input.format);
+		}
+		return input.width * input.height * Convolution::PixelSize(input.format);
+	case Pipeline::Step::Operation::Hough:
+		return original.width * original.height * Convolution::PixelSize(original.format);
+	}
+	return 0;
+}
+
+Convolution::Image* AcquireBuffer(Pipeline::Context& context, uint32_t bytes)
+{
+	if(context.free.empty())
+	{
+		++context.allocations;
+		return new Convolution::Image();
+	}
+	uint32_t chosen = context.free.size() - 1;
+	for(uint32_t i = 0; i < context.free.size(); ++i)
+	{
+		const Convolution::Image* buffer = context.free[i];
+		if(buffer->width * buffer->height * Convolution::PixelSize(buffer->format) == bytes)
+		{
+			chosen = i;
+			break;
+		}
+	}
+	Convolution::Image* buffer = context.free[chosen];
+	context.free.erase(context.free.begin() + chosen);
+	return buffer;
+}
+
+Pipeline::Context::Context(void)
+	: allocations(0)
+{
+
+}
+
+Pipeline::Context::~Context(void)
+{
+	for(uint32_t i = 0; i < results.size(); ++i)
+	{
+		delete results[i];
+	}
+	for(uint32_t i = 0; i < free.size(); ++i)
+	{
+		delete free[i];
+	}
+}
+
+Pipeline::Pipeline(const std::string& name)
+	: m_name(name)
+{
+
+}
+
+/*virtual*/ Pipeline::~Pipeline(void)
+{
+	for(std::map<std::string, Convolution::CompiledFilter*>::iterator it = m_filters.begin(); it != m_filters.end(); ++it)
+	{
+		delete it->second;
+	}
+}
+
+/*static*/ bool Pipeline::Load(const QString& fileName, std::map<std::string, Convolution::Filter>& filters, std::map<std::string, Pipeline*>& pipelines, QString& error)
+{
+	QFile file(fileName);
+	if(!file.open(QIODevice::ReadOnly))
+	{
+		error = QString("Cannot open %1").arg(fileName);
+		return false;
+	}
+
+	QXmlStreamReader xml(&file);
+	std::vector<Pipeline*> loaded;
+	bool success = xml.readNextStartElement() && xml.name() == QLatin1String("filters");
+	if(!success && !xml.hasError())
+	{
+		error = XmlError(xml, "<filters> root element expected");
+	}
+	while(success && xml.readNextStartElement())
+	{
+		if(xml.name() == QLatin1String("filter"))
+		{
+			success = ReadFilter(xml, filters, error);
+		}
+		else if(xml.name() == QLatin1String("pipeline"))
+		{
+			Pipeline* pipeline = Read(xml, error);
+			success = (pipeline != nullptr);
+			if(success)
+			{
+				loaded.push_back(pipeline);
+			}
+		}
+		else
+		{
+			xml.skipCurrentElement();
+		}
+	}
+	if(xml.hasError())
+	{
+		error = XmlError(xml, xml.errorString());
+		success = false;
+	}
+
+	//
+	// Pipelines are planned once every filter of the file is known
+	for(uint32_t i = 0; i < loaded.size() && success; ++i)
+	{
+		success = loaded[i]->Plan(filters, error);
+	}
+	for(uint32_t i = 0; i < loaded.size(); ++i)
+	{
+		if(success)
+		{
+			delete pipelines[loaded[i]->m_name];
+			pipelines[loaded[i]->m_name] = loaded[i];
+		}
+		else
+		{
+			delete loaded[i];
+		}
+	}
+	if(!success)
+	{
+		error = fileName + ": " + error;
+	}
+	return success;
+}
+
+//
+// <pipeline name=""> followed by <step name="" operation="" .../> elements, each step reads the previous one unless told otherwise
+/*static*/ Pipeline* Pipeline::Read(QXmlStreamReader& xml, QString& error)
+{
+	Pipeline* pipeline = new Pipeline(xml.attributes().value("name").toString().toStdString());
+	if(pipeline->m_name.empty())
+	{
+		error = XmlError(xml, "pipeline needs a name");
+		delete pipeline;
+		return nullptr;
+	}
+
+	while(xml.readNextStartElement())
+	{
+		if(xml.name() != QLatin1String("step"))
+		{
+			xml.skipCurrentElement();
+			continue;
+		}
+
+		QXmlStreamAttributes attributes = xml.attributes();
+		Step step;
+		step.name = attributes.value("name").toString().toStdString();
+		step.input = pipeline->m_steps.empty() ? SOURCE : (int)pipeline->m_steps.size() - 1;
+		step.gradient = NO_STEP;
+		step.original = SOURCE;
+		step.orientation = NO_STEP;
+		step.filter = attributes.value("filter").toString().toStdString();
+		step.multi = (attributes.value("multi").toString() == "true");
+		step.sideHandle = Convolution::Filter::SideHandle::Continuous;
+		step.tresholdMin = 0;
+		step.tresholdMax = 0;
+		step.alphaPrecision = 180;
+		step.houghTreshold = 100;
+		step.maximas = 9;
+		step.lineColor = 0xff0000;
+		step.angleWindow = 10;
+		step.samples = 0;
+		step.gap = 10;
+		step.minGradient = 20;
+		step.output = (attributes.value("output").toString() == "true");
+		step.level = 0;
+		step.lastUse = 0;
+
+		QString message;
+		QString operation = attributes.value("operation").toString();
+		if(step.name.empty() || StepIndex(pipeline->m_steps, QString::fromStdString(step.name)) != NO_STEP)
+		{
+			message = "step needs a unique name other than \"source\"";
+		}
+		else if(operation == "gray")
+		{
+			step.operation = Step::Operation::GrayScale;
+		}
+		else if(operation == "filter")
+		{
+			step.operation = Step::Operation::Filter;
+			if(attributes.hasAttribute("side") && !ReadSideHandle(attributes.value("side").toString(), step.sideHandle))
+			{
+				message = "unknown side handle";
+			}
+		}
+		else if(operation == "threshold" || operation == "canny")
+		{
+			step.operation = (operation == "threshold") ? Step::Operation::Treshold : Step::Operation::Canny;
+			if(!ReadInteger(attributes, "min", step.tresholdMin))
+			{
+				message = "invalid min";
+			}
+			step.tresholdMax = step.tresholdMin;
+			if(!ReadInteger(attributes, "max", step.tresholdMax) || step.tresholdMax < step.tresholdMin)
+			{
+				message = "invalid max";
+			}
+		}
+		else if(operation == "refine")
+		{
+			step.operation = Step::Operation::Refine;
+			step.gradient = StepIndex(pipeline->m_steps, attributes.value("gradient").toString());
+			if(step.gradient == NO_STEP)
+			{
+				message = "refine needs the name of a previous step as gradient";
+			}
+			else if(attributes.hasAttribute("orientation"))
+			{
+				step.orientation = StepIndex(pipeline->m_steps, attributes.value("orientation").toString());
+				if(step.orientation == NO_STEP)
+				{
+					message = "unknown orientation step";
+				}
+			}
+		}
+		else if(operation == "close")
+		{
+			step.operation = Step::Operation::CloseContours;
+			step.gradient = StepIndex(pipeline->m_steps, attributes.value("gradient").toString());
+			if(step.gradient == NO_STEP)
+			{
+				message = "close needs the name of a previous step as gradient";
+			}
+			else if(!ReadInteger(attributes, "gap", step.gap) || !ReadInteger(attributes, "min", step.minGradient) || step.gap < 0)
+			{
+				message = "invalid close parameter";
+			}
+		}
+		else if(operation == "orientation")
+		{
+			step.operation = Step::Operation::Orientation;
+		}
+		else if(operation == "hough")
+		{
+			step.operation = Step::Operation::Hough;
+			if(attributes.hasAttribute("original"))
+			{
+				step.original = StepIndex(pipeline->m_steps, attributes.value("original").toString());
+			}
+			if(attributes.hasAttribute("orientation"))
+			{
+				step.orientation = StepIndex(pipeline->m_steps, attributes.value("orientation").toString());
+			}
+			if(step.original == NO_STEP)
+			{
+				message = "unknown original step";
+			}
+			else if(attributes.hasAttribute("orientation") && step.orientation == NO_STEP)
+			{
+				message = "unknown orientation step";
+			}
+			else if(!ReadInteger(attributes, "alpha", step.alphaPrecision) || !ReadInteger(attributes, "threshold", step.houghTreshold) ||
+					!ReadInteger(attributes, "maximas", step.maximas) || !ReadInteger(attributes, "color", step.lineColor) ||
+					!ReadInteger(attributes, "window", step.angleWindow) || !ReadInteger(attributes, "samples", step.samples) ||
+					step.alphaPrecision < 1 || step.angleWindow < 0 || step.samples < 0)
+			{
+				message = "invalid hough parameter";
+			}
+			else if(step.samples > 0 && step.orientation != NO_STEP)
+			{
+				message = "the probabilistic hough transformation does not use an orientation";
+			}
+		}
+		else
+		{
+			message = QString("unknown operation \"%1\"").arg(operation);
+		}
+		if(message.isEmpty() && attributes.hasAttribute("input"))
+		{
+			step.input = StepIndex(pipeline->m_steps, attributes.value("input").toString());
+			if(step.input == NO_STEP)
+			{
+				message = "input must be \"source\" or a previous step";
+			}
+		}
+		if(!message.isEmpty())
+		{
+			error = XmlError(xml, message);
+			delete pipeline;
+			return nullptr;
+		}
+
+		pipeline->m_steps.push_back(step);
+		xml.skipCurrentElement();
+	}
+	if(pipeline->m_steps.empty() && !xml.hasError())
+	{
+		error = XmlError(xml, "pipeline has no step");
+		delete pipeline;
+		return nullptr;
+	}
+	return pipeline;
+}
+
+bool Pipeline::Run(const Convolution::Image& source, Pipeline::Context& context, uint32_t threadCount, std::string& error) const
+{
+	//
+	// Everything left by the previous run is recycled
+	for(uint32_t i = 0; i < context.results.size(); ++i)
+	{
+		if(context.results[i] != nullptr)
+		{
+			context.free.push_back(context.results[i]);
+		}
+	}
+	context.results.assign(m_steps.size(), nullptr);
+	context.milliseconds.assign(m_steps.size(), 0.0);
+	context.poolAllocations.assign(m_steps.size(), 0);
+	context.lines.resize(m_steps.size());
+
+	threadCount = Convolution::ThreadCount(threadCount);
+	std::vector<std::string> errors(m_steps.size());
+	for(uint32_t level = 0; level < m_levels.size(); ++level)
+	{
+		const std::vector<uint32_t>& steps = m_levels[level];
+		for(uint32_t i = 0; i < steps.size(); ++i)
+		{
+			const Step& step = m_steps[steps[i]];
+			const Convolution::Image& input = (step.input == SOURCE) ? source : *context.results[step.input];
+			const Convolution::Image& original = (step.original == SOURCE) ? source : *context.results[step.original];
+			uint32_t filterSize = (step.operation == Step::Operation::Filter) ? m_filters.at(step.filter)->size : 1;
+			context.results[steps[i]] = AcquireBuffer(context, ResultBytes(step, input, original, filterSize));
+		}
+
+		//
+		// Independent steps run side by side and share the threads
+		uint32_t stepThreads = (threadCount > steps.size()) ? threadCount / steps.size() : 1;
+		Convolution::ParallelFor(steps.size(), 1, threadCount, [&](uint32_t begin, uint32_t end)
+		{
+			for(uint32_t i = begin; i < end; ++i)
+			{
+				Execute(m_steps[steps[i]], steps[i], source, context, stepThreads, errors[steps[i]]);
+			}
+		});
+		for(uint32_t i = 0; i < steps.size(); ++i)
+		{
+			if(!errors[steps[i]].empty())
+			{
+				error = "step \"" + m_steps[steps[i]].name + "\": " + errors[steps[i]];
+				return false;
+			}
+		}
+
+		//
+		// Buffers whose last consumer belongs to this level can be used by the next ones
+		for(uint32_t i = 0; i < m_steps.size(); ++i)
+		{
+			if(!m_steps[i].output && m_steps[i].lastUse == level && context.results[i] != nullptr)
+			{
+				context.free.push_back(context.results[i]);
+				context.results[i] = nullptr;
+			}
+		}
+	}
+	return true;
+}
+
+const std::string& Pipeline::Name(void) const
+{
+	return m_name;
+}
+
+const std::vector<Pipeline::Step>& Pipeline::Steps(void) const
+{
+	return m_steps;
+}
+
+bool Pipeline::Plan(const std::map<std::string, Convolution::Filter>& filters, QString& error)
+{
+	for(uint32_t i = 0; i < m_steps.size(); ++i)
+	{
+		Step& step = m_steps[i];
+		if(step.operation == Step::Operation::Filter && m_filters.count(step.filter) == 0)
+		{
+			std::map<std::string, Convolution::Filter>::const_iterator filter = filters.find(step.filter);
+			if(filter == filters.end())
+			{
+				error = QString("pipeline \"%1\": unknown filter \"%2\"").arg(QString::fromStdString(m_name)).arg(QString::fromStdString(step.filter));
+				return false;
+			}
+			m_filters[step.filter] = new Convolution::CompiledFilter(filter->second);
+		}
+
+		//
+		// Steps only read previous steps, so a single pass gives the level of each step and the last level reading it
+		int inputs[4] = { step.input, step.gradient, step.original, step.orientation };
+		step.level = 0;
+		for(uint32_t k = 0; k < 4; ++k)
+		{
+			if(inputs[k] >= 0 && m_steps[inputs[k]].level + 1 > step.level)
+			{
+				step.level = m_steps[inputs[k]].level + 1;
+			}
+		}
+		for(uint32_t k = 0; k < 4; ++k)
+		{
+			if(inputs[k] >= 0 && m_steps[inputs[k]].lastUse < step.level)
+			{
+				m_steps[inputs[k]].lastUse = step.level;
+			}
+		}
+		step.lastUse = step.level;
+		if(m_levels.size() <= step.level)
+		{
+			m_levels.resize(step.level + 1);
+		}
+		m_levels[step.level].push_back(i);
+	}
+
+	//
+	// Results nothing reads are outputs as well
+	for(uint32_t i = 0; i < m_steps.size(); ++i)
+	{
+		if(m_steps[i].lastUse == m_steps[i].level)
+		{
+			m_steps[i].output = true;
+		}
+	}
+	return true;
+}
+
+bool Pipeline::Execute(const Pipeline::Step& step, uint32_t index, const Convolution::Image& source, Pipeline::Context& context, uint32_t threadCount, std::string& error) const
+{
+	const Convolution::Image& input = (step.input == SOURCE) ? source : *context.results[step.input];
+	Convolution::Image& out = *context.results[index];
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint64_t allocations = Convolution::Pool::ThreadCounters().allocations;
+	switch(step.operation)
+	{
+	case Step::Operation::GrayScale:
+		Convolution::ToGrayScale(input, out);
+		break;
+	case Step::Operation::Filter:
+		Convolution::ApplyFilter(input, *m_filters.at(step.filter), step.sideHandle, out, step.multi, threadCount);
+		break;
+	case Step::Operation::Treshold:
+		Convolution::Treshold(input, step.tresholdMin, step.tresholdMax, out, threadCount);
+		break;
+	case Step::Operation::Canny:
+		Convolution::Canny(input, step.tresholdMin, step.tresholdMax, out, threadCount);
+		break;
+	case Step::Operation::Refine:
+	{
+		const Convolution::Image& gradient = (step.gradient == SOURCE) ? source : *context.results[step.gradient];
+		if(gradient.format != Convolution::Image::Format::Indexed8 || gradient.width != input.width || gradient.height != input.height)
+		{
+			error = "the gradient must be a gray scale image of the same size";
+			return false;
+		}
+		if(step.orientation == NO_STEP)
+		{
+			Convolution::Refine(input, gradient, out);
+			break;
+		}
+		const Convolution::Image& orientation = (step.orientation == SOURCE) ? source : *context.results[step.orientation];
+		if(orientation.format != Convolution::Image::Format::Indexed8 || orientation.width != input.width || orientation.height != input.height)
+		{
+			error = "the orientation must be a gray scale image of the same size";
+			return false;
+		}
+		Convolution::Refine(input, gradient, orientation, out, threadCount);
+		break;
+	}
+	case Step::Operation::CloseContours:
+	{
+		const Convolution::Image& gradient = (step.gradient == SOURCE) ? source : *context.results[step.gradient];
+		if(input.format != Convolution::Image::Format::Indexed8 || gradient.format != Convolution::Image::Format::Indexed8 ||
+		   gradient.width != input.width || gradient.height != input.height)
+		{
+			error = "close needs a gray scale edge image and a gray scale gradient of the same size";
+			return false;
+		}
+		Convolution::Contours contours;
+		Convolution::TraceContours(input, &gradient, contours, step.gap, step.minGradient);
+		out.Resize(input.width, input.height, Convolution::Image::Format::Indexed8);
+		memset(out.pixels, 0, (size_t)input.width * input.height);
+		Convolution::DrawContours(contours, out, 0xffffff);
+		break;
+	}
+	case Step::Operation::Orientation:
+		Convolution::Orientation(input, out, threadCount);
+		break;
+	case Step::Operation::Hough:
+	{
+		const Convolution::Image& original = (step.original == SOURCE) ? source : *context.results[step.original];
+		if(input.format != Convolution::Image::Format::Indexed8)
+		{
+			error = "the input must be a gray scale edge image";
+			return false;
+		}
+		if(step.samples > 0)
+		{
+			context.lines[index].clear();
+			Convolution::ProbabilisticHough(input, original, out, step.alphaPrecision, step.houghTreshold, step.samples, step.lineColor);
+			break;
+		}
+		const Convolution::Image* orientation = nullptr;
+		if(step.orientation != NO_STEP)
+		{
+			orientation = (step.orientation == SOURCE) ? &source : context.results[step.orientation];
+			if(orientation->format != Convolution::Image::Format::Indexed8 || orientation->width != input.width || orientation->height != input.height)
+			{
+				error = "the orientation must be a gray scale image of the same size";
+				return false;
+			}
+		}
+		Convolution::HoughLines(input, context.lines[index], nullptr, step.alphaPrecision, step.houghTreshold, step.maximas, threadCount, orientation, step.angleWindow);
+		out = original;
+		out.Detach();
+		Convolution::DrawHoughLines(context.lines[index], out, step.lineColor);
+		break;
+	}
+	}
+	context.milliseconds[index] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	context.poolAllocations[index] = Convolution::Pool::ThreadCounters().allocations - allocations;
+	return true;
+}
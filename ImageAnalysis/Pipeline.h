@@ -0,0 +1,103 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "Convolution.h"
+
+#include <QString>
+
+#include <map>
+#include <string>
+#include <vector>
+
+class QXmlStreamReader;
+
+//
+// Graph of Convolution operations loaded from the filters definition file.
+// Steps are grouped in levels that only depend on previous levels, the steps of a level run concurrently.
+// Intermediate results are written into buffers recycled as soon as their last consumer has run.
+class Pipeline
+{
+
+public:
+
+	static const int SOURCE = -1;
+
+	struct Step
+	{
+		enum class Operation
+		{
+			GrayScale,
+			Filter,
+			Treshold,
+			Canny,
+			Refine,
+			CloseContours,
+			Orientation,
+			Hough
+		};
+
+		std::string							name;
+		Operation							operation;
+		int									input;			// Index of the step providing the input, SOURCE for the processed image
+		int									gradient;		// Refine and CloseContours
+		int									original;		// Hough, image the lines are drawn on
+		int									orientation;	// Refine, orientation plane of the suppression along the gradient direction, and Hough
+		std::string							filter;
+		bool								multi;
+		Convolution::Filter::SideHandle		sideHandle;
+		int									tresholdMin;	// Treshold and Canny
+		int									tresholdMax;
+		int									alphaPrecision;
+		int									houghTreshold;
+		int									maximas;
+		int									lineColor;
+		int									angleWindow;	// Hough, used with an orientation plane
+		int									samples;		// Hough, pixels voting in the probabilistic transformation, 0 for the standard one
+		int									gap;			// CloseContours, longest gap closed
+		int									minGradient;	// CloseContours, weakest gradient a closure goes through
+		bool								output;			// Result kept after the run
+		uint32_t							level;
+		uint32_t							lastUse;		// Level after which the result is not needed anymore
+	};
+
+	//
+	// State of a run, kept between runs so that buffers are reused from one image to the next.
+	// A context must not be shared by concurrent runs.
+	struct Context
+	{
+		Context		(void);
+		~Context	(void);
+
+		std::vector<Convolution::Image*>	results;		// By step, null once recycled
+		std::vector<Convolution::Image*>	free;
+		std::vector<double>					milliseconds;	// By step
+		std::vector<uint64_t>				poolAllocations;// By step, buffers the step could not get from the pool
+		std::vector<std::vector<Convolution::HoughLine> >	lines;	// By step, lines found by the Hough steps
+		uint32_t							allocations;
+	};
+
+	explicit	Pipeline	(const std::string& name);
+	virtual		~Pipeline	(void);
+
+	static bool	Load		(const QString& file, std::map<std::string, Convolution::Filter>& filters, std::map<std::string, Pipeline*>& pipelines, QString& error);
+
+	bool		Run			(const Convolution::Image& source, Context& context, uint32_t threadCount, std::string& error) const;
+
+	const std::string&			Name	(void) const;
+	const std::vector<Step>&	Steps	(void) const;
+
+private:
+
+	static Pipeline*	Read	(QXmlStreamReader& xml, QString& error);
+
+	bool		Plan		(const std::map<std::string, Convolution::Filter>& filters, QString& error);
+	bool		Execute		(const Step& step, uint32_t index, const Convolution::Image& source, Context& context, uint32_t threadCount, std::string& error) const;
+
+	std::string										m_name;
+	std::vector<Step>								m_steps;
+	std::vector<std::vector<uint32_t> >				m_levels;
+	std::map<std::string, Convolution::CompiledFilter*>	m_filters;
+
+};
+
+#endif // PIPELINE_H
@@ -1,12 +1,24 @@
 #include "TresholdBox.h"
 #include "ui_TresholdBox.h"
 
+#include <QPainter>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+//
+// Height in pixels of the histogram drawing, one column per gray level
+const int HISTOGRAM_HEIGHT = 80;
+
 TresholdBox::TresholdBox(QWidget *parent, bool simple)
 	: QDialog(parent)
 	, m_ui(new Ui::TresholdBox)
+	, m_simple(simple)
 	, m_validated(false)
 	, m_min(0)
 	, m_max(255)
+	, m_hasHistogram(false)
 {
 	m_ui->setupUi(this);
 
@@ -52,18 +64,39 @@ int TresholdBox::GetMax(void) const
 	return m_max;
 }
 
+//
+// Gray level counts of the image to treshold, drawn above the sliders
+void TresholdBox::SetHistogram(const uint32_t histogram[256])
+{
+	memcpy(m_histogram, histogram, sizeof(m_histogram));
+	m_hasHistogram = true;
+	DrawHistogram();
+}
+
 void TresholdBox::SetMin(int value)
 {
+	bool changed = (value != m_min);
+	m_min = value;
 	m_ui->slide_min->setValue(value);
 	m_ui->spin_min->setValue(value);
-	m_min = value;
+	if(changed)
+	{
+		DrawHistogram();
+		emit Changed(m_min, m_simple ? m_min : m_max);
+	}
 }
 
 void TresholdBox::SetMax(int value)
 {
+	bool changed = (value != m_max);
+	m_max = value;
 	m_ui->slide_max->setValue(value);
 	m_ui->spin_max->setValue(value);
-	m_max = value;
+	if(changed)
+	{
+		DrawHistogram();
+		emit Changed(m_min, m_max);
+	}
 }
 
 void TresholdBox::OnValidate(void)
@@ -77,3 +110,42 @@ void TresholdBox::OnCancel(void)
 	m_validated = false;
 	close();
 }
+
+//
+// Logarithmic bars colored by the class the levels fall in: black, kept by hysteresis, or white
+void TresholdBox::DrawHistogram(void)
+{
+	if(!m_hasHistogram)
+	{
+		return;
+	}
+	int tresholdMax = m_simple ? m_min : m_max;
+	uint32_t highest = *std::max_element(m_histogram, m_histogram + 256);
+	double scale = (highest > 0) ? (HISTOGRAM_HEIGHT - 1) / log(1.0 + highest) : 0.0;
+
+	QImage image(256, HISTOGRAM_HEIGHT, QImage::Format_RGB32);
+	image.fill(Qt::white);
+	QPainter painter(&image);
+	for(int i = 0; i < 256; ++i)
+	{
+		if(i <= m_min)
+		{
+			painter.setPen(Qt::black);
+		}
+		else if(i > tresholdMax)
+		{
+			painter.setPen(Qt::gray);
+		}
+		else
+		{
+			painter.setPen(Qt::darkYellow);
+		}
+		int height = (int)(log(1.0 + m_histogram[i]) * scale);
+		if(height > 0)
+		{
+			painter.drawLine(i, HISTOGRAM_HEIGHT - 1, i, HISTOGRAM_HEIGHT - height);
+		}
+	}
+	painter.end();
+	m_ui->histogram_label->setPixmap(QPixmap::fromImage(image));
+}
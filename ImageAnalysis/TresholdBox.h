@@ -3,6 +3,8 @@
 
 #include <QDialog>
 
+#include <cstdint>
+
 namespace Ui {
 class TresholdBox;
 }
@@ -18,6 +20,7 @@ public:
 	bool		IsValidated	(void) const;
 	int			GetMin		(void) const;
 	int			GetMax		(void) const;
+	void		SetHistogram(const uint32_t histogram[256]);
 
 public slots:
 
@@ -27,12 +30,23 @@ public slots:
 	void OnValidate(void);
 	void OnCancel(void);
 
+signals:
+
+	//
+	// Emitted while the values are being tuned, the simple threshold gives its value as both bounds
+	void Changed(int tresholdMin, int tresholdMax);
+
 private:
 
+	void		DrawHistogram(void);
+
 	Ui::TresholdBox*	m_ui;
+	bool				m_simple;
 	bool				m_validated;
 	int					m_min;
 	int					m_max;
+	uint32_t			m_histogram[256];
+	bool				m_hasHistogram;
 
 };
 
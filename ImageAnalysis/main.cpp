@@ -1,29 +1,31 @@
 #include "MainWindow.h"
 #include <QApplication>
 
-#include "Convolution.h"
-#include <QImage>
+#include "Batch.h"
 
 int main(int argc, char *argv[])
 {
-
-	/*Convolution::Image* img = Convolution::LoadImage("Data/g");
-	Convolution::Filter filter = { 3, nullptr, 6 };
-	filter.kernel = new double[9];
-	filter.kernel[0] = filter.kernel[2] = filter.kernel[6] = filter.kernel[8] = 0.0;
-	filter.kernel[1] = filter.kernel[3] = filter.kernel[5] = filter.kernel[7] = -1.0;
-	filter.kernel[4] = 4;
-
-	Convolution::Image* out = Convolution::ApplyFilter(*img, filter, Convolution::Filter::SideHandle::Continuous);
-
-	Convolution::SaveImage(*out, "Out/base_tower.png");
-
-	delete [] filter.kernel;
-	delete out;
-	delete img;*/
+	//
+	// Batch mode runs without a display server
+	if(Batch::IsRequested(argc, argv))
+	{
+		QCoreApplication a(argc, argv);
+		Batch batch;
+		if(!batch.Parse(a.arguments()))
+		{
+			Batch::Usage();
+			return 2;
+		}
+		return batch.Run();
+	}
 
 	QApplication a(argc, argv);
 	MainWindow w;
+	int budget = a.arguments().indexOf("--history-budget");
+	if(budget >= 0 && budget + 1 < a.arguments().size())
+	{
+		w.SetHistoryBudget(a.arguments()[budget + 1].toULongLong() * 1024 * 1024);
+	}
 	w.show();
 
 	return a.exec();